@@ -19,24 +19,68 @@
 #define _BSD_SOURCE
 #define _GNU_SOURCE
 
+#include <dirent.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <ctype.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 /*** defines ***/
 
 #define MACHO_VERSION "0.0.1"
 #define MACHO_TAB_STOP 8
 #define MACHO_QUIT_NUM_TIMES 3
+#define MACHO_HL_NEARBY 1024        // rows around the viewport highlighted before the rest.
+#define MACHO_HL_BATCH 256          // background rows handed to the worker at a time.
+#define MACHO_HL_SCAN 16384         // rows the background sweep looks at per frame.
+#define MACHO_JOURNAL_SYNC_MS 1000  // longest a journaled edit waits for fdatasync.
+#define MACHO_JOURNAL_FLUSH 65536   // journal bytes buffered before they are written.
+#define MACHO_UNDO_LIMIT (1 << 20)  // undo records kept before the oldest are dropped.
+#define MACHO_COLD_ROWS 65536       // files with fewer rows are kept resident.
+#define MACHO_COLD_AGE 5            // seconds a row stays resident after it was last used.
+#define MACHO_COLD_BLOCK 65536      // bytes of rows packed into one compressed block.
+#define MACHO_COLD_RUN 16           // fewest adjacent rows worth packing.
+#define MACHO_CLIP_PACK 4096        // fewest rows a clip packs, in files that cool.
+#define MACHO_COLD_SCAN 262144      // rows the cooling sweep looks at per pass.
+#define MACHO_COLD_TICK_MS 100      // pause between cooling passes while there is work left.
+#define MACHO_PULL_BLOCKS 16        // blocks still in the file read in per pass once the buffer is edited.
+#define MACHO_DISK_BLOCK 1024       // average lines per checksummed block of the file on disk.
+#define MACHO_DISK_SETTLE_MS 100    // wait after a change on disk for the writer to finish.
+#define MACHO_CACHE_SAMPLES 16     // pages of the file hashed to tell it is the one cached.
+#define MACHO_COMPRESS_CHUNK (1 << 20) // bytes compressed at a time, one zstd frame each.
+#define MACHO_STREAM_BATCH (1 << 20)    // bytes read from a pipe before the screen is redrawn.
+#define MACHO_VIEW_WINDOW 4096      // rows kept in memory in view mode.
+#define MACHO_VIEW_CHECKPOINT 4096  // lines between offsets kept in the view mode index.
+#define MACHO_VIEW_CHUNK (1 << 20)  // bytes read at a time when going through the file.
+#define MACHO_LINES_PART 65536      // fewest lines a thread is given to sort or filter.
+#define MACHO_CHUNK_ROWS 64         // rows a leaf of the row trees is cut to, it may grow to twice that.
+#define MACHO_MATCH_CACHE 4096     // rows whose search matches are remembered.
+#define MACHO_INTERN_SLOTS 1024     // slots the table of shared lines starts with.
+#define MACHO_DIFF_COST 1024        // edits the diff looks for in a range before calling it all changed.
+#define MACHO_FRAME_MS 16           // shortest time between frames, about 60 a second.
+#define MACHO_FRAME_LATE_MS 100     // a frame this late is drawn even with keys waiting.
+#define MACHO_FRAME_STALL_MS 250    // longest a frame waits for the terminal to catch up.
 #define CTRL_KEY(k) ((k) & 0x1f)
 
 // constants definition of editor keys.
@@ -63,28 +107,200 @@ enum editorHighlight {
     HL_MATCH
 };
 
+// state carried over from the end of one row to the start of the next.
+enum editorHighlightState {
+    HL_STATE_NORMAL,
+    HL_STATE_COMMENT,
+    HL_STATE_COUNT
+};
+
+// edit operations recorded in the journal.
+enum editorEdit {
+    EDIT_INSERT_ROW = 1,
+    EDIT_DELETE_ROW,
+    EDIT_INSERT_CHAR,
+    EDIT_DELETE_CHAR,
+    EDIT_APPEND_STRING,
+    EDIT_TRUNCATE_ROW,
+    EDIT_SET_ROW,
+    EDIT_PERMUTE_ROWS,
+    EDIT_DELETE_ROWS,
+    EDIT_INSERT_ROWS
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
 /*** variables ***/
 
+struct editorLexer;
+
 struct editorSyntax {
     char *fileType;
     char **fileMatch;
     char **keywords;
     char *singleLineCommentStart;
+    char *multiLineCommentStart;
+    char *multiLineCommentEnd;
+    char *stringQuotes;     // characters that open and close a string.
     int flags;
+    struct editorLexer *lexer;  // compiled when the syntax is first selected.
+};
+
+// brackets of one kind a stretch of text leaves unmatched: closing ones at
+// its start and opening ones at its end.
+struct bracketCount {
+    int close;
+    int open;
+};
+
+// counts for (), [] and {}.
+struct bracketNode {
+    struct bracketCount kind[3];
+};
+
+struct coldBlock;
+struct seekFrame;
+
+// how a row differs from the file on disk.
+enum editorDiffMark {
+    DIFF_ADDED = 1,
+    DIFF_CHANGED = 2,
+    DIFF_REMOVED = 4        // lines of the file were removed above the row.
+};
+
+struct internLine;
+
+enum editorCompression {
+    COMPRESS_NONE = 0,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD
 };
 
 // structure to store the editor text.
 typedef struct editorRow {
     int size;
-    int rsize;
+    int rsize;      // both sizes stay valid while the row is cold.
     char *chars;
     char *render;
     unsigned char *highlight;
+    unsigned int hlSerial;  // version of the row contents, bumped on every update.
+    unsigned int hlDone;    // version the highlight was computed for.
+    unsigned int hlTicket;  // ticket of the highlight job in flight, 0 if none.
+    unsigned char hlStartState;     // state the highlight was computed from.
+    unsigned char hlEndState;       // state carried over to the next row.
+    unsigned char interned; // chars are those of a shared internLine, see editorRowLine.
+    struct coldBlock *cold; // block holding chars and highlight, NULL if resident.
+    unsigned int coldAt;    // offset of the row in the unpacked block.
+    unsigned int seen;      // coldClock when the row was last used.
+    struct bracketNode brackets;    // outside strings and comments, as of the last highlight.
+    int *wrap;              // where render breaks onto the next screen line, wrapLines - 1 of them.
+    int wrapLines;          // screen lines the row takes when wrapped, 0 if not counted yet.
+    unsigned int hashSerial;    // version of the row hash was taken of.
+    uint64_t hash;          // of chars, compared with the lines on disk by the diff.
 } editorRow;
 
+// the text of identical rows, held once. it never changes: a row gets a copy
+// of its own before it is edited. the colors are shared by the rows that are
+// highlighted from the state they were computed from.
+struct internLine {
+    int refs;
+    int size;
+    int rsize;
+    uint64_t hash;          // fnv1a of chars, as the diff hashes rows.
+    char *render;           // chars itself when there are no tabs.
+    unsigned char *highlight;
+    struct editorSyntax *hlSyntax;  // syntax the colors are of.
+    unsigned char hlValid;  // the colors were computed, they are blank until then.
+    unsigned char hlStartState;
+    unsigned char hlEndState;
+    struct bracketNode brackets;
+    char chars[];
+};
+
+// the hash is kept next to the line, so going along the slots only looks at
+// the lines whose hash matches.
+struct internSlot {
+    uint64_t hash;
+    struct internLine *line;    // NULL for an empty slot.
+};
+
+// a line held by the clipboard or an undo record. a line that was packed
+// shares the block of the row it came from, any other shares an interned
+// line, which an edited row's text is first interned into.
+struct clipLine {
+    struct coldBlock *cold;
+    struct internLine *intern;
+    char *chars;            // the line, if it is not in a block.
+    unsigned int coldAt;
+    int size;
+    int rsize;
+    unsigned char startState;
+    unsigned char endState;
+    struct bracketNode brackets;
+};
+
+struct editorClip {
+    int refs;
+    int count;
+    struct clipLine *line;
+};
+
+// the inverse of an edit, in the terms of the journal.
+struct undoRecord {
+    int group;      // records undone together share a group.
+    int op;
+    int row;
+    int at;
+    int len;
+    char *data;
+    struct editorClip *clip;    // rows to put back, for EDIT_INSERT_ROWS.
+};
+
+// where the search query shows up in the render of a row. a row gets a new
+// version on every change, so an entry is only used for the version it was
+// made for.
+struct matchCacheEntry {
+    unsigned int serial;    // row version, 0 for an unused entry.
+    int count;
+    int cap;
+    int *at;
+};
+
+// rows (start, end] are hidden, start stays in sight.
+struct editorFold {
+    int start;
+    int end;
+};
+
+// a cursor besides the primary one in E.cx and E.cy.
+struct editorCursor {
+    int cy;
+    int cx;
+};
+
+// the file as it was last read or written, cut into checksummed blocks. a
+// block ends after a line whose own hash picks it, so a change on disk only
+// alters the blocks it falls in and the rest still line up.
+struct diskBlock {
+    int rows;
+    long long len;
+    uint64_t hash;
+};
+
+struct editorDisk {
+    int known;          // whether this describes the file, unset for a new one.
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct diskBlock *block;
+    int numBlocks;
+    int blockCap;
+    int sealed;         // the last block takes no more lines.
+    long long tailLen;  // length of the last line if it has no newline, else 0.
+};
+
 // structure for the editor's configuration.
 struct editorConfig {
     int cx;     // cursor x position
@@ -95,16 +311,129 @@ struct editorConfig {
     int screenRows;     // terminal's number of rows.
     int screenColumns;  // terminal's number of columns.
     int numRows;        // number of rows of the text to be written.
+    int rowCap;         // rows allocated, grown geometrically.
     editorRow *row;      // stores the text and the size of the text of each line.
     int dirty;      // tracks if any changes has been made to the file since it has been opened.
     char *fileName;     // stores the name of the current open file.
     char statusMsg[80];     //stores the status message.
     time_t statusMsgTime;   //stores the time at which the status message was written.
     struct editorSyntax *syntax;
+    unsigned int hlSerial;  // last row version handed out.
+    unsigned int hlTicket;  // last highlight job ticket handed out.
+    unsigned int hlEpoch;   // ticket at the last row shift, older jobs are orphaned.
+    int hlPending;          // rows whose highlight is out of date.
+    int hlSweep;            // next row the background sweep looks at.
+    int journalFd;          // append-only log of edits since the last save, -1 if none.
+    char *journalBuf;       // records not written yet.
+    int journalLen;
+    int journalCap;
+    long long journalSyncAt;    // when written records get synced, 0 if all are.
+    int journalSuspended;   // set while loading or replaying, when edits aren't new.
+    struct undoRecord *undo;    // inverses of the edits made, oldest first.
+    int undoLen;
+    int undoCap;
+    int undoGroup;          // group the edits being made now belong to.
+    int undoSuspended;      // set while loading, replaying or undoing.
+    int undoLost;           // group too large to undo, its edits aren't recorded.
+    int undoTyping;         // the last keypress typed a character at undoTypingRow/Col.
+    int undoTypingRow;
+    int undoTypingCol;
+    unsigned int coldClock;     // seconds, advanced while waiting for input.
+    int coldSweep;          // next row the cooling sweep looks at.
+    int coldLapPacked;      // rows packed since the sweep last wrapped around.
+    long long coldNextAt;   // when the next cooling pass is due.
+    int coldHold;           // set while rows may be referenced across a keypress.
+    struct coldBlock *coldCache;    // block whose unpacked bytes are in coldPlain.
+    unsigned char *coldPlain;
+    int coldPlainCap;
+    struct editorDisk disk;
+    int watchFd;            // inotify descriptor, -1 if not watching.
+    int watchFile;          // watch on the file itself.
+    int watchDir;           // watch on its directory, for files renamed over it.
+    int diskConflict;       // 1 once the file changed under unsaved edits, 2 once warned on save.
+    long long diskCheckAt;  // when to look at the file after it changed, 0 if not due.
+    int follow;             // keep the cursor on the last row as rows are added.
+    int streamFd;           // pipe still being read, -1 if none.
+    int streamed;           // the text came from standard input.
+    char *streamBuf;        // read from the pipe, up to an unfinished line.
+    int streamLen;
+    int streamCap;
+    int view;               // read only, with only a window of the file in rows.
+    int viewFd;
+    long long viewBase;     // line of the file in the first row.
+    int viewAtEnd;          // the last row is the last line of the file.
+    long long viewLines;    // lines in the file, -1 until it was read to the end.
+    off_t *viewIndex;       // offset of every MACHO_VIEW_CHECKPOINT-th line seen so far.
+    int viewIndexLen;
+    int viewIndexCap;
+    char *viewBuf;          // MACHO_VIEW_CHUNK bytes read from the file.
+    int viewSearchCut;      // the last search stopped early for a key.
+    struct editorCursor *cursor;    // extra cursors, sorted by position.
+    int numCursors;
+    int cursorCap;
+    int headless;           // run from a script, with no terminal.
+    int frameWanted;        // the screen is out of date.
+    char *matchQuery;       // search shown on screen, NULL if none.
+    int matchQueryLen;
+    struct matchCacheEntry *matchCache;     // MACHO_MATCH_CACHE entries, by row version.
+    int *chunkTree;         // rows in each chunk at chunkSize and up, sums above.
+    int chunkSize;          // leaves in the row trees, a power of two.
+    int numChunks;          // leaves with rows in them.
+    int *chunkDirty;        // chunks whose sums in the trees are out of date.
+    int numChunkDirty;
+    int chunkDirtyCap;
+    unsigned char *chunkMarked; // whether each chunk is in chunkDirty.
+    struct bracketNode *bracketTree;    // brackets of the chunks, NULL until it is needed.
+    int bracketRow;         // bracket matching the one at the cursor, -1 if none.
+    int bracketRx;
+    struct editorClip *clip;    // the clipboard, NULL if empty.
+    int wrap;               // long rows go on over further screen lines.
+    int wrapWidth;          // columns the rows were wrapped at.
+    int *wrapTree;          // screen lines of the chunks, NULL until it is needed.
+    int wrapOffset;         // screen lines of the top row scrolled past.
+    long long *byteTree;    // bytes of the chunks, NULL until it is needed.
+    int lineNumbers;        // the gutter shows line numbers.
+    struct editorFold *fold;    // folded blocks, sorted and apart.
+    int numFolds;
+    int foldCap;
+    int fileFd;             // the file as it was opened, for rows still read from it, -1 if none.
+    int fileBlocks;         // blocks of rows still in the file.
+    struct coldBlock **fileBlock;   // those blocks, NULL where one was freed or read in.
+    int fileBlockLen;
+    int fileBlockCap;
+    int filePulled;         // slots of fileBlock before this one are all NULL.
+    int fileLost;           // rows read back from the file had changed, so saving is refused.
+    int cacheFresh;         // rows came from the file cache and match it.
+    int cacheHlFrom;        // first row of it still to be highlighted.
+    int compress;           // how the file is compressed, COMPRESS_NONE if it isn't.
+    struct seekFrame *viewFrame;    // frames of a seekable .zst in view mode, NULL otherwise.
+    int viewFrames;
+    int viewFrameAt;        // frame unpacked in viewFrameBuf, -1 if none.
+    char *viewFrameBuf;
+    int markRow;            // where the selected rows start or end, -1 if none.
+    int gutter;             // columns left of the text.
+    int diff;               // rows are marked where they differ from the file on disk.
+    unsigned char *diffMark;    // DIFF_* flags of every row, and one past the last.
+    uint64_t *diffRow;      // hash of every row as of the last diff.
+    int diffRows;
+    int diffRowCap;
+    int diffFrom;           // rows edited since, all but the first diffFrom and the
+    int diffAfter;          // last diffAfter. INT_MAX if none were.
+    struct editorDisk diffDisk; // the file the lines in diffLine were hashed from.
+    uint64_t *diffLine;     // hash of every line of the file on disk.
+    int diffLines;
+    int diffAdded;          // rows added, changed and lines removed since the file on disk.
+    int diffChanged;
+    int diffRemoved;
+    struct internSlot *internSlot;  // hash table of shared lines, probed linearly.
+    int internCap;          // slots, a power of two, at most 3/4 used.
+    int internCount;        // lines in the table.
+    long long frameAt;      // when the last frame was drawn.
     struct termios origTermios;     // struct to store the default (initial) config of the terminal.
 };
 
-struct editorConfig E;
+// each thread running a script over a file has its own.
+__thread struct editorConfig E;
 
 /*** filetypes ***/
 
@@ -113,23 +442,120 @@ char *C_HL_keywords[] = {
     "switch", "if", "while", "for", "break", "continue", "return", "else", "struct", "union", "typedef", "static", "enum", "class", "case", "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|", "void", NULL
 };
 
+// built in definitions, used when no definition file matches.
 struct editorSyntax HLDB[] = {
     {
         "c",
         C_HL_extensions,
         C_HL_keywords,
-        "//",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        "//", "/*", "*/",
+        "\"'",
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     },
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+// definitions loaded from *.syntax files at startup.
+struct editorSyntax *syntaxDefs = NULL;
+int syntaxDefCount = 0;
+
 /*** function prototypes ***/
 
 void setEditorStatusMessage(const char *message, ...);
 void refreshEditorScreen();
+int editorRowCxToRx(editorRow *row, int cx);
+int editorRowRxToCx(editorRow *row, int rx);
+void summarizeEditorRowBrackets(int at);
+void setEditorRowBrackets(int at, const struct bracketNode *sum);
+char *renderEditorChars(const char *chars, int size, int *rsize);
+void shareEditorRow(editorRow *row, const char *s, int len);
+void ownEditorRow(editorRow *row);
+struct internLine *editorRowLine(editorRow *row);
+void releaseEditorLine(struct internLine *line);
+void freeEditorRowText(editorRow *row);
+void dropEditorRowHighlight(editorRow *row);
+unsigned char *ownEditorRowHighlight(editorRow *row);
+int isEditorLineHighlighted(editorRow *row, int start);
+void useEditorLineHighlight(int at);
+void keepEditorLineHighlight(int at);
+void markEditorRowChunk(int at);
+void markEditorDiff(int at, int lines);
+void spliceEditorFolds(int at, int removed, int lines);
+int isEditorRowHidden(int at);
+int nextEditorVisibleRow(int at);
+int prevEditorVisibleRow(int at);
+void revealEditorRow(int at);
+int editorBottomRow();
+int findEditorBracketRow(int row, int kind, int forward, int *need);
+void showEditorViewLine(long long line);
+void goEditorLine(long long line);
+int goEditorOffset(long long offset);
+void editorGoto();
+long long editorViewLineAt(off_t offset, off_t *lineStart);
+void wrapEditorRow(editorRow *row);
+void addBracketNode(struct bracketNode *a, const struct bracketNode *b);
+void sumEditorBracketChunk(int first, int rows, struct bracketNode *sum);
+int sumEditorWrapChunk(int first, int rows);
+long long sumEditorByteChunk(int first, int rows);
+void requestEditorFrame();
+int editorFrameWait(long long now);
+void drawEditorFrame();
+int isEditorKeyPending();
+void updateEditorSyntax(editorRow *row);
+void waitEditorInput();
+void recordEditorEdit(int op, int row, int at, const char *data, int len);
+void journalEditorEdit(int op, int row, int at, const char *data, int len);
+void flushEditorJournal();
+void removeEditorJournal();
+void recoverEditorJournal();
+void pushEditorUndo(int op, int row, int at, const char *data, int len);
+char *copyEditorBytes(const char *s, int len);
+struct editorClip *makeEditorClip(int at, int count);
+void releaseEditorClip(struct editorClip *clip);
+int pasteEditorClip(int at, struct editorClip *clip);
+void delEditorRows(int at, int count);
+editorRow *getEditorRow(int at);
+void thawEditorRow(editorRow *row);
+char *peekEditorRow(editorRow *row);
+char *peekEditorRowRender(editorRow *row);
+void releaseColdBlock(struct coldBlock *block);
+void readEditorFileBlock(struct coldBlock *block, unsigned char *plain);
+void dropEditorFileBlock(struct coldBlock *block);
+int pullEditorFileBlocks();
+int loadEditorCache(char *fileName);
+void saveEditorCache();
+struct bracketNode *getEditorRowBrackets(int at);
+long long editorNowMs();
+int editorTextColumns();
+void rewrapEditorRows();
+void updateEditorGutter();
+void refreshEditorDiff();
+void toggleEditorDiff();
+uint64_t fnv1a(uint64_t h, const void *data, size_t len);
+void resetEditorDisk(struct editorDisk *d);
+void addEditorDiskLine(struct editorDisk *d, const char *line, long long len);
+void addEditorDiskRow(struct editorDisk *d, const char *chars, int size);
+void addEditorDiskText(struct editorDisk *d, const char *text, long long len, int newline);
+char *readEditorDisk(int fd, off_t offset, long long len);
+void scanEditorDisk(struct editorDisk *d, const char *buf, long long len);
+void statEditorDisk(struct editorDisk *d, struct stat *st);
+void watchEditorFile();
+int checkEditorDisk();
+void clearEditorUndo();
+int isEditorReadOnly();
+void clearEditorCursors();
+void moveEditorCursor(int key);
+void initEditor();
+void freeEditor();
+void saveEditor();
+int readEditorFile(char *fileName);
+void editorReplaceAll(char *query, char *with);
+int isEditorPermutation(const int32_t *perm, int count);
+void permuteEditorRows(int at, int count, const int32_t *perm);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPromptInput(char *prompt, void (*callback)(char *, int), int allowEmpty);
 
 /*** terminal ***/
 
@@ -173,7 +599,12 @@ int readEditorKey() {
     int nread;
     char c;
 
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+    while (1) {
+        waitEditorInput();
+
+        if ((nread = read(STDIN_FILENO, &c, 1)) == 1) {
+            break;
+        }
         if (nread == -1 && errno != EAGAIN) {
             die("read error");
         }
@@ -287,579 +718,8289 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
-/*** syntax highlighting ***/
+/*** lexer ***/
+
+/* A syntax is compiled into a table driven state machine. For every state and
+ * class of input byte a cell tells the color of the byte, the next state, and
+ * how many of the preceding bytes to repaint: a keyword is only known to be
+ * one once the separator after it is seen, and a comment delimiter once its
+ * last byte is seen.
+ *
+ * The states are found by running the reference semantics below (lexStep)
+ * from the start states over every byte value until no new configuration
+ * turns up. Bytes that behave the same in every state share a class.
+ */
+
+#define LEX_VERSION 1
+#define LEX_MAX_STATES 65535
+#define LEX_MAX_DELIMITER 16
+#define LEX_MAX_KEYWORD 255
 
 int isSeparator(int c) {
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void updateEditorSyntax(editorRow *row) {
-    row->highlight = (unsigned char *)realloc(row->highlight, row->rsize);
-    memset(row->highlight, HL_NORMAL, row->rsize);
-
-    if (E.syntax == NULL) {
-        return;
-    }
+#define LEX_CELL(next, emit, paint, paintHl) ((uint32_t)(next) | ((uint32_t)(emit) << 16) | ((uint32_t)(paintHl) << 20) | ((uint32_t)(paint) << 24))
+#define LEX_NEXT(cell) ((cell) & 0xffff)
+#define LEX_EMIT(cell) (((cell) >> 16) & 0xf)
+#define LEX_PAINT_HL(cell) (((cell) >> 20) & 0xf)
+#define LEX_PAINT(cell) ((cell) >> 24)
+
+struct editorLexer {
+    int numStates;
+    int numClasses;
+    int start[HL_STATE_COUNT];      // state a row starts in, per carried state.
+    unsigned char classOf[256];
+    uint32_t *cells;                // numStates * numClasses.
+    unsigned char *eolPaint;        // per state: bytes to repaint at the end of the row.
+    unsigned char *eolPaintHl;
+    unsigned char *eolCarry;        // per state: state carried over to the next row.
+};
 
-    char **keywords = E.syntax->keywords;
+enum lexMode {
+    LEX_NORMAL,
+    LEX_STRING,
+    LEX_LINE_COMMENT,
+    LEX_BLOCK_COMMENT
+};
 
-    char *scs = E.syntax->singleLineCommentStart;
-    int scsLen = scs ? strlen(scs) : 0;
+// a configuration of the reference lexer, packed into 64 bits so it can be
+// hashed while the states are enumerated.
+struct lexConf {
+    int mode;
+    int quote;      // index into stringQuotes while in a string.
+    int escape;     // previous byte was a backslash inside a string.
+    int prevSep;
+    int prevNum;    // previous byte was part of a number.
+    int kw;         // keyword trie node of the current word, -1 if it can't be one.
+    int delim;      // delimiter automaton node.
+};
 
-    int prevSep = 1;
-    int inString = 0;
+struct lexKeywordNode {
+    int child;
+    int sibling;
+    unsigned char c;
+    unsigned char accept;   // HL_KEYWORD1 or HL_KEYWORD2 if a keyword ends here.
+    unsigned char depth;
+};
 
-    int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prevHighlight = (i > 0) ? row->highlight[i - 1] : HL_NORMAL;
+// recognises a handful of short delimiters anywhere in the input. the nodes
+// are all prefixes of the delimiters; delta is the longest prefix that is a
+// suffix of the input seen so far.
+struct lexDelimiters {
+    int count;
+    char prefix[3 * LEX_MAX_DELIMITER + 1][LEX_MAX_DELIMITER + 1];
+    int accept[3 * LEX_MAX_DELIMITER + 1];      // 1 + index of the delimiter ending here, 0 if none.
+    unsigned char delta[3 * LEX_MAX_DELIMITER + 1][256];
+};
 
-        if (scsLen && !inString) {
-            if (!strncmp(&row->render[i], scs, scsLen)) {
-                memset(&row->highlight[i], HL_COMMENT, row->rsize - i);
-                break;
-            }
-        }
+struct lexCompiler {
+    struct editorSyntax *syntax;
+    struct lexKeywordNode *kw;
+    int kwCount;
+    struct lexDelimiters open;      // line comment, block comment start.
+    struct lexDelimiters close;     // block comment end.
+    uint64_t *confs;                // state id -> packed configuration.
+    int numConfs;
+    int *slots;                     // open addressing table of state ids.
+    int slotCap;
+};
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (inString) {
-                row->highlight[i] = HL_STRING;
+uint64_t packLexConf(struct lexConf *c) {
+    return (uint64_t)c->mode | ((uint64_t)c->quote << 2) | ((uint64_t)c->escape << 7) | ((uint64_t)c->prevSep << 8) | ((uint64_t)c->prevNum << 9) | ((uint64_t)c->delim << 10) | ((uint64_t)(c->kw + 1) << 18);
+}
 
-                if (c == '\\' && (i + 1 < row->rsize)) {
-                    row->highlight[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
+void unpackLexConf(uint64_t p, struct lexConf *c) {
+    c->mode = p & 0x3;
+    c->quote = (p >> 2) & 0x1f;
+    c->escape = (p >> 7) & 0x1;
+    c->prevSep = (p >> 8) & 0x1;
+    c->prevNum = (p >> 9) & 0x1;
+    c->delim = (p >> 10) & 0xff;
+    c->kw = (int)(p >> 18) - 1;
+}
 
-                // string ends.
-                if (c == inString) {
-                    inString = 0;
-                }
+void initLexDelimiters(struct lexDelimiters *d, char **delims, int n) {
+    int i, k;
 
-                i++;
-                prevSep = 1;
-                continue;
-            } else {
-                // string starts.
-                if (c == '"' || c == '\'') {
-                    inString = c;
-                    row->highlight[i] = HL_STRING;
+    d->count = 1;
+    d->prefix[0][0] = '\0';
+    d->accept[0] = 0;
 
-                    i++;
-                    continue;
+    for (i = 0; i < n; i++) {
+        if (delims[i] == NULL) {
+            continue;
+        }
+        int len = strlen(delims[i]);
+        for (k = 1; k <= len; k++) {
+            int j;
+            for (j = 0; j < d->count; j++) {
+                if ((int)strlen(d->prefix[j]) == k && !strncmp(d->prefix[j], delims[i], k)) {
+                    break;
                 }
             }
-        }
-
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prevSep || prevHighlight == HL_NUMBER)) || (c == '.' && prevHighlight == HL_NUMBER)) {
-                row->highlight[i] = HL_NUMBER;
-                i++;
-                prevSep = 0;
-                continue;
+            if (j == d->count) {
+                memcpy(d->prefix[j], delims[i], k);
+                d->prefix[j][k] = '\0';
+                d->accept[j] = 0;
+                d->count++;
+            }
+            if (k == len && d->accept[j] == 0) {
+                d->accept[j] = i + 1;
             }
         }
+    }
 
-        if (prevSep) {
-            int j;
-
-            // iterate until there are keywords in the array.
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                // check if the keyword has | in the end to color it different.
-                int kw2 = keywords[j][klen - 1] == '|';
-
-                if (kw2) {
-                    klen--;
+    int node, c;
+    for (node = 0; node < d->count; node++) {
+        for (c = 0; c < 256; c++) {
+            char seen[LEX_MAX_DELIMITER + 2];
+            int len = strlen(d->prefix[node]);
+            memcpy(seen, d->prefix[node], len);
+            seen[len++] = c;
+
+            d->delta[node][c] = 0;
+            for (k = (len < LEX_MAX_DELIMITER ? len : LEX_MAX_DELIMITER); k > 0; k--) {
+                int j;
+                for (j = 1; j < d->count; j++) {
+                    if ((int)strlen(d->prefix[j]) == k && !memcmp(d->prefix[j], &seen[len - k], k)) {
+                        break;
+                    }
                 }
-
-                if (!strncmp(&row->render[i], keywords[j], klen) && isSeparator(row->render[i + klen])) {
-                    memset(&row->highlight[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
+                if (j < d->count) {
+                    d->delta[node][c] = j;
                     break;
                 }
             }
-
-            if (keywords[j] == NULL) {
-                prevSep = 0;
-                continue;
-            }
         }
-
-        prevSep = isSeparator(c);
-        i++;
     }
 }
 
-int editorSyntaxToColor(int highlight) {
-    switch(highlight) {
-        case HL_COMMENT:
-            return 36;
-        case HL_KEYWORD1:
-            return 33;
-        case HL_KEYWORD2:
-            return 32;
-        case HL_STRING:
-            return 35;
-        case HL_NUMBER:
-            return 31;
-        case HL_MATCH:
-            return 34;
-        default:
-            return 37;
+int lexKeywordChild(struct lexCompiler *lc, int node, unsigned char c) {
+    int child;
+    for (child = lc->kw[node].child; child != -1; child = lc->kw[child].sibling) {
+        if (lc->kw[child].c == c) {
+            return child;
+        }
     }
+    return -1;
 }
 
-void editorSelectSyntaxHighlight() {
-    E.syntax = NULL;
-    if (E.fileName == NULL) {
+void addLexKeyword(struct lexCompiler *lc, char *keyword) {
+    int len = strlen(keyword);
+    unsigned char type = HL_KEYWORD1;
+
+    // a trailing | marks a secondary keyword (types).
+    if (len && keyword[len - 1] == '|') {
+        type = HL_KEYWORD2;
+        len--;
+    }
+    if (len == 0 || len > LEX_MAX_KEYWORD) {
         return;
     }
 
-    char *extension = strrchr(E.fileName, '.');
-
-    unsigned int j;
-    for (j = 0; j < HLDB_ENTRIES; j++) {
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
+    int node = 0;
+    int i;
+    for (i = 0; i < len; i++) {
+        unsigned char c = keyword[i];
+        int child = lexKeywordChild(lc, node, c);
+
+        if (child == -1) {
+            child = lc->kwCount++;
+            lc->kw = (struct lexKeywordNode *)realloc(lc->kw, sizeof(struct lexKeywordNode) * lc->kwCount);
+            lc->kw[child].child = -1;
+            lc->kw[child].sibling = lc->kw[node].child;
+            lc->kw[child].c = c;
+            lc->kw[child].accept = 0;
+            lc->kw[child].depth = i + 1;
+            lc->kw[node].child = child;
+        }
+        node = child;
+    }
+    lc->kw[node].accept = type;
+}
 
-        while (s->fileMatch[i]) {
-            int isExtension = (s->fileMatch[i][0] == '.');
+void resetLexConf(struct lexConf *c, int mode) {
+    c->mode = mode;
+    c->quote = 0;
+    c->escape = 0;
+    c->prevSep = 1;
+    c->prevNum = 0;
+    c->kw = (mode == LEX_NORMAL) ? 0 : -1;
+    c->delim = 0;
+}
 
-            if ((isExtension && extension && !strcmp(extension, s->fileMatch[i])) || (!isExtension && strstr(E.fileName, s->fileMatch[i]))) {
-                E.syntax = s;
+// the reference semantics: consumes one byte and reports its color and the
+// bytes before it to repaint.
+uint64_t lexStep(struct lexCompiler *lc, uint64_t packed, unsigned char c, int *emit, int *paint, int *paintHl) {
+    struct editorSyntax *syntax = lc->syntax;
+    struct lexConf conf;
+    unpackLexConf(packed, &conf);
+
+    *emit = HL_NORMAL;
+    *paint = 0;
+    *paintHl = HL_NORMAL;
+
+    if (conf.mode == LEX_STRING) {
+        *emit = HL_STRING;
+        if (conf.escape) {
+            conf.escape = 0;
+        } else if (c == '\\') {
+            conf.escape = 1;
+        } else if (c == (unsigned char)syntax->stringQuotes[conf.quote]) {
+            resetLexConf(&conf, LEX_NORMAL);
+        }
+        return packLexConf(&conf);
+    }
 
-                int fileRow;
-                for (fileRow = 0; fileRow < E.numRows; fileRow++) {
-                    updateEditorSyntax(&E.row[fileRow]);
-                }
+    if (conf.mode == LEX_LINE_COMMENT) {
+        *emit = HL_COMMENT;
+        return packLexConf(&conf);
+    }
 
-                return;
-            }
-            i++;
+    if (conf.mode == LEX_BLOCK_COMMENT) {
+        *emit = HL_COMMENT;
+        conf.delim = lc->close.delta[conf.delim][c];
+        if (lc->close.accept[conf.delim]) {
+            resetLexConf(&conf, LEX_NORMAL);
         }
+        return packLexConf(&conf);
     }
-}
 
-/*** row operations ***/
+    int sep = isSeparator(c);
+    int delim = lc->open.delta[conf.delim][c];
+    int opened = lc->open.accept[delim];
 
-int editorRowCxToRx(editorRow *row, int cx) {
-    int rx = 0;
-    int j;
+    int keyword = (conf.kw >= 0 && sep) ? lc->kw[conf.kw].accept : 0;
+    if (keyword) {
+        *paint = lc->kw[conf.kw].depth;
+        *paintHl = keyword;
+    }
 
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') {
-            rx += (MACHO_TAB_STOP - 1) - (rx % MACHO_TAB_STOP);
+    if (opened) {
+        char *opener = (opened == 1) ? syntax->singleLineCommentStart : syntax->multiLineCommentStart;
+        int len = strlen(opener);
+
+        *emit = HL_COMMENT;
+        if (len > 1) {
+            *paint = len - 1;
+            *paintHl = HL_COMMENT;
         }
-        rx++;
+        resetLexConf(&conf, opened == 1 ? LEX_LINE_COMMENT : LEX_BLOCK_COMMENT);
+        return packLexConf(&conf);
     }
 
-    return rx;
+    char *quote = (syntax->flags & HL_HIGHLIGHT_STRINGS) && c ? strchr(syntax->stringQuotes, c) : NULL;
+    if (quote) {
+        *emit = HL_STRING;
+        resetLexConf(&conf, LEX_STRING);
+        conf.quote = quote - syntax->stringQuotes;
+        return packLexConf(&conf);
+    }
+
+    if ((syntax->flags & HL_HIGHLIGHT_NUMBERS) && ((isdigit(c) && (conf.prevSep || conf.prevNum)) || (c == '.' && conf.prevNum))) {
+        *emit = HL_NUMBER;
+        conf.prevSep = 0;
+        conf.prevNum = 1;
+        conf.kw = -1;
+        conf.delim = delim;
+        return packLexConf(&conf);
+    }
+
+    conf.prevSep = sep;
+    conf.prevNum = 0;
+    conf.kw = sep ? 0 : (conf.kw >= 0 ? lexKeywordChild(lc, conf.kw, c) : -1);
+    conf.delim = delim;
+    return packLexConf(&conf);
 }
 
-int editorRowRxToCx(editorRow *row, int rx) {
-    int curRx = 0;
-    int cx;
+int internLexConf(struct lexCompiler *lc, uint64_t packed) {
+    if (lc->numConfs * 2 >= lc->slotCap) {
+        int cap = lc->slotCap ? lc->slotCap * 2 : 1024;
+        int *slots = (int *)malloc(sizeof(int) * cap);
+        int i;
 
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t') {
-            curRx += (MACHO_TAB_STOP - 1) - (curRx % MACHO_TAB_STOP);
+        for (i = 0; i < cap; i++) {
+            slots[i] = -1;
         }
-        curRx++;
+        for (i = 0; i < lc->numConfs; i++) {
+            uint64_t h = (lc->confs[i] * 0x9e3779b97f4a7c15ULL) >> 20;
+            while (slots[h & (cap - 1)] != -1) {
+                h++;
+            }
+            slots[h & (cap - 1)] = i;
+        }
+        free(lc->slots);
+        lc->slots = slots;
+        lc->slotCap = cap;
+        lc->confs = (uint64_t *)realloc(lc->confs, sizeof(uint64_t) * (cap / 2));
+    }
 
-        if(curRx > rx) {
-            return cx;
+    uint64_t h = (packed * 0x9e3779b97f4a7c15ULL) >> 20;
+    while (lc->slots[h & (lc->slotCap - 1)] != -1) {
+        int id = lc->slots[h & (lc->slotCap - 1)];
+        if (lc->confs[id] == packed) {
+            return id;
         }
+        h++;
     }
-    
-    return cx;
+
+    if (lc->numConfs >= LEX_MAX_STATES) {
+        return -1;
+    }
+    lc->slots[h & (lc->slotCap - 1)] = lc->numConfs;
+    lc->confs[lc->numConfs] = packed;
+    return lc->numConfs++;
 }
 
-void updateEditorRow(editorRow *row) {
-    int tabs = 0;
+void freeEditorLexer(struct editorLexer *lx) {
+    if (lx == NULL) {
+        return;
+    }
+    free(lx->cells);
+    free(lx->eolPaint);
+    free(lx->eolPaintHl);
+    free(lx->eolCarry);
+    free(lx);
+}
+
+struct editorLexer *compileEditorLexer(struct editorSyntax *syntax) {
+    struct lexCompiler lc;
+    memset(&lc, 0, sizeof(lc));
+    lc.syntax = syntax;
+
+    lc.kw = (struct lexKeywordNode *)malloc(sizeof(struct lexKeywordNode));
+    lc.kw[0].child = -1;
+    lc.kw[0].sibling = -1;
+    lc.kw[0].accept = 0;
+    lc.kw[0].depth = 0;
+    lc.kwCount = 1;
+
     int j;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            tabs++;
+    for (j = 0; syntax->keywords && syntax->keywords[j]; j++) {
+        addLexKeyword(&lc, syntax->keywords[j]);
+    }
+
+    char *openers[2] = { syntax->singleLineCommentStart, syntax->multiLineCommentEnd ? syntax->multiLineCommentStart : NULL };
+    char *closers[1] = { syntax->multiLineCommentEnd };
+    for (j = 0; j < 2; j++) {
+        if (openers[j] && (openers[j][0] == '\0' || strlen(openers[j]) > LEX_MAX_DELIMITER)) {
+            openers[j] = NULL;
+        }
+    }
+    if (openers[1] == NULL || strlen(closers[0]) > LEX_MAX_DELIMITER) {
+        openers[1] = closers[0] = NULL;
+    }
+    initLexDelimiters(&lc.open, openers, 2);
+    initLexDelimiters(&lc.close, closers, 1);
+
+    struct lexConf conf;
+    int start[HL_STATE_COUNT];
+    resetLexConf(&conf, LEX_NORMAL);
+    start[HL_STATE_NORMAL] = internLexConf(&lc, packLexConf(&conf));
+    resetLexConf(&conf, LEX_BLOCK_COMMENT);
+    start[HL_STATE_COMMENT] = internLexConf(&lc, packLexConf(&conf));
+
+    uint32_t *full = NULL;
+    int state;
+    int failed = 0;
+
+    for (state = 0; state < lc.numConfs && !failed; state++) {
+        full = (uint32_t *)realloc(full, sizeof(uint32_t) * 256 * (state + 1));
+
+        int c;
+        for (c = 0; c < 256; c++) {
+            int emit, paint, paintHl;
+            uint64_t next = lexStep(&lc, lc.confs[state], c, &emit, &paint, &paintHl);
+            int id = internLexConf(&lc, next);
+
+            if (id == -1) {
+                failed = 1;
+                break;
+            }
+            full[state * 256 + c] = LEX_CELL(id, emit, paint, paintHl);
         }
     }
 
-    free(row->render);
-    row->render = malloc(row->size + (tabs * (MACHO_TAB_STOP - 1)) + 1);
+    struct editorLexer *lx = NULL;
+    if (!failed) {
+        lx = (struct editorLexer *)calloc(1, sizeof(struct editorLexer));
+        lx->numStates = lc.numConfs;
+        memcpy(lx->start, start, sizeof(start));
+
+        // bytes whose columns are identical in every state share a class.
+        int representative[256];
+        int c;
+        for (c = 0; c < 256; c++) {
+            int k;
+            for (k = 0; k < lx->numClasses; k++) {
+                int s;
+                for (s = 0; s < lx->numStates; s++) {
+                    if (full[s * 256 + c] != full[s * 256 + representative[k]]) {
+                        break;
+                    }
+                }
+                if (s == lx->numStates) {
+                    break;
+                }
+            }
+            if (k == lx->numClasses) {
+                representative[lx->numClasses++] = c;
+            }
+            lx->classOf[c] = k;
+        }
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % MACHO_TAB_STOP != 0) {
-                row->render[idx++] = ' ';
+        lx->cells = (uint32_t *)malloc(sizeof(uint32_t) * lx->numStates * lx->numClasses);
+        lx->eolPaint = (unsigned char *)malloc(lx->numStates);
+        lx->eolPaintHl = (unsigned char *)malloc(lx->numStates);
+        lx->eolCarry = (unsigned char *)malloc(lx->numStates);
+
+        int s;
+        for (s = 0; s < lx->numStates; s++) {
+            int k;
+            for (k = 0; k < lx->numClasses; k++) {
+                lx->cells[s * lx->numClasses + k] = full[s * 256 + representative[k]];
             }
-        } else {
-            row->render[idx++] = row->chars[j];
+
+            // the end of the row ends a keyword like a separator does.
+            unpackLexConf(lc.confs[s], &conf);
+            lx->eolPaint[s] = 0;
+            lx->eolPaintHl[s] = HL_NORMAL;
+            if (conf.mode == LEX_NORMAL && conf.kw >= 0 && lc.kw[conf.kw].accept) {
+                lx->eolPaint[s] = lc.kw[conf.kw].depth;
+                lx->eolPaintHl[s] = lc.kw[conf.kw].accept;
+            }
+            lx->eolCarry[s] = (conf.mode == LEX_BLOCK_COMMENT) ? HL_STATE_COMMENT : HL_STATE_NORMAL;
         }
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
 
-    updateEditorSyntax(row);
+    free(full);
+    free(lc.kw);
+    free(lc.confs);
+    free(lc.slots);
+    return lx;
 }
 
-void insertEditorRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numRows) {
-        return;
+/*** lexer cache ***/
+
+uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
     }
+    return h;
+}
 
-    E.row = (editorRow *)realloc(E.row, sizeof(editorRow) * (E.numRows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(editorRow) * (E.numRows - at));
+#define FNV1A_INIT 0xcbf29ce484222325ULL
 
-    E.row[at].size = len;
-    E.row[at].chars = (char *)malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+uint64_t hashEditorSyntax(struct editorSyntax *syntax) {
+    uint64_t h = FNV1A_INIT;
+    int version = LEX_VERSION;
+    int j;
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].highlight = NULL;
-    updateEditorRow(&E.row[at]);
+    h = fnv1a(h, &version, sizeof(version));
+    h = fnv1a(h, &syntax->flags, sizeof(syntax->flags));
+    for (j = 0; syntax->keywords && syntax->keywords[j]; j++) {
+        h = fnv1a(h, syntax->keywords[j], strlen(syntax->keywords[j]) + 1);
+    }
 
-    E.numRows++;
-    E.dirty++;
+    char *fields[4] = { syntax->singleLineCommentStart, syntax->multiLineCommentStart, syntax->multiLineCommentEnd, syntax->stringQuotes };
+    for (j = 0; j < 4; j++) {
+        h = fnv1a(h, "\x01", 1);
+        if (fields[j]) {
+            h = fnv1a(h, fields[j], strlen(fields[j]) + 1);
+        }
+    }
+    return h;
 }
 
-void freeEditorRow(editorRow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->highlight);
-}
+// creates every directory along path, like mkdir -p.
+int makeEditorDirs(char *path) {
+    char buf[PATH_MAX];
+    char *p;
 
-void delEditorRow(int at) {
-    if (at < 0 || at >= E.numRows) {
-        return;
+    if (snprintf(buf, sizeof(buf), "%s", path) >= (int)sizeof(buf)) {
+        return -1;
+    }
+    for (p = buf + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(buf, 0755) == -1 && errno != EEXIST) {
+                return -1;
+            }
+            *p = '/';
+        }
     }
+    if (mkdir(buf, 0755) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
 
-    freeEditorRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(editorRow) * (E.numRows - at - 1));
-    E.numRows--;
-    E.dirty++;
+// directory for cached data: $XDG_CACHE_HOME/macho/<name> or ~/.cache/macho/<name>.
+int editorCacheDir(char *buf, size_t size, const char *name) {
+    char *xdg = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    int len;
+
+    if (xdg && xdg[0]) {
+        len = snprintf(buf, size, "%s/macho/%s", xdg, name);
+    } else if (home && home[0]) {
+        len = snprintf(buf, size, "%s/.cache/macho/%s", home, name);
+    } else {
+        return -1;
+    }
+    if (len >= (int)size || makeEditorDirs(buf) == -1) {
+        return -1;
+    }
+    return 0;
 }
 
-void insertEditorRowCharacter(editorRow *row, int at, int c) {
-    if (at < 0 || at > row->size) {
-        at = row->size;
+#define LEX_CACHE_MAGIC "MLEX"
+
+struct editorLexer *readCachedEditorLexer(char *path, uint64_t hash) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
     }
 
-    row->chars = (char *)realloc(row->chars, row->size + 2);
-    if (row->chars == NULL) {
-        die("realloc");
+    char magic[4];
+    int version;
+    uint64_t fileHash;
+    struct editorLexer *lx = (struct editorLexer *)calloc(1, sizeof(struct editorLexer));
+
+    if (fread(magic, 4, 1, fp) != 1 || memcmp(magic, LEX_CACHE_MAGIC, 4) ||
+        fread(&version, sizeof(version), 1, fp) != 1 || version != LEX_VERSION ||
+        fread(&fileHash, sizeof(fileHash), 1, fp) != 1 || fileHash != hash ||
+        fread(&lx->numStates, sizeof(int), 1, fp) != 1 ||
+        fread(&lx->numClasses, sizeof(int), 1, fp) != 1 ||
+        lx->numStates <= 0 || lx->numStates > LEX_MAX_STATES || lx->numClasses <= 0 || lx->numClasses > 256 ||
+        fread(lx->start, sizeof(lx->start), 1, fp) != 1 ||
+        fread(lx->classOf, sizeof(lx->classOf), 1, fp) != 1) {
+        fclose(fp);
+        free(lx);
+        return NULL;
     }
 
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
+    size_t cells = (size_t)lx->numStates * lx->numClasses;
+    lx->cells = (uint32_t *)malloc(sizeof(uint32_t) * cells);
+    lx->eolPaint = (unsigned char *)malloc(lx->numStates);
+    lx->eolPaintHl = (unsigned char *)malloc(lx->numStates);
+    lx->eolCarry = (unsigned char *)malloc(lx->numStates);
 
-    updateEditorRow(row);
-    E.dirty++;
-}
+    int ok = fread(lx->cells, sizeof(uint32_t), cells, fp) == cells &&
+        fread(lx->eolPaint, 1, lx->numStates, fp) == (size_t)lx->numStates &&
+        fread(lx->eolPaintHl, 1, lx->numStates, fp) == (size_t)lx->numStates &&
+        fread(lx->eolCarry, 1, lx->numStates, fp) == (size_t)lx->numStates;
+    fclose(fp);
 
-void appendEditorRowString(editorRow *row, char *s, int len) {
-    row->chars = (char *)realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    updateEditorRow(row);
-    E.dirty++;
-}
-
-void delEditorRowChar(editorRow *row, int at) {
-    if (at < 0 || at >= row->size) {
-        return;
+    // a truncated or corrupt table must never send the lexer out of bounds.
+    size_t i;
+    int s, k;
+    for (k = 0; ok && k < 256; k++) {
+        ok = lx->classOf[k] < lx->numClasses;
     }
-
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    updateEditorRow(row);
-
-    E.dirty++;
-}
-
-/*** editor operations ***/
-
-void insertEditorChar(int c) {
-    if (E.cy == E.numRows) {
-        insertEditorRow(E.numRows, "", 0);
+    for (s = 0; ok && s < HL_STATE_COUNT; s++) {
+        ok = lx->start[s] >= 0 && lx->start[s] < lx->numStates;
+    }
+    for (i = 0; ok && i < cells; i++) {
+        ok = (int)LEX_NEXT(lx->cells[i]) < lx->numStates;
+    }
+    for (s = 0; ok && s < lx->numStates; s++) {
+        ok = lx->eolCarry[s] < HL_STATE_COUNT;
     }
 
-    insertEditorRowCharacter(&E.row[E.cy], E.cx, c);
-    E.cx++;
-}
-
-void insertEditorNewline() {
-    if (E.cx == 0) {
-        insertEditorRow(E.cy, "", 0);
-    } else {
-        editorRow *row = &E.row[E.cy];
-        insertEditorRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        updateEditorRow(row);
+    if (!ok) {
+        freeEditorLexer(lx);
+        return NULL;
     }
-    E.cy++;
-    E.cx = 0;
+    return lx;
 }
 
-void delEditorChar() {
-    if (E.cy == E.numRows) {
-        E.cy--;
-        E.cx = E.row[E.cy].size;
+void writeCachedEditorLexer(char *path, uint64_t hash, struct editorLexer *lx) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >= (int)sizeof(tmp)) {
         return;
     }
-    if (E.cx == 0 && E.cy == 0) {
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
         return;
     }
 
-    editorRow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        delEditorRowChar(row, E.cx - 1);
-        E.cx--;
-    } else {
-        E.cx = E.row[E.cy - 1].size;
-        appendEditorRowString(&E.row[E.cy - 1], row->chars, row->size);
-        delEditorRow(E.cy);
-        E.cy--;
+    int version = LEX_VERSION;
+    size_t cells = (size_t)lx->numStates * lx->numClasses;
+    int ok = fwrite(LEX_CACHE_MAGIC, 4, 1, fp) == 1 &&
+        fwrite(&version, sizeof(version), 1, fp) == 1 &&
+        fwrite(&hash, sizeof(hash), 1, fp) == 1 &&
+        fwrite(&lx->numStates, sizeof(int), 1, fp) == 1 &&
+        fwrite(&lx->numClasses, sizeof(int), 1, fp) == 1 &&
+        fwrite(lx->start, sizeof(lx->start), 1, fp) == 1 &&
+        fwrite(lx->classOf, sizeof(lx->classOf), 1, fp) == 1 &&
+        fwrite(lx->cells, sizeof(uint32_t), cells, fp) == cells &&
+        fwrite(lx->eolPaint, 1, lx->numStates, fp) == (size_t)lx->numStates &&
+        fwrite(lx->eolPaintHl, 1, lx->numStates, fp) == (size_t)lx->numStates &&
+        fwrite(lx->eolCarry, 1, lx->numStates, fp) == (size_t)lx->numStates;
+
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) == -1) {
+        unlink(tmp);
     }
 }
 
-/*** file i/o ***/
+// makes sure the syntax has its tables, from the cache if they were compiled
+// before.
+void loadEditorLexer(struct editorSyntax *syntax) {
+    if (syntax->lexer) {
+        return;
+    }
 
-char *editorRowsToString(int *bufLen) {
-    int totalLen = 0;
-    int j;
+    uint64_t hash = hashEditorSyntax(syntax);
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+    int cached = editorCacheDir(dir, sizeof(dir), "lexers") == 0 &&
+        snprintf(path, sizeof(path), "%s/%016llx.lex", dir, (unsigned long long)hash) < (int)sizeof(path);
 
-    for (j = 0; j < E.numRows; j++) {
-        totalLen += E.row[j].size + 1;
+    if (cached) {
+        syntax->lexer = readCachedEditorLexer(path, hash);
     }
-    *bufLen = totalLen;
+    if (syntax->lexer == NULL) {
+        syntax->lexer = compileEditorLexer(syntax);
+        if (syntax->lexer && cached) {
+            writeCachedEditorLexer(path, hash, syntax->lexer);
+        }
+    }
+}
 
-    char *buf = (char *)malloc(totalLen);
-    char *p = buf;
-    for (j = 0; j < E.numRows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size; 
-        *p = '\n';
-        p++;
+/*** syntax definitions ***/
+
+// definition files (*.syntax) hold one setting per line:
+//
+//   filetype javascript
+//   match .js .mjs
+//   keywords if else while for return function class new const let var
+//   types true false null undefined
+//   comment //
+//   multiline-comment /* */
+//   strings " ' `
+//   numbers yes
+//
+// keywords and types may be repeated. blank lines and lines starting with #
+// are ignored.
+
+#define SYNTAX_MAX_QUOTES 31
+
+void appendSyntaxWord(char ***list, int *count, char *word, int secondary) {
+    int len = strlen(word);
+    char *copy = (char *)malloc(len + 2);
+
+    memcpy(copy, word, len);
+    if (secondary) {
+        copy[len++] = '|';
     }
+    copy[len] = '\0';
 
-    return buf;
+    *list = (char **)realloc(*list, sizeof(char *) * (*count + 2));
+    (*list)[(*count)++] = copy;
+    (*list)[*count] = NULL;
 }
 
-void openEditor(char *fileName) {
-    free(E.fileName);
-    E.fileName = strdup(fileName);
-    if (E.fileName == NULL) {
-        die("strdup fileName");
+void freeSyntaxWords(char **list) {
+    int j;
+
+    for (j = 0; list && list[j]; j++) {
+        free(list[j]);
     }
+    free(list);
+}
 
-    editorSelectSyntaxHighlight();
+// frees what parseSyntaxDefinition allocated for a definition not kept.
+void freeEditorSyntax(struct editorSyntax *syntax) {
+    free(syntax->fileType);
+    freeSyntaxWords(syntax->fileMatch);
+    freeSyntaxWords(syntax->keywords);
+    free(syntax->singleLineCommentStart);
+    free(syntax->multiLineCommentStart);
+    free(syntax->multiLineCommentEnd);
+    free(syntax->stringQuotes);
+    freeEditorLexer(syntax->lexer);
+    memset(syntax, 0, sizeof(*syntax));
+}
 
-    FILE *fp = fopen(fileName, "r");
+int parseSyntaxDefinition(char *path, struct editorSyntax *syntax) {
+    FILE *fp = fopen(path, "r");
     if (!fp) {
-        die("file open error");
+        return -1;
     }
 
+    memset(syntax, 0, sizeof(*syntax));
+    int matchCount = 0;
+    int keywordCount = 0;
+    char quotes[SYNTAX_MAX_QUOTES + 1] = "";
+    int numQuotes = 0;
+    int numbers = 0;
+
     char *line = NULL;
     size_t lineCapacity = 0;
-    ssize_t lineLen;
 
-    while ((lineLen = getline(&line, &lineCapacity, fp)) != -1) {
-        while (lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r')) {
-            lineLen--; 
+    while (getline(&line, &lineCapacity, fp) != -1) {
+        char *save = NULL;
+        char *key = strtok_r(line, " \t\r\n", &save);
+        char *word;
+
+        if (key == NULL || key[0] == '#') {
+            continue;
         }
 
-        insertEditorRow(E.numRows, line, lineLen);
+        if (!strcmp(key, "filetype")) {
+            if ((word = strtok_r(NULL, " \t\r\n", &save))) {
+                free(syntax->fileType);
+                syntax->fileType = strdup(word);
+            }
+        } else if (!strcmp(key, "match")) {
+            while ((word = strtok_r(NULL, " \t\r\n", &save))) {
+                appendSyntaxWord(&syntax->fileMatch, &matchCount, word, 0);
+            }
+        } else if (!strcmp(key, "keywords") || !strcmp(key, "types")) {
+            while ((word = strtok_r(NULL, " \t\r\n", &save))) {
+                appendSyntaxWord(&syntax->keywords, &keywordCount, word, key[0] == 't');
+            }
+        } else if (!strcmp(key, "comment")) {
+            if ((word = strtok_r(NULL, " \t\r\n", &save))) {
+                free(syntax->singleLineCommentStart);
+                syntax->singleLineCommentStart = strdup(word);
+            }
+        } else if (!strcmp(key, "multiline-comment")) {
+            char *start = strtok_r(NULL, " \t\r\n", &save);
+            char *end = strtok_r(NULL, " \t\r\n", &save);
+            if (start && end) {
+                free(syntax->multiLineCommentStart);
+                free(syntax->multiLineCommentEnd);
+                syntax->multiLineCommentStart = strdup(start);
+                syntax->multiLineCommentEnd = strdup(end);
+            }
+        } else if (!strcmp(key, "strings")) {
+            while ((word = strtok_r(NULL, " \t\r\n", &save)) && numQuotes < SYNTAX_MAX_QUOTES) {
+                quotes[numQuotes++] = word[0];
+                quotes[numQuotes] = '\0';
+            }
+        } else if (!strcmp(key, "numbers")) {
+            word = strtok_r(NULL, " \t\r\n", &save);
+            numbers = word && (!strcmp(word, "yes") || !strcmp(word, "true"));
+        }
     }
 
     free(line);
     fclose(fp);
-    E.dirty = 0;
+
+    syntax->stringQuotes = strdup(quotes);
+    syntax->flags = (numbers ? HL_HIGHLIGHT_NUMBERS : 0) | (numQuotes ? HL_HIGHLIGHT_STRINGS : 0);
+    if (syntax->keywords == NULL) {
+        syntax->keywords = (char **)calloc(1, sizeof(char *));
+    }
+
+    if (syntax->fileType == NULL || syntax->fileMatch == NULL) {
+        freeEditorSyntax(syntax);
+        return -1;
+    }
+    return 0;
 }
 
-void saveEditor() {
-    if (E.fileName == NULL) {
-        E.fileName = editorPrompt("Save as : %s (ESC to cancel)", NULL);
-        if (E.fileName == NULL) {
-            setEditorStatusMessage("Save aborted...");
-            return;
-        }
-        editorSelectSyntaxHighlight();
+void loadSyntaxDirectory(char *dirName) {
+    DIR *dir = opendir(dirName);
+    if (!dir) {
+        return;
     }
 
-    int len;
-    char *buf = editorRowsToString(&len);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int len = strlen(entry->d_name);
+        char path[PATH_MAX];
 
-    /* 
-     * O_RDWR -> allows read and write operation.
-     * O_CREAT -> creates new file if it does not exists.
-     */
-    int fd = open(E.fileName, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                setEditorStatusMessage("\"%s\" %dL, %dB written", E.fileName, E.numRows, len);
-                return;
+        if (len < 8 || strcmp(&entry->d_name[len - 7], ".syntax")) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", dirName, entry->d_name) >= (int)sizeof(path)) {
+            continue;
+        }
+
+        struct editorSyntax syntax;
+        if (parseSyntaxDefinition(path, &syntax) == -1) {
+            continue;
+        }
+
+        // the first directory searched wins.
+        int j;
+        for (j = 0; j < syntaxDefCount; j++) {
+            if (!strcmp(syntaxDefs[j].fileType, syntax.fileType)) {
+                break;
             }
         }
-        close(fd);
+        if (j < syntaxDefCount) {
+            freeEditorSyntax(&syntax);
+            continue;
+        }
+
+        syntaxDefs = (struct editorSyntax *)realloc(syntaxDefs, sizeof(struct editorSyntax) * (syntaxDefCount + 1));
+        syntaxDefs[syntaxDefCount++] = syntax;
     }
 
-    free(buf);
-    setEditorStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    closedir(dir);
 }
 
-/*** find ***/
+// reads the definitions from $MACHO_SYNTAX_PATH (colon separated) or, without
+// it, from ~/.config/macho/syntax, the syntax directory next to the executable
+// and the system share directories. only the definition in use is compiled.
+void loadSyntaxDefinitions() {
+    char *path = getenv("MACHO_SYNTAX_PATH");
+    char dir[PATH_MAX];
 
-void editorFindCallback(char *query, int key) {
-    static int lastMatch = -1;
-    static int direction = 1;
+    if (path) {
+        char *copy = strdup(path);
+        char *save = NULL;
+        char *d;
 
-    static int savedHighlightLine;
-    static unsigned char *savedHighlight = NULL;
+        for (d = strtok_r(copy, ":", &save); d; d = strtok_r(NULL, ":", &save)) {
+            loadSyntaxDirectory(d);
+        }
+        free(copy);
+        return;
+    }
 
-    if (savedHighlight) {
-        memcpy(E.row[savedHighlightLine].highlight, savedHighlight, E.row[savedHighlightLine].rsize);
-        free(savedHighlight);
-        savedHighlight = NULL;
+    char *xdg = getenv("XDG_CONFIG_HOME");
+    char *home = getenv("HOME");
+    if (xdg && xdg[0] && snprintf(dir, sizeof(dir), "%s/macho/syntax", xdg) < (int)sizeof(dir)) {
+        loadSyntaxDirectory(dir);
+    } else if (home && home[0] && snprintf(dir, sizeof(dir), "%s/.config/macho/syntax", home) < (int)sizeof(dir)) {
+        loadSyntaxDirectory(dir);
     }
 
-    if (key == '\x1b' || key == '\r') {
-        lastMatch = -1;
-        direction = 1;
-        return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        lastMatch = -1;
-        direction = 1;
+    ssize_t len = readlink("/proc/self/exe", dir, sizeof(dir) - 8);
+    if (len > 0) {
+        dir[len] = '\0';
+        char *slash = strrchr(dir, '/');
+        if (slash) {
+            strcpy(slash, "/syntax");
+            loadSyntaxDirectory(dir);
+        }
     }
 
-    if (lastMatch == -1) {
-        direction = 1;
+    loadSyntaxDirectory("/usr/local/share/macho/syntax");
+    loadSyntaxDirectory("/usr/share/macho/syntax");
+}
+
+/*** syntax highlighting ***/
+
+// highlights a rendered line starting in the given carried state and returns
+// the state carried over to the next line. touches nothing but its arguments,
+// so the background worker can call it on a copy of the row.
+int highlightEditorRender(struct editorSyntax *syntax, int state, char *render, int rsize, unsigned char *highlight) {
+    struct editorLexer *lx = syntax ? syntax->lexer : NULL;
+
+    if (lx == NULL) {
+        memset(highlight, HL_NORMAL, rsize);
+        return HL_STATE_NORMAL;
     }
 
-    int current = lastMatch;
+    const unsigned char *classOf = lx->classOf;
+    const uint32_t *cells = lx->cells;
+    int numClasses = lx->numClasses;
+    int s = lx->start[state];
     int i;
-    for (i = 0; i < E.numRows; i++) {
-        current += direction;
-        if (current == -1) {
-            current = E.numRows - 1;
-        } else if (current == E.numRows) {
-            current = 0;
+
+    for (i = 0; i < rsize; i++) {
+        uint32_t cell = cells[s * numClasses + classOf[(unsigned char)render[i]]];
+        int paint = LEX_PAINT(cell);
+
+        highlight[i] = LEX_EMIT(cell);
+        if (paint) {
+            memset(&highlight[i - paint], LEX_PAINT_HL(cell), paint);
         }
+        s = LEX_NEXT(cell);
+    }
 
-        editorRow *row = &E.row[current];
-        char *match = strstr(row->render, query);
+    if (lx->eolPaint[s]) {
+        memset(&highlight[rsize - lx->eolPaint[s]], lx->eolPaintHl[s], lx->eolPaint[s]);
+    }
+    return lx->eolCarry[s];
+}
 
-        if (match) {
-            lastMatch = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowOffset = E.numRows;
+int editorSyntaxToColor(int highlight) {
+    switch(highlight) {
+        case HL_COMMENT:
+            return 36;
+        case HL_KEYWORD1:
+            return 33;
+        case HL_KEYWORD2:
+            return 32;
+        case HL_STRING:
+            return 35;
+        case HL_NUMBER:
+            return 31;
+        case HL_MATCH:
+            return 34;
+        default:
+            return 37;
+    }
+}
 
-            savedHighlightLine = current;
-            savedHighlight = (unsigned char *)malloc(row->rsize);
-            memcpy(savedHighlight, row->highlight, row->rsize);
+int editorSyntaxMatches(struct editorSyntax *s, char *fileName) {
+    char *extension = strrchr(fileName, '.');
+    unsigned int i = 0;
 
-            memset(&row->highlight[match - row->render], HL_MATCH, strlen(query));
-            break;
+    while (s->fileMatch[i]) {
+        int isExtension = (s->fileMatch[i][0] == '.');
+
+        if ((isExtension && extension && !strcmp(extension, s->fileMatch[i])) || (!isExtension && strstr(fileName, s->fileMatch[i]))) {
+            return 1;
+        }
+        i++;
+    }
+    return 0;
+}
+
+void editorSelectSyntaxHighlight() {
+    E.syntax = NULL;
+    if (E.fileName == NULL) {
+        return;
+    }
+
+    // definition files take precedence over the built in ones.
+    int j;
+    for (j = 0; j < syntaxDefCount + (int)HLDB_ENTRIES; j++) {
+        struct editorSyntax *s = (j < syntaxDefCount) ? &syntaxDefs[j] : &HLDB[j - syntaxDefCount];
+
+        if (editorSyntaxMatches(s, E.fileName)) {
+            loadEditorLexer(s);
+            E.syntax = s;
+
+            int fileRow;
+            for (fileRow = 0; fileRow < E.numRows; fileRow++) {
+                updateEditorSyntax(&E.row[fileRow]);
+            }
+
+            return;
         }
     }
 }
 
-void editorFind() {
-    int prevCx = E.cx;
-    int prevCy = E.cy;
-    int prevColOffset = E.colOffset;
-    int prevRowOffset = E.rowOffset;
+/*** background highlighting ***/
 
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+// a row handed to the worker. the worker only sees the copy of the render
+// stored here, never E.row, so edits on the main thread need no locking.
+struct highlightJob {
+    int at;                 // row index when the job was handed out.
+    unsigned int serial;    // row version the render was copied from.
+    struct editorSyntax *syntax;
+    int chained;            // follows the job for the row above in the same batch.
+    int startState;
+    int endState;
+    char *render;
+    int rsize;
+    unsigned char *highlight;
+    struct highlightJob *next;
+};
 
-    if (query) {
-        free(query);
-    } else {
-        E.cx = prevCx;
-        E.cy = prevCy;
-        E.colOffset = prevColOffset;
-        E.rowOffset = prevRowOffset;
+struct highlightWorker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct highlightJob *urgent;        // visible rows, taken first.
+    struct highlightJob *background;    // everything else, in priority order.
+    struct highlightJob *done;          // finished jobs waiting to be published.
+    struct highlightJob **doneTail;
+    int backgroundCount;
+    int wakeFd[2];                      // worker writes here when jobs are done.
+    int running;
+};
+
+struct highlightWorker HW = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .doneTail = &HW.done, .wakeFd = {-1, -1} };
+
+void *highlightWorkerMain(void *arg) {
+    (void)arg;
+    int lastAt = -1;
+    int lastEnd = HL_STATE_NORMAL;
+
+    pthread_mutex_lock(&HW.lock);
+    while (1) {
+        while (HW.urgent == NULL && HW.background == NULL) {
+            pthread_cond_wait(&HW.cond, &HW.lock);
+        }
+
+        struct highlightJob *job;
+        if (HW.urgent) {
+            job = HW.urgent;
+            HW.urgent = job->next;
+        } else {
+            job = HW.background;
+            HW.background = job->next;
+            HW.backgroundCount--;
+        }
+        pthread_mutex_unlock(&HW.lock);
+
+        // a run of rows carries the state down itself, so a comment opened
+        // at the top of a batch reaches the bottom in one pass.
+        if (job->chained && job->at == lastAt + 1) {
+            job->startState = lastEnd;
+        }
+
+        job->highlight = (unsigned char *)malloc(job->rsize ? job->rsize : 1);
+        job->endState = highlightEditorRender(job->syntax, job->startState, job->render, job->rsize, job->highlight);
+        lastAt = job->at;
+        lastEnd = job->endState;
+
+        pthread_mutex_lock(&HW.lock);
+        int wasIdle = (HW.done == NULL);
+        job->next = NULL;
+        *HW.doneTail = job;
+        HW.doneTail = &job->next;
+        if (wasIdle) {
+            write(HW.wakeFd[1], "h", 1);
+        }
     }
+
+    return NULL;
+}
+
+void startHighlightWorker() {
+    if (pipe(HW.wakeFd) == -1) {
+        return;
+    }
+    fcntl(HW.wakeFd[0], F_SETFL, O_NONBLOCK);
+    fcntl(HW.wakeFd[1], F_SETFL, O_NONBLOCK);
+
+    if (pthread_create(&HW.thread, NULL, highlightWorkerMain, NULL) != 0) {
+        close(HW.wakeFd[0]);
+        close(HW.wakeFd[1]);
+        HW.wakeFd[0] = HW.wakeFd[1] = -1;
+        return;
+    }
+    HW.running = 1;
 }
 
-/*** append buffer ***/
+// marks the row's highlight out of date. with the worker running the row is
+// picked up at the next frame and keeps its old colors until then, otherwise
+// it is highlighted right away.
+void updateEditorSyntax(editorRow *row) {
+    if (row->hlDone == row->hlSerial) {
+        E.hlPending++;
+    }
+    row->hlSerial = ++E.hlSerial;
+    row->hlTicket = 0;
+
+    if (E.syntax && HW.running) {
+        return;
+    }
+
+    // highlight right away, following a changed carried state down the file.
+    int at = row - E.row;
+    row = getEditorRow(at);
+    while (1) {
+        int start = (at > 0) ? E.row[at - 1].hlEndState : HL_STATE_NORMAL;
+
+        if (isEditorLineHighlighted(row, start)) {
+            useEditorLineHighlight(at);
+        } else {
+            row->hlStartState = start;
+            row->hlEndState = highlightEditorRender(E.syntax, start, row->render, row->rsize, ownEditorRowHighlight(row));
+            summarizeEditorRowBrackets(at);
+            keepEditorLineHighlight(at);
+        }
+        row->hlDone = row->hlSerial;
+        E.hlPending--;
+
+        if (++at >= E.numRows || E.row[at].hlStartState == row->hlEndState) {
+            break;
+        }
+
+        row = getEditorRow(at);
+        if (row->hlDone == row->hlSerial) {
+            E.hlPending++;
+        }
+        row->hlSerial = ++E.hlSerial;
+        row->hlTicket = 0;
+    }
+}
+
+int isEditorRowHighlightQueued(editorRow *row) {
+    return row->hlDone != row->hlSerial && row->hlTicket > E.hlEpoch;
+}
+
+struct highlightJob *newHighlightJob(int at, struct highlightJob *prev) {
+    editorRow *row = getEditorRow(at);
+    struct highlightJob *job = (struct highlightJob *)malloc(sizeof(struct highlightJob));
+
+    job->at = at;
+    job->serial = row->hlSerial;
+    job->syntax = E.syntax;
+    job->chained = (prev && prev->at == at - 1);
+    job->startState = (at > 0) ? E.row[at - 1].hlEndState : HL_STATE_NORMAL;
+    job->endState = HL_STATE_NORMAL;
+    job->rsize = row->rsize;
+    job->render = (char *)malloc(row->rsize + 1);
+    memcpy(job->render, row->render, row->rsize + 1);
+    job->highlight = NULL;
+    job->next = NULL;
+
+    row->hlTicket = ++E.hlTicket;
+    return job;
+}
+
+// moves finished jobs into their rows. returns the number of visible rows
+// that got new colors.
+int publishEditorHighlights() {
+    if (!HW.running) {
+        return 0;
+    }
+
+    char drain[64];
+    while (read(HW.wakeFd[0], drain, sizeof(drain)) > 0);
+
+    pthread_mutex_lock(&HW.lock);
+    struct highlightJob *job = HW.done;
+    HW.done = NULL;
+    HW.doneTail = &HW.done;
+    pthread_mutex_unlock(&HW.lock);
+
+    int bottom = editorBottomRow();
+    int visible = 0;
+    while (job) {
+        struct highlightJob *next = job->next;
+
+        if (job->at < E.numRows) {
+            editorRow *row = &E.row[job->at];
+
+            int start = (job->at > 0) ? E.row[job->at - 1].hlEndState : HL_STATE_NORMAL;
+
+            if (row->hlSerial != job->serial || row->hlDone == job->serial || row->rsize != job->rsize) {
+                // edited or moved since, or already done by a duplicate.
+            } else if (job->startState != start) {
+                // the row above changed state meanwhile, hand it out again.
+                row->hlTicket = 0;
+            } else {
+                dropEditorRowHighlight(row);
+                row->highlight = job->highlight;
+                job->highlight = NULL;
+
+                row->hlDone = job->serial;
+                row->hlTicket = 0;
+                row->hlStartState = job->startState;
+                row->hlEndState = job->endState;
+                E.hlPending--;
+                summarizeEditorRowBrackets(job->at);
+                keepEditorLineHighlight(job->at);
+
+                if (job->at >= E.rowOffset && job->at < bottom) {
+                    visible++;
+                }
+
+                // the row below was highlighted from a different state.
+                editorRow *below = (job->at + 1 < E.numRows) ? &E.row[job->at + 1] : NULL;
+                if (below && below->hlDone == below->hlSerial && below->hlStartState != job->endState) {
+                    updateEditorSyntax(below);
+                    if (job->at + 1 >= bottom) {
+                        E.hlSweep = job->at + 1;
+                    }
+                }
+            }
+        }
+
+        free(job->render);
+        free(job->highlight);
+        free(job);
+        job = next;
+    }
+
+    return visible;
+}
+
+// hands out rows whose highlight is out of date: the visible ones first, then
+// the ones around the viewport, then a bounded slice of the rest of the file.
+struct highlightJobList {
+    struct highlightJob *head;
+    struct highlightJob *tail;
+    int count;
+};
+
+// queues the row unless its highlight is up to date or already in flight. a
+// row sharing the colors it needs with identical rows gets them right away.
+void queueEditorRowHighlight(struct highlightJobList *list, int at) {
+    editorRow *row = &E.row[at];
+    if (row->hlDone == row->hlSerial || isEditorRowHighlightQueued(row)) {
+        return;
+    }
+
+    int start = (at > 0) ? E.row[at - 1].hlEndState : HL_STATE_NORMAL;
+    if (isEditorLineHighlighted(row, start)) {
+        useEditorLineHighlight(at);
+        row->hlDone = row->hlSerial;
+        E.hlPending--;
+
+        editorRow *below = (at + 1 < E.numRows) ? &E.row[at + 1] : NULL;
+        if (below && below->hlDone == below->hlSerial && below->hlStartState != row->hlEndState) {
+            updateEditorSyntax(below);
+        }
+        return;
+    }
+
+    struct highlightJob *job = newHighlightJob(at, list->tail);
+    if (list->tail) {
+        list->tail->next = job;
+    } else {
+        list->head = job;
+    }
+    list->tail = job;
+    list->count++;
+}
+
+void scheduleEditorHighlights() {
+    if (!HW.running || E.hlPending == 0) {
+        return;
+    }
+
+    struct highlightJobList urgent = { NULL, NULL, 0 };
+    struct highlightJobList background = { NULL, NULL, 0 };
+    int at;
+
+    int top = E.rowOffset;
+    int bottom = editorBottomRow();
+
+    for (at = top; at < bottom; at = nextEditorVisibleRow(at)) {
+        queueEditorRowHighlight(&urgent, at);
+    }
+
+    pthread_mutex_lock(&HW.lock);
+    int room = MACHO_HL_BATCH - HW.backgroundCount;
+    pthread_mutex_unlock(&HW.lock);
+
+    // rows just below the viewport, then just above it.
+    for (at = bottom; at < bottom + MACHO_HL_NEARBY && at < E.numRows && background.count < room; at++) {
+        queueEditorRowHighlight(&background, at);
+    }
+    for (at = top - 1; at >= 0 && at >= top - MACHO_HL_NEARBY && background.count < room; at--) {
+        queueEditorRowHighlight(&background, at);
+    }
+
+    int scanned = 0;
+    while (background.count < room && scanned < MACHO_HL_SCAN && E.numRows > 0) {
+        if (E.hlSweep >= E.numRows) {
+            E.hlSweep = 0;
+        }
+        queueEditorRowHighlight(&background, E.hlSweep);
+        E.hlSweep++;
+        scanned++;
+    }
+
+    if (urgent.head == NULL && background.head == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&HW.lock);
+    if (urgent.head) {
+        urgent.tail->next = HW.urgent;
+        HW.urgent = urgent.head;
+    }
+    if (background.head) {
+        struct highlightJob **tail = &HW.background;
+        while (*tail) {
+            tail = &(*tail)->next;
+        }
+        *tail = background.head;
+        HW.backgroundCount += background.count;
+    }
+    pthread_cond_signal(&HW.cond);
+    pthread_mutex_unlock(&HW.lock);
+}
+
+/*** row chunks ***/
+
+// the bracket, wrap and byte trees sum up the same chunks of rows, whose
+// rows are counted in chunkTree, a segment tree of its own. a chunk is cut
+// to MACHO_CHUNK_ROWS rows and may grow to twice that or shrink to half, so
+// rows added or removed only change the count of their chunk and the path
+// above it. a chunk grown or shrunk past that is cut up again or joined to
+// the next one, moving the leaves after it once. the chunks whose rows
+// changed are listed, and their sums brought up to date in every tree the
+// next time one of the trees is used.
+
+// cuts the rows into chunks, unless that is done already.
+void layoutEditorChunks() {
+    int size = 1;
+    int j;
+
+    if (E.chunkTree) {
+        return;
+    }
+
+    E.numChunks = (E.numRows + MACHO_CHUNK_ROWS - 1) / MACHO_CHUNK_ROWS;
+    while (size < E.numChunks) {
+        size *= 2;
+    }
+    E.chunkSize = size;
+    E.chunkTree = (int *)calloc(size * 2, sizeof(int));
+    E.chunkMarked = (unsigned char *)calloc(size, 1);
+    if (E.chunkTree == NULL || E.chunkMarked == NULL) {
+        die("calloc");
+    }
+    for (j = 0; j < E.numChunks; j++) {
+        E.chunkTree[size + j] = (j + 1 < E.numChunks) ? MACHO_CHUNK_ROWS : E.numRows - j * MACHO_CHUNK_ROWS;
+    }
+    for (j = size - 1; j >= 1; j--) {
+        E.chunkTree[j] = E.chunkTree[2 * j] + E.chunkTree[2 * j + 1];
+    }
+}
+
+// drops the chunks and the trees over them, which are built again when
+// next used.
+void resetEditorChunks() {
+    free(E.chunkTree);
+    free(E.chunkMarked);
+    free(E.bracketTree);
+    free(E.wrapTree);
+    free(E.byteTree);
+    E.chunkTree = NULL;
+    E.chunkMarked = NULL;
+    E.bracketTree = NULL;
+    E.wrapTree = NULL;
+    E.byteTree = NULL;
+    E.chunkSize = 0;
+    E.numChunks = 0;
+    E.numChunkDirty = 0;
+}
+
+int editorChunkRows(int chunk) {
+    return E.chunkTree[E.chunkSize + chunk];
+}
+
+// the first row of a chunk.
+int editorChunkStart(int chunk) {
+    int first = 0;
+    int lo, hi;
+
+    for (lo = E.chunkSize, hi = E.chunkSize + chunk; lo < hi; lo /= 2, hi /= 2) {
+        if (lo & 1) {
+            first += E.chunkTree[lo++];
+        }
+        if (hi & 1) {
+            first += E.chunkTree[--hi];
+        }
+    }
+    return first;
+}
+
+// the chunk row at is in, and in *first the row it starts at. past the end
+// that is the last chunk.
+int findEditorChunk(int at, int *first) {
+    int node = 1;
+
+    layoutEditorChunks();
+    *first = 0;
+    if (at >= E.chunkTree[1]) {
+        at = E.chunkTree[1] - 1;
+    }
+    if (at < 0) {
+        return 0;
+    }
+
+    while (node < E.chunkSize) {
+        if (at < E.chunkTree[2 * node]) {
+            node = 2 * node;
+        } else {
+            at -= E.chunkTree[2 * node];
+            *first += E.chunkTree[2 * node];
+            node = 2 * node + 1;
+        }
+    }
+    return node - E.chunkSize;
+}
+
+void markEditorChunk(int chunk) {
+    if (E.chunkMarked[chunk]) {
+        return;
+    }
+    if (E.numChunkDirty == E.chunkDirtyCap) {
+        E.chunkDirtyCap = E.chunkDirtyCap ? E.chunkDirtyCap * 2 : 64;
+        E.chunkDirty = (int *)realloc(E.chunkDirty, sizeof(int) * E.chunkDirtyCap);
+        if (E.chunkDirty == NULL) {
+            die("realloc");
+        }
+    }
+    E.chunkDirty[E.numChunkDirty++] = chunk;
+    E.chunkMarked[chunk] = 1;
+}
+
+// row at changed what it adds up to in the trees.
+void markEditorRowChunk(int at) {
+    int first;
+
+    if (E.chunkTree) {
+        markEditorChunk(findEditorChunk(at, &first));
+    }
+}
+
+// the sums of the nodes above the leaves from `from` on, in every tree.
+void joinEditorChunks(int from) {
+    int lo = (E.chunkSize + from) / 2;
+    int hi = (E.chunkSize * 2 - 1) / 2;
+    int j;
+
+    for (; lo >= 1; lo /= 2, hi /= 2) {
+        for (j = lo; j <= hi; j++) {
+            E.chunkTree[j] = E.chunkTree[2 * j] + E.chunkTree[2 * j + 1];
+            if (E.bracketTree) {
+                E.bracketTree[j] = E.bracketTree[2 * j];
+                addBracketNode(&E.bracketTree[j], &E.bracketTree[2 * j + 1]);
+            }
+            if (E.wrapTree) {
+                E.wrapTree[j] = E.wrapTree[2 * j] + E.wrapTree[2 * j + 1];
+            }
+            if (E.byteTree) {
+                E.byteTree[j] = E.byteTree[2 * j] + E.byteTree[2 * j + 1];
+            }
+        }
+    }
+}
+
+// makes room for `count` chunks in place of chunks [first, last], moving the
+// leaves after them. past the size of the trees they grow, and only the
+// chunk counts are kept; the other trees are built again.
+void spliceEditorChunks(int first, int last, int count) {
+    int by = count - (last - first + 1);
+    int moved = E.numChunks - last - 1;
+    int j, k;
+
+    // listed chunks move along, the ones replaced are listed again.
+    for (j = 0, k = 0; j < E.numChunkDirty; j++) {
+        int chunk = E.chunkDirty[j];
+        if (chunk > last) {
+            E.chunkDirty[k++] = chunk + by;
+        } else if (chunk < first) {
+            E.chunkDirty[k++] = chunk;
+        }
+    }
+    E.numChunkDirty = k;
+
+    if (E.numChunks + by > E.chunkSize) {
+        int size = E.chunkSize;
+        while (size < E.numChunks + by) {
+            size *= 2;
+        }
+
+        int *tree = (int *)calloc(size * 2, sizeof(int));
+        unsigned char *marked = (unsigned char *)calloc(size, 1);
+        if (tree == NULL || marked == NULL) {
+            die("calloc");
+        }
+        memcpy(&tree[size], &E.chunkTree[E.chunkSize], sizeof(int) * E.numChunks);
+        memcpy(marked, E.chunkMarked, E.numChunks);
+        free(E.chunkTree);
+        free(E.chunkMarked);
+        E.chunkTree = tree;
+        E.chunkMarked = marked;
+        E.chunkSize = size;
+
+        free(E.bracketTree);
+        free(E.wrapTree);
+        free(E.byteTree);
+        E.bracketTree = NULL;
+        E.wrapTree = NULL;
+        E.byteTree = NULL;
+        joinEditorChunks(0);
+    }
+
+    int leaf = E.chunkSize + last + 1;
+    memmove(&E.chunkTree[leaf + by], &E.chunkTree[leaf], sizeof(int) * moved);
+    memmove(&E.chunkMarked[last + 1 + by], &E.chunkMarked[last + 1], moved);
+    if (E.bracketTree) {
+        memmove(&E.bracketTree[leaf + by], &E.bracketTree[leaf], sizeof(struct bracketNode) * moved);
+    }
+    if (E.wrapTree) {
+        memmove(&E.wrapTree[leaf + by], &E.wrapTree[leaf], sizeof(int) * moved);
+    }
+    if (E.byteTree) {
+        memmove(&E.byteTree[leaf + by], &E.byteTree[leaf], sizeof(long long) * moved);
+    }
+
+    // leaves left over at the end hold nothing.
+    for (j = E.numChunks + by; j < E.numChunks; j++) {
+        E.chunkTree[E.chunkSize + j] = 0;
+        E.chunkMarked[j] = 0;
+        if (E.bracketTree) {
+            memset(&E.bracketTree[E.chunkSize + j], 0, sizeof(struct bracketNode));
+        }
+        if (E.wrapTree) {
+            E.wrapTree[E.chunkSize + j] = 0;
+        }
+        if (E.byteTree) {
+            E.byteTree[E.chunkSize + j] = 0;
+        }
+    }
+    for (j = first; j < first + count; j++) {
+        E.chunkMarked[j] = 0;
+    }
+    E.numChunks += by;
+}
+
+// rows [at, at + removed) were replaced by `lines` others, and the rows are
+// in place, if not yet filled in. the chunks they are in change their
+// counts, and are summed up again when the trees are next used.
+void markEditorRows(int at, int removed, int lines) {
+    int first;
+    int chunk;
+    int last;
+    int rows;
+    int j;
+
+    if (E.chunkTree == NULL) {
+        return;
+    }
+
+    chunk = findEditorChunk(at, &first);
+    last = chunk;
+    rows = editorChunkRows(chunk);
+    while (first + rows < at + removed && last + 1 < E.numChunks) {
+        rows += editorChunkRows(++last);
+    }
+    if (E.numChunks == 0) {
+        last = -1;
+    }
+
+    if (removed == lines) {
+        for (j = chunk; j <= last; j++) {
+            markEditorChunk(j);
+        }
+        return;
+    }
+
+    rows += lines - removed;
+    if (chunk == last && rows <= 2 * MACHO_CHUNK_ROWS && (rows >= MACHO_CHUNK_ROWS / 2 || E.numChunks == 1) && rows > 0) {
+        int i = E.chunkSize + chunk;
+        E.chunkTree[i] = rows;
+        for (i /= 2; i >= 1; i /= 2) {
+            E.chunkTree[i] = E.chunkTree[2 * i] + E.chunkTree[2 * i + 1];
+        }
+        markEditorChunk(chunk);
+        return;
+    }
+
+    // too few rows are joined to the chunk after, or before at the end.
+    if (rows < MACHO_CHUNK_ROWS / 2 && E.numChunks > last - chunk + 1) {
+        if (last + 1 < E.numChunks) {
+            rows += editorChunkRows(++last);
+        } else {
+            rows += editorChunkRows(--chunk);
+        }
+    }
+
+    int count = (rows + MACHO_CHUNK_ROWS - 1) / MACHO_CHUNK_ROWS;
+    spliceEditorChunks(chunk, last, count);
+    for (j = 0; j < count; j++) {
+        E.chunkTree[E.chunkSize + chunk + j] = rows / count + (j < rows % count);
+        markEditorChunk(chunk + j);
+    }
+    joinEditorChunks(chunk);
+}
+
+// brings the sums of the listed chunks up to date in the trees there are.
+void flushEditorChunks() {
+    while (E.numChunkDirty > 0) {
+        int chunk = E.chunkDirty[--E.numChunkDirty];
+        int first = editorChunkStart(chunk);
+        int rows = editorChunkRows(chunk);
+        int i;
+
+        E.chunkMarked[chunk] = 0;
+        if (E.bracketTree) {
+            i = E.chunkSize + chunk;
+            sumEditorBracketChunk(first, rows, &E.bracketTree[i]);
+            for (i /= 2; i >= 1; i /= 2) {
+                E.bracketTree[i] = E.bracketTree[2 * i];
+                addBracketNode(&E.bracketTree[i], &E.bracketTree[2 * i + 1]);
+            }
+        }
+        if (E.wrapTree) {
+            i = E.chunkSize + chunk;
+            E.wrapTree[i] = sumEditorWrapChunk(first, rows);
+            for (i /= 2; i >= 1; i /= 2) {
+                E.wrapTree[i] = E.wrapTree[2 * i] + E.wrapTree[2 * i + 1];
+            }
+        }
+        if (E.byteTree) {
+            i = E.chunkSize + chunk;
+            E.byteTree[i] = sumEditorByteChunk(first, rows);
+            for (i /= 2; i >= 1; i /= 2) {
+                E.byteTree[i] = E.byteTree[2 * i] + E.byteTree[2 * i + 1];
+            }
+        }
+    }
+}
+
+/*** brackets ***/
+
+// every row keeps the brackets of each kind it leaves unmatched, outside of
+// strings and comments as the highlighter sees them. the rows are summed up
+// in chunks and the chunks in a segment tree, so the bracket matching
+// another is found by going down the tree rather than through every row in
+// between. a changed row, or rows added or removed, only update their chunk
+// and the path above it.
+
+// the kind of bracket c is, -1 if none. *dir is 1 for an opening one.
+int editorBracketKind(int c, int *dir) {
+    static const char *opening = "([{";
+    static const char *closing = ")]}";
+    char *p;
+
+    if (c == '\0') {
+        return -1;
+    }
+    if ((p = strchr(opening, c)) != NULL) {
+        *dir = 1;
+        return p - opening;
+    }
+    if ((p = strchr(closing, c)) != NULL) {
+        *dir = -1;
+        return p - closing;
+    }
+    return -1;
+}
+
+int isEditorBracketCode(unsigned char hl) {
+    return hl != HL_STRING && hl != HL_COMMENT;
+}
+
+// a is followed by b.
+void addBracketNode(struct bracketNode *a, const struct bracketNode *b) {
+    int k;
+    for (k = 0; k < 3; k++) {
+        struct bracketCount *x = &a->kind[k];
+        const struct bracketCount *y = &b->kind[k];
+        int matched = (x->open < y->close) ? x->open : y->close;
+
+        x->close += y->close - matched;
+        x->open += y->open - matched;
+    }
+}
+
+void sumEditorBracketChunk(int first, int rows, struct bracketNode *sum) {
+    int j;
+
+    memset(sum, 0, sizeof(*sum));
+    for (j = first; j < first + rows; j++) {
+        addBracketNode(sum, getEditorRowBrackets(j));
+    }
+}
+
+// counts the brackets of a render outside strings and comments.
+void countEditorBrackets(const char *render, const unsigned char *highlight, int rsize, struct bracketNode *sum) {
+    int j;
+
+    memset(sum, 0, sizeof(*sum));
+    for (j = 0; j < rsize; j++) {
+        int dir;
+        int k = editorBracketKind(render[j], &dir);
+
+        if (k == -1 || !isEditorBracketCode(highlight[j])) {
+            continue;
+        }
+        if (dir == 1) {
+            sum->kind[k].open++;
+        } else if (sum->kind[k].open) {
+            sum->kind[k].open--;
+        } else {
+            sum->kind[k].close++;
+        }
+    }
+}
+
+// the counts of a row. rows from the file cache may not have them, and get
+// them from their text and the state their colors start from.
+struct bracketNode *getEditorRowBrackets(int at) {
+    static unsigned char *highlight = NULL;
+    static int highlightCap = 0;
+    editorRow *row = &E.row[at];
+
+    if (row->brackets.kind[0].close >= 0) {
+        return &row->brackets;
+    }
+
+    char *render = peekEditorRowRender(row);
+    if (row->rsize > highlightCap) {
+        highlightCap = row->rsize;
+        highlight = (unsigned char *)realloc(highlight, highlightCap);
+        if (highlight == NULL) {
+            die("realloc");
+        }
+    }
+    highlightEditorRender(E.syntax, row->hlStartState, render, row->rsize, highlight);
+    countEditorBrackets(render, highlight, row->rsize, &row->brackets);
+    return &row->brackets;
+}
+
+// counts the brackets of a resident row whose highlight is current.
+void summarizeEditorRowBrackets(int at) {
+    editorRow *row = &E.row[at];
+    struct bracketNode sum;
+
+    countEditorBrackets(row->render, row->highlight, row->rsize, &sum);
+    setEditorRowBrackets(at, &sum);
+}
+
+// sets the brackets row at leaves unmatched and the sums over them.
+void setEditorRowBrackets(int at, const struct bracketNode *sum) {
+    editorRow *row = &E.row[at];
+
+    if (memcmp(sum, &row->brackets, sizeof(*sum)) == 0) {
+        return;
+    }
+    row->brackets = *sum;
+    markEditorRowChunk(at);
+}
+
+// builds the tree, if there is none, and brings its chunks up to date.
+void rebuildEditorBrackets() {
+    int first = 0;
+    int j;
+
+    layoutEditorChunks();
+    flushEditorChunks();
+    if (E.bracketTree) {
+        return;
+    }
+
+    E.bracketTree = (struct bracketNode *)calloc(E.chunkSize * 2, sizeof(struct bracketNode));
+    if (E.bracketTree == NULL) {
+        die("calloc");
+    }
+    for (j = 0; j < E.numChunks; j++) {
+        sumEditorBracketChunk(first, editorChunkRows(j), &E.bracketTree[E.chunkSize + j]);
+        first += editorChunkRows(j);
+    }
+    for (j = E.chunkSize - 1; j >= 1; j--) {
+        E.bracketTree[j] = E.bracketTree[2 * j];
+        addBracketNode(&E.bracketTree[j], &E.bracketTree[2 * j + 1]);
+    }
+}
+
+// the counts seen going through a stretch one way: the brackets that close
+// the ones being matched, then the ones left open for the next stretch.
+int editorBracketMatched(const struct bracketCount *c, int forward) {
+    return forward ? c->close : c->open;
+}
+
+int editorBracketLeft(const struct bracketCount *c, int forward) {
+    return forward ? c->open : c->close;
+}
+
+// the first chunk in the subtree of node, from start on going forward or
+// back, that closes *need brackets. chunks skipped over update *need.
+int findEditorBracketChunk(int node, int lo, int hi, int start, int kind, int forward, int *need) {
+    if (forward ? hi <= start : lo > start) {
+        return -1;
+    }
+
+    const struct bracketCount *c = &E.bracketTree[node].kind[kind];
+    if ((forward ? lo >= start : hi - 1 <= start) && editorBracketMatched(c, forward) < *need) {
+        *need += editorBracketLeft(c, forward) - editorBracketMatched(c, forward);
+        return -1;
+    }
+    if (hi - lo == 1) {
+        return lo;
+    }
+
+    int mid = lo + (hi - lo) / 2;
+    int found;
+    if (forward) {
+        found = findEditorBracketChunk(2 * node, lo, mid, start, kind, forward, need);
+        return (found != -1) ? found : findEditorBracketChunk(2 * node + 1, mid, hi, start, kind, forward, need);
+    }
+    found = findEditorBracketChunk(2 * node + 1, mid, hi, start, kind, forward, need);
+    return (found != -1) ? found : findEditorBracketChunk(2 * node, lo, mid, start, kind, forward, need);
+}
+
+// the row from row on, going forward or back, where need brackets of the
+// kind are closed, or -1. *need is left at what is still open when
+// entering that row.
+int findEditorBracketRow(int row, int kind, int forward, int *need) {
+    int step = forward ? 1 : -1;
+    int first;
+    int chunk = findEditorChunk(row, &first);
+    int end = first + editorChunkRows(chunk);
+    int j = row;
+
+    // first the rest of the chunk the row is in, then the tree for the
+    // chunk that has it, then the rows of that chunk.
+    while (j >= 0 && j < E.numRows) {
+        const struct bracketCount *c = &getEditorRowBrackets(j)->kind[kind];
+        if (editorBracketMatched(c, forward) >= *need) {
+            return j;
+        }
+        *need += editorBracketLeft(c, forward) - editorBracketMatched(c, forward);
+
+        j += step;
+        if (j < first || j >= end) {
+            if (j < 0 || j >= E.numRows) {
+                return -1;
+            }
+            rebuildEditorBrackets();
+            chunk = findEditorBracketChunk(1, 0, E.chunkSize, chunk + step, kind, forward, need);
+            if (chunk == -1 || chunk >= E.numChunks) {
+                return -1;
+            }
+            first = editorChunkStart(chunk);
+            end = first + editorChunkRows(chunk);
+            j = forward ? first : end - 1;
+        }
+    }
+    return -1;
+}
+
+// the render position in the row where need brackets of the kind are
+// closed, scanning from rx one way, or -1. *need is updated on the way.
+int findEditorBracketInRow(editorRow *row, int rx, int kind, int forward, int *need) {
+    int j;
+    for (j = rx; j >= 0 && j < row->rsize; j += forward ? 1 : -1) {
+        int dir;
+        if (editorBracketKind(row->render[j], &dir) != kind || !isEditorBracketCode(row->highlight[j])) {
+            continue;
+        }
+        *need += (dir == 1) == forward ? 1 : -1;
+        if (*need == 0) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+// finds the bracket matching the one at render position rx of the row.
+// returns 0 with its position, or -1.
+int findEditorBracketMatch(int at, int rx, int *matchRow, int *matchRx) {
+    editorRow *row = getEditorRow(at);
+    int dir;
+    int kind = (rx < row->rsize) ? editorBracketKind(row->render[rx], &dir) : -1;
+
+    if (kind == -1 || !isEditorBracketCode(row->highlight[rx])) {
+        return -1;
+    }
+
+    int forward = (dir == 1);
+    int need = 1;
+    int found = findEditorBracketInRow(row, rx + (forward ? 1 : -1), kind, forward, &need);
+    if (found == -1) {
+        int r = findEditorBracketRow(at + (forward ? 1 : -1), kind, forward, &need);
+        if (r == -1) {
+            return -1;
+        }
+        row = getEditorRow(r);
+        found = findEditorBracketInRow(row, forward ? 0 : row->rsize - 1, kind, forward, &need);
+        at = r;
+    }
+    if (found == -1) {
+        return -1;
+    }
+    *matchRow = at;
+    *matchRx = found;
+    return 0;
+}
+
+// the bracket at the cursor, or else just before it, and its match.
+int findEditorCursorBracket(int *matchRow, int *matchRx) {
+    if (E.cy >= E.numRows) {
+        return -1;
+    }
+    editorRow *row = getEditorRow(E.cy);
+    int rx = editorRowCxToRx(row, E.cx);
+
+    if (findEditorBracketMatch(E.cy, rx, matchRow, matchRx) == 0) {
+        return 0;
+    }
+    return (E.cx > 0) ? findEditorBracketMatch(E.cy, editorRowCxToRx(row, E.cx - 1), matchRow, matchRx) : -1;
+}
+
+void jumpEditorBracket() {
+    int row, rx;
+    if (findEditorCursorBracket(&row, &rx) == -1) {
+        setEditorStatusMessage("No matching bracket");
+        return;
+    }
+    E.cy = row;
+    E.cx = editorRowRxToCx(getEditorRow(row), rx);
+}
+
+/*** line interning ***/
+
+// logs and dumps repeat lines a lot: blank lines, headers, stack frames. rows
+// of the same text share one internLine, found by hash, holding the text, the
+// render and, for rows highlighted from the same state, the colors and the
+// brackets, so such a line is stored and highlighted once. rows are interned
+// when they are made or brought back in; an edited row has its own copy until
+// it is packed away.
+
+// where a line of the hash belongs. the high bits of fnv1a are the mixed ones.
+static int editorLineHome(uint64_t hash) {
+    return (int)(hash >> 32) & (E.internCap - 1);
+}
+
+// the slot holding the line s, or the empty one where it goes.
+static struct internSlot *findEditorLineSlot(uint64_t hash, const char *s, int len) {
+    int i = editorLineHome(hash);
+
+    while (E.internSlot[i].line) {
+        struct internLine *line = E.internSlot[i].line;
+        if (E.internSlot[i].hash == hash && line->size == len && memcmp(line->chars, s, len) == 0) {
+            break;
+        }
+        i = (i + 1) & (E.internCap - 1);
+    }
+    return &E.internSlot[i];
+}
+
+void resizeEditorLines(int cap) {
+    struct internSlot *old = E.internSlot;
+    int oldCap = E.internCap;
+    int j;
+
+    E.internSlot = (struct internSlot *)calloc(cap, sizeof(struct internSlot));
+    if (E.internSlot == NULL) {
+        die("calloc");
+    }
+    E.internCap = cap;
+    for (j = 0; j < oldCap; j++) {
+        if (old[j].line) {
+            int i = editorLineHome(old[j].hash);
+            while (E.internSlot[i].line) {
+                i = (i + 1) & (cap - 1);
+            }
+            E.internSlot[i] = old[j];
+        }
+    }
+    free(old);
+}
+
+// the shared line holding s, made if there is none, with a reference taken.
+struct internLine *internEditorLine(const char *s, int len) {
+    uint64_t hash = fnv1a(FNV1A_INIT, s, len);
+
+    if ((E.internCount + 1) * 4 > E.internCap * 3) {
+        resizeEditorLines(E.internCap ? E.internCap * 2 : MACHO_INTERN_SLOTS);
+    }
+    struct internSlot *slot = findEditorLineSlot(hash, s, len);
+    if (slot->line) {
+        slot->line->refs++;
+        return slot->line;
+    }
+
+    struct internLine *line = (struct internLine *)malloc(sizeof(struct internLine) + len + 1);
+    if (line == NULL) {
+        die("malloc");
+    }
+    line->refs = 1;
+    line->size = len;
+    line->hash = hash;
+    memcpy(line->chars, s, len);
+    line->chars[len] = '\0';
+
+    if (memchr(s, '\t', len)) {
+        line->render = renderEditorChars(line->chars, len, &line->rsize);
+    } else {
+        line->render = line->chars;
+        line->rsize = len;
+    }
+    line->highlight = (unsigned char *)malloc(line->rsize ? line->rsize : 1);
+    if (line->highlight == NULL) {
+        die("malloc");
+    }
+    memset(line->highlight, HL_NORMAL, line->rsize);
+    line->hlSyntax = NULL;
+    line->hlValid = 0;
+    line->hlStartState = HL_STATE_NORMAL;
+    line->hlEndState = HL_STATE_NORMAL;
+    memset(&line->brackets, 0, sizeof(line->brackets));
+
+    slot->hash = hash;
+    slot->line = line;
+    E.internCount++;
+    return line;
+}
+
+void releaseEditorLine(struct internLine *line) {
+    if (--line->refs > 0) {
+        return;
+    }
+
+    // with the table gone, everything is being freed.
+    if (E.internSlot) {
+        int mask = E.internCap - 1;
+        int i = editorLineHome(line->hash);
+        int j;
+        while (E.internSlot[i].line != line) {
+            i = (i + 1) & mask;
+        }
+
+        // lines further along that went past the slot move back into it.
+        for (j = (i + 1) & mask; E.internSlot[j].line; j = (j + 1) & mask) {
+            int home = editorLineHome(E.internSlot[j].hash);
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                E.internSlot[i] = E.internSlot[j];
+                i = j;
+            }
+        }
+        E.internSlot[i].line = NULL;
+        E.internCount--;
+        if (E.internCount < E.internCap / 8 && E.internCap > MACHO_INTERN_SLOTS) {
+            resizeEditorLines(E.internCap / 2);
+        }
+    }
+
+    if (line->render != line->chars) {
+        free(line->render);
+    }
+    free(line->highlight);
+    free(line);
+}
+
+// the shared line holding the row's chars, NULL if they are its own. a row
+// only keeps a flag, as the chars are part of the line.
+struct internLine *editorRowLine(editorRow *row) {
+    if (!row->interned) {
+        return NULL;
+    }
+    return (struct internLine *)(row->chars - offsetof(struct internLine, chars));
+}
+
+// points the row at the shared line holding s. until the row is highlighted
+// it shows the colors of the line, whichever they are.
+void shareEditorRow(editorRow *row, const char *s, int len) {
+    struct internLine *line = internEditorLine(s, len);
+
+    row->interned = 1;
+    row->size = len;
+    row->rsize = line->rsize;
+    row->chars = line->chars;
+    row->render = line->render;
+    row->highlight = line->highlight;
+}
+
+// gives the row a copy of its shared line, to be changed.
+void ownEditorRow(editorRow *row) {
+    struct internLine *line = editorRowLine(row);
+    if (line == NULL) {
+        return;
+    }
+
+    ownEditorRowHighlight(row);
+    row->chars = copyEditorBytes(line->chars, line->size);
+    row->render = copyEditorBytes(line->render, line->rsize);
+    row->interned = 0;
+    releaseEditorLine(line);
+}
+
+// frees the row's text, render and colors, or lets go of its shared line.
+void freeEditorRowText(editorRow *row) {
+    dropEditorRowHighlight(row);
+    if (row->interned) {
+        releaseEditorLine(editorRowLine(row));
+        row->interned = 0;
+    } else {
+        free(row->chars);
+        free(row->render);
+    }
+    row->chars = NULL;
+    row->render = NULL;
+    row->highlight = NULL;
+}
+
+// frees the colors of the row unless they are those of its shared line.
+void dropEditorRowHighlight(editorRow *row) {
+    struct internLine *line = editorRowLine(row);
+
+    if (line == NULL || row->highlight != line->highlight) {
+        free(row->highlight);
+    }
+    row->highlight = NULL;
+}
+
+// the row's colors, copied from its shared line first if they are those.
+unsigned char *ownEditorRowHighlight(editorRow *row) {
+    struct internLine *line = editorRowLine(row);
+
+    if (line && row->highlight == line->highlight) {
+        row->highlight = (unsigned char *)malloc(row->rsize ? row->rsize : 1);
+        if (row->highlight == NULL) {
+            die("malloc");
+        }
+        memcpy(row->highlight, line->highlight, row->rsize);
+    }
+    return row->highlight;
+}
+
+// whether the colors of the row's shared line are those it gets highlighted
+// from state start.
+int isEditorLineHighlighted(editorRow *row, int start) {
+    struct internLine *line = editorRowLine(row);
+    return line && line->hlValid && line->hlSyntax == E.syntax && line->hlStartState == start;
+}
+
+// gives row at the colors and brackets of its shared line, for which
+// isEditorLineHighlighted holds. the row is left to be marked done.
+void useEditorLineHighlight(int at) {
+    editorRow *row = &E.row[at];
+    struct internLine *line = editorRowLine(row);
+
+    dropEditorRowHighlight(row);
+    row->highlight = line->highlight;
+    row->hlStartState = line->hlStartState;
+    row->hlEndState = line->hlEndState;
+    setEditorRowBrackets(at, &line->brackets);
+}
+
+// row at was just highlighted, with colors of its own. if its shared line has
+// none yet, or the same ones, the row's become the shared ones.
+void keepEditorLineHighlight(int at) {
+    editorRow *row = &E.row[at];
+    struct internLine *line = editorRowLine(row);
+
+    if (line == NULL || row->highlight == line->highlight) {
+        return;
+    }
+    if (line->hlValid && line->hlSyntax == E.syntax) {
+        if (line->hlStartState == row->hlStartState) {
+            free(row->highlight);
+            row->highlight = line->highlight;
+        }
+        return;
+    }
+
+    // the rows showing the line's colors until now are all waiting for their own.
+    memcpy(line->highlight, row->highlight, row->rsize);
+    free(row->highlight);
+    row->highlight = line->highlight;
+    line->hlValid = 1;
+    line->hlSyntax = E.syntax;
+    line->hlStartState = row->hlStartState;
+    line->hlEndState = row->hlEndState;
+    line->brackets = row->brackets;
+}
+
+/*** row operations ***/
+
+int editorRowCxToRx(editorRow *row, int cx) {
+    int rx = 0;
+    int j;
+
+    for (j = 0; j < cx; j++) {
+        if (row->chars[j] == '\t') {
+            rx += (MACHO_TAB_STOP - 1) - (rx % MACHO_TAB_STOP);
+        }
+        rx++;
+    }
+
+    return rx;
+}
+
+int editorRowRxToCx(editorRow *row, int rx) {
+    int curRx = 0;
+    int cx;
+
+    for (cx = 0; cx < row->size; cx++) {
+        if (row->chars[cx] == '\t') {
+            curRx += (MACHO_TAB_STOP - 1) - (curRx % MACHO_TAB_STOP);
+        }
+        curRx++;
+
+        if(curRx > rx) {
+            return cx;
+        }
+    }
+    
+    return cx;
+}
+
+// size chars with tabs expanded, in a new nul terminated buffer.
+char *renderEditorChars(const char *chars, int size, int *rsize) {
+    int tabs = 0;
+    int j;
+    for (j = 0; j < size; j++) {
+        if (chars[j] == '\t') {
+            tabs++;
+        }
+    }
+
+    char *render = malloc(size + (tabs * (MACHO_TAB_STOP - 1)) + 1);
+
+    int idx = 0;
+    for (j = 0; j < size; j++) {
+        if (chars[j] == '\t') {
+            render[idx++] = ' ';
+            while (idx % MACHO_TAB_STOP != 0) {
+                render[idx++] = ' ';
+            }
+        } else {
+            render[idx++] = chars[j];
+        }
+    }
+    render[idx] = '\0';
+    *rsize = idx;
+    return render;
+}
+
+// rebuilds render from chars, expanding tabs.
+void renderEditorRow(editorRow *row) {
+    free(row->render);
+    row->render = renderEditorChars(row->chars, row->size, &row->rsize);
+
+    if (E.wrap) {
+        wrapEditorRow(row);
+    }
+}
+
+// the row is new or its chars changed. a shared row is new, with its render
+// and blank colors in place already.
+void updateEditorRow(editorRow *row) {
+    if (row->interned) {
+        if (E.wrap) {
+            wrapEditorRow(row);
+        }
+    } else {
+        renderEditorRow(row);
+
+        // the old colors would be drawn out of place on the new text, so the
+        // row is plain until its new ones are ready.
+        row->highlight = (unsigned char *)realloc(row->highlight, row->rsize ? row->rsize : 1);
+        memset(row->highlight, HL_NORMAL, row->rsize);
+    }
+
+    markEditorRowChunk(row - E.row);
+    markEditorDiff(row - E.row, 1);
+    updateEditorSyntax(row);
+}
+
+// grows the row array geometrically, so that adding rows at the end one at a
+// time is amortized constant time.
+void reserveEditorRows(int rows) {
+    if (rows <= E.rowCap) {
+        return;
+    }
+
+    int cap = E.rowCap ? E.rowCap : 64;
+    while (cap < rows) {
+        cap *= 2;
+    }
+    E.row = (editorRow *)realloc(E.row, sizeof(editorRow) * cap);
+    if (E.row == NULL) {
+        die("realloc");
+    }
+    E.rowCap = cap;
+}
+
+// in follow mode, rows added below keep the cursor on the last row if it
+// was there before they came.
+int isEditorCursorAtEnd() {
+    return E.cy >= E.numRows - 1;
+}
+
+void followEditorEnd(int atEnd) {
+    if (E.follow && atEnd && E.numRows > 0) {
+        E.cy = E.numRows - 1;
+        E.cx = 0;
+    }
+}
+
+// fills in a new row holding s, shared with the rows holding the same. it
+// still has to be passed to updateEditorRow.
+void initEditorRow(editorRow *row, const char *s, size_t len) {
+    shareEditorRow(row, s, len);
+
+    row->hlSerial = 0;
+    row->hlDone = 0;
+    row->hlTicket = 0;
+    row->hlStartState = HL_STATE_NORMAL;
+    row->hlEndState = HL_STATE_NORMAL;
+    row->cold = NULL;
+    row->coldAt = 0;
+    row->seen = E.coldClock;
+    memset(&row->brackets, 0, sizeof(row->brackets));
+    row->wrap = NULL;
+    row->wrapLines = 0;
+    row->hashSerial = 0;
+}
+
+// rows [at, at + lines) replaced others, and E.numRows counts them. the diff
+// hashes again the rows between those left in place at either end.
+void markEditorDiff(int at, int lines) {
+    if (at < E.diffFrom) {
+        E.diffFrom = at;
+    }
+    if (E.numRows - at - lines < E.diffAfter) {
+        E.diffAfter = E.numRows - at - lines;
+    }
+}
+
+void insertEditorRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numRows) {
+        return;
+    }
+
+    reserveEditorRows(E.numRows + 1);
+    memmove(&E.row[at + 1], &E.row[at], sizeof(editorRow) * (E.numRows - at));
+    markEditorRows(at, 0, 1);
+    if (at < E.numRows) {
+        E.hlEpoch = E.hlTicket;
+    }
+
+    initEditorRow(&E.row[at], s, len);
+    E.numRows++;
+    spliceEditorFolds(at, 0, 1);
+    updateEditorRow(&E.row[at]);
+
+    recordEditorEdit(EDIT_INSERT_ROW, at, 0, s, len);
+    E.dirty++;
+}
+
+void freeEditorRow(editorRow *row) {
+    if (row->cold) {
+        releaseColdBlock(row->cold);
+    }
+    freeEditorRowText(row);
+    free(row->wrap);
+}
+
+void delEditorRow(int at) {
+    if (at < 0 || at >= E.numRows) {
+        return;
+    }
+
+    recordEditorEdit(EDIT_DELETE_ROW, at, 0, NULL, 0);
+
+    if (E.row[at].hlDone != E.row[at].hlSerial) {
+        E.hlPending--;
+    }
+    freeEditorRow(&E.row[at]);
+    memmove(&E.row[at], &E.row[at + 1], sizeof(editorRow) * (E.numRows - at - 1));
+    markEditorRows(at, 1, 0);
+    E.hlEpoch = E.hlTicket;
+    E.numRows--;
+    markEditorDiff(at, 0);
+    spliceEditorFolds(at, 1, 0);
+    E.dirty++;
+
+    // the row that moved up now follows a different row.
+    if (at < E.numRows && E.row[at].hlStartState != ((at > 0) ? E.row[at - 1].hlEndState : HL_STATE_NORMAL)) {
+        updateEditorSyntax(&E.row[at]);
+    }
+}
+
+// replaces count rows at `at` with the lines of buf, moving the rows after
+// them only once. it brings in changes made on disk, so nothing is recorded.
+// returns the number of rows inserted.
+int spliceEditorRows(int at, int count, const char *buf, long long len) {
+    const char *end = buf + len;
+    const char *p;
+    int lines = 0;
+    int j;
+
+    for (p = buf; p < end; lines++) {
+        const char *nl = (const char *)memchr(p, '\n', end - p);
+        p = nl ? nl + 1 : end;
+    }
+
+    for (j = at; j < at + count; j++) {
+        if (E.row[j].hlDone != E.row[j].hlSerial) {
+            E.hlPending--;
+        }
+        freeEditorRow(&E.row[j]);
+    }
+
+    reserveEditorRows(E.numRows - count + lines);
+    memmove(&E.row[at + lines], &E.row[at + count], sizeof(editorRow) * (E.numRows - at - count));
+    markEditorRows(at, count, lines);
+    if (at + count < E.numRows) {
+        E.hlEpoch = E.hlTicket;
+    }
+    E.numRows += lines - count;
+    markEditorDiff(at, lines);
+    spliceEditorFolds(at, count, lines);
+
+    for (p = buf, j = at; p < end; j++) {
+        const char *nl = (const char *)memchr(p, '\n', end - p);
+        long long lineLen = (nl ? nl : end) - p;
+
+        while (lineLen > 0 && (p[lineLen - 1] == '\n' || p[lineLen - 1] == '\r')) {
+            lineLen--;
+        }
+        initEditorRow(&E.row[j], p, lineLen);
+        p = nl ? nl + 1 : end;
+    }
+    for (j = at; j < at + lines; j++) {
+        updateEditorRow(&E.row[j]);
+    }
+
+    // the row after the new ones may now follow a different state.
+    j = at + lines;
+    if (j < E.numRows && E.row[j].hlStartState != ((j > 0) ? E.row[j - 1].hlEndState : HL_STATE_NORMAL)) {
+        updateEditorSyntax(&E.row[j]);
+    }
+
+    return lines;
+}
+
+int isEditorPermutation(const int32_t *perm, int count) {
+    unsigned char *seen = (unsigned char *)calloc(count ? count : 1, 1);
+    int j;
+
+    for (j = 0; j < count; j++) {
+        if (perm[j] < 0 || perm[j] >= count || seen[perm[j]]) {
+            break;
+        }
+        seen[perm[j]] = 1;
+    }
+    free(seen);
+    return j == count;
+}
+
+// moves row at + perm[j] to at + j. only the row structs move, the text
+// stays where it is.
+void permuteEditorRows(int at, int count, const int32_t *perm) {
+    recordEditorEdit(EDIT_PERMUTE_ROWS, at, count, (const char *)perm, count * sizeof(int32_t));
+
+    editorRow *moved = (editorRow *)malloc(sizeof(editorRow) * (count ? count : 1));
+    int j;
+    for (j = 0; j < count; j++) {
+        moved[j] = E.row[at + perm[j]];
+    }
+    memcpy(&E.row[at], moved, sizeof(editorRow) * count);
+    free(moved);
+    markEditorRows(at, count, count);
+    markEditorDiff(at, count);
+    spliceEditorFolds(at, count, count);
+    E.hlEpoch = E.hlTicket;
+    E.dirty++;
+
+    // rows now follow other rows than the ones they were highlighted after.
+    for (j = at; j <= at + count && j < E.numRows; j++) {
+        if (E.row[j].hlStartState != ((j > 0) ? E.row[j - 1].hlEndState : HL_STATE_NORMAL)) {
+            updateEditorSyntax(&E.row[j]);
+        }
+    }
+}
+
+void insertEditorRowCharacter(editorRow *row, int at, int c) {
+    if (at < 0 || at > row->size) {
+        at = row->size;
+    }
+
+    ownEditorRow(row);
+    row->chars = (char *)realloc(row->chars, row->size + 2);
+    if (row->chars == NULL) {
+        die("realloc");
+    }
+
+    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    row->size++;
+    row->chars[at] = c;
+
+    updateEditorRow(row);
+
+    char ch = c;
+    recordEditorEdit(EDIT_INSERT_CHAR, row - E.row, at, &ch, 1);
+    E.dirty++;
+}
+
+void appendEditorRowString(editorRow *row, char *s, int len) {
+    recordEditorEdit(EDIT_APPEND_STRING, row - E.row, 0, s, len);
+    ownEditorRow(row);
+    row->chars = (char *)realloc(row->chars, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    updateEditorRow(row);
+    E.dirty++;
+}
+
+// replaces the contents of the row with chars, a malloc'd string of size
+// bytes plus a terminating nul, which the row takes over.
+void setEditorRowChars(editorRow *row, char *chars, int size) {
+    recordEditorEdit(EDIT_SET_ROW, row - E.row, 0, chars, size);
+
+    ownEditorRow(row);
+    free(row->chars);
+    row->chars = chars;
+    row->size = size;
+    updateEditorRow(row);
+    E.dirty++;
+}
+
+void truncateEditorRow(editorRow *row, int at) {
+    if (at < 0 || at > row->size) {
+        return;
+    }
+
+    recordEditorEdit(EDIT_TRUNCATE_ROW, row - E.row, at, NULL, 0);
+
+    ownEditorRow(row);
+    row->size = at;
+    row->chars[row->size] = '\0';
+    updateEditorRow(row);
+    E.dirty++;
+}
+
+void delEditorRowChar(editorRow *row, int at) {
+    if (at < 0 || at >= row->size) {
+        return;
+    }
+
+    recordEditorEdit(EDIT_DELETE_CHAR, row - E.row, at, NULL, 0);
+
+    ownEditorRow(row);
+    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    row->size--;
+    updateEditorRow(row);
+    E.dirty++;
+}
+
+/*** cold rows ***/
+
+// rows of a large file that have not been used for a while are packed, with
+// their colors, into compressed blocks and their buffers freed. render is
+// not stored as it is rebuilt from chars when the row is brought back in.
+struct coldBlock {
+    int rows;       // cold rows and clipboard lines using it, the block is freed at 0.
+    int plainLen;
+    int packedLen;
+    unsigned char *packed;
+    off_t fileAt;   // where the rows are in the file as it was opened, -1 if packed with colors.
+    uint64_t fileHash;  // of the bytes there, checked when they are read.
+    int fileSlot;   // in E.fileBlock, until the rows are read in and packed.
+};
+
+// the packed format follows LZ4: each sequence is a token holding a literal
+// length and a match length in 4 bits each, extended by further bytes, the
+// literals, then a 2 byte offset back to where the match is copied from. the
+// last sequence only has literals.
+#define COLD_HASH_BITS 12
+#define COLD_MIN_MATCH 4
+
+int packedColdBound(int len) {
+    return len + len / 255 + 16;
+}
+
+static uint32_t readColdWord(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned char *writeColdLength(unsigned char *out, int len) {
+    for (len -= 15; len >= 255; len -= 255) {
+        *out++ = 255;
+    }
+    *out++ = (unsigned char)len;
+    return out;
+}
+
+static unsigned char *writeColdSequence(unsigned char *out, const unsigned char *literals, int literalLen, int offset, int matchLen) {
+    int matchCode = offset ? matchLen - COLD_MIN_MATCH : 0;
+
+    *out++ = (unsigned char)(((literalLen < 15 ? literalLen : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+    if (literalLen >= 15) {
+        out = writeColdLength(out, literalLen);
+    }
+    memcpy(out, literals, literalLen);
+    out += literalLen;
+
+    if (offset) {
+        *out++ = offset & 0xff;
+        *out++ = offset >> 8;
+        if (matchCode >= 15) {
+            out = writeColdLength(out, matchCode);
+        }
+    }
+    return out;
+}
+
+// compresses len bytes of src into dst, which must hold packedColdBound(len)
+// bytes. returns the packed length.
+int packColdBytes(const unsigned char *src, int len, unsigned char *dst) {
+    int table[1 << COLD_HASH_BITS];
+    unsigned char *out = dst;
+    int anchor = 0;
+    int i = 0;
+
+    memset(table, 0xff, sizeof(table));
+    while (i + COLD_MIN_MATCH <= len) {
+        uint32_t word = readColdWord(&src[i]);
+        int slot = (word * 2654435761u) >> (32 - COLD_HASH_BITS);
+        int ref = table[slot];
+        table[slot] = i;
+
+        if (ref < 0 || i - ref > 0xffff || readColdWord(&src[ref]) != word) {
+            // step faster through data that does not compress.
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+
+        int matchLen = COLD_MIN_MATCH;
+        while (i + matchLen < len && src[ref + matchLen] == src[i + matchLen]) {
+            matchLen++;
+        }
+
+        out = writeColdSequence(out, &src[anchor], i - anchor, i - ref, matchLen);
+        i += matchLen;
+        anchor = i;
+    }
+
+    out = writeColdSequence(out, &src[anchor], len - anchor, 0, 0);
+    return out - dst;
+}
+
+static const unsigned char *readColdLength(const unsigned char *p, int *len) {
+    int b;
+    do {
+        b = *p++;
+        *len += b;
+    } while (b == 255);
+    return p;
+}
+
+// reverses packColdBytes. returns the unpacked length.
+int unpackColdBytes(const unsigned char *src, int len, unsigned char *dst) {
+    const unsigned char *p = src;
+    const unsigned char *end = src + len;
+    unsigned char *out = dst;
+
+    while (p < end) {
+        int token = *p++;
+
+        int literalLen = token >> 4;
+        if (literalLen == 15) {
+            p = readColdLength(p, &literalLen);
+        }
+        memcpy(out, p, literalLen);
+        out += literalLen;
+        p += literalLen;
+        if (p >= end) {
+            break;
+        }
+
+        int offset = p[0] | (p[1] << 8);
+        p += 2;
+        int matchLen = token & 15;
+        if (matchLen == 15) {
+            p = readColdLength(p, &matchLen);
+        }
+        matchLen += COLD_MIN_MATCH;
+
+        // byte by byte, as the match may overlap what it is copying.
+        const unsigned char *ref = out - offset;
+        while (matchLen--) {
+            *out++ = *ref++;
+        }
+    }
+
+    return out - dst;
+}
+
+// the unpacked bytes of the block. the last block unpacked is kept, so
+// going through the rows in order unpacks each block once.
+unsigned char *unpackColdBlock(struct coldBlock *block) {
+    if (E.coldCache != block) {
+        // a block of empty rows still gets a buffer to point into.
+        if (E.coldPlain == NULL || block->plainLen > E.coldPlainCap) {
+            E.coldPlainCap = block->plainLen ? block->plainLen : 1;
+            E.coldPlain = (unsigned char *)realloc(E.coldPlain, E.coldPlainCap);
+            if (E.coldPlain == NULL) {
+                die("realloc");
+            }
+        }
+        if (block->fileAt >= 0 && block->packed == NULL) {
+            readEditorFileBlock(block, E.coldPlain);
+        } else {
+            unpackColdBytes(block->packed, block->packedLen, E.coldPlain);
+        }
+        E.coldCache = block;
+    }
+
+    return E.coldPlain;
+}
+
+void releaseColdBlock(struct coldBlock *block) {
+    if (--block->rows > 0) {
+        return;
+    }
+
+    if (E.coldCache == block) {
+        E.coldCache = NULL;
+    }
+    if (block->fileAt >= 0 && block->packed == NULL) {
+        dropEditorFileBlock(block);
+    }
+    free(block->packed);
+    free(block);
+}
+
+void thawEditorRow(editorRow *row) {
+    struct coldBlock *block = row->cold;
+    unsigned char *plain = unpackColdBlock(block);
+    int at = row - E.row;
+    int done = (row->hlDone == row->hlSerial);
+
+    row->cold = NULL;
+    shareEditorRow(row, (char *)&plain[row->coldAt], row->size);
+    if (E.wrap) {
+        wrapEditorRow(row);
+    }
+
+    if (done && isEditorLineHighlighted(row, row->hlStartState)) {
+        useEditorLineHighlight(at);
+        releaseColdBlock(block);
+        return;
+    }
+
+    row->highlight = (unsigned char *)malloc(row->rsize ? row->rsize : 1);
+    if (row->highlight == NULL) {
+        die("malloc");
+    }
+
+    // a row still in the file has no colors stored, only the state they
+    // start from.
+    if (block->fileAt >= 0) {
+        highlightEditorRender(E.syntax, row->hlStartState, row->render, row->rsize, row->highlight);
+        if (row->brackets.kind[0].close < 0) {
+            summarizeEditorRowBrackets(at);
+        }
+    } else {
+        memcpy(row->highlight, &plain[row->coldAt + row->size], row->rsize);
+    }
+    if (done) {
+        keepEditorLineHighlight(at);
+    }
+    releaseColdBlock(block);
+}
+
+// the row, brought back in if it was cold. anything that reads or changes
+// the contents of a row goes through here.
+editorRow *getEditorRow(int at) {
+    editorRow *row = &E.row[at];
+
+    row->seen = E.coldClock;
+    if (row->cold) {
+        thawEditorRow(row);
+    }
+    return row;
+}
+
+// the chars of the row without bringing it back in. they are not nul
+// terminated, and stay valid until a row from another block is looked at.
+char *peekEditorRow(editorRow *row) {
+    if (row->cold == NULL) {
+        return row->chars;
+    }
+    return (char *)unpackColdBlock(row->cold) + row->coldAt;
+}
+
+// the render of the row without bringing it back in. that of a cold row
+// with tabs is rebuilt in a scratch buffer, which the next call reuses.
+char *peekEditorRowRender(editorRow *row) {
+    static char *render = NULL;
+    static int renderCap = 0;
+    char *chars = peekEditorRow(row);
+    int len = 0;
+    int j;
+
+    if (row->cold == NULL || memchr(chars, '\t', row->size) == NULL) {
+        return (row->cold == NULL) ? row->render : chars;
+    }
+
+    if (row->rsize > renderCap) {
+        renderCap = row->rsize;
+        render = (char *)realloc(render, renderCap);
+        if (render == NULL) {
+            die("realloc");
+        }
+    }
+    for (j = 0; j < row->size; j++) {
+        if (chars[j] == '\t') {
+            do {
+                render[len++] = ' ';
+            } while (len % MACHO_TAB_STOP != 0);
+        } else {
+            render[len++] = chars[j];
+        }
+    }
+    return render;
+}
+
+// packs rows [start, end) into a new block and frees their buffers.
+void freezeEditorRows(int start, int end) {
+    int plainLen = 0;
+    int at;
+
+    for (at = start; at < end; at++) {
+        plainLen += E.row[at].size + E.row[at].rsize;
+    }
+
+    unsigned char *plain = (unsigned char *)malloc(plainLen);
+    struct coldBlock *block = (struct coldBlock *)malloc(sizeof(struct coldBlock));
+    if (plain == NULL || block == NULL) {
+        die("malloc");
+    }
+
+    int offset = 0;
+    for (at = start; at < end; at++) {
+        editorRow *row = &E.row[at];
+
+        row->coldAt = offset;
+        memcpy(&plain[offset], row->chars, row->size);
+        offset += row->size;
+        memcpy(&plain[offset], row->highlight, row->rsize);
+        offset += row->rsize;
+    }
+
+    block->rows = end - start;
+    block->plainLen = plainLen;
+    block->fileAt = -1;
+    block->packed = (unsigned char *)malloc(packedColdBound(plainLen));
+    if (block->packed == NULL) {
+        die("malloc");
+    }
+    block->packedLen = packColdBytes(plain, plainLen, block->packed);
+    block->packed = (unsigned char *)realloc(block->packed, block->packedLen ? block->packedLen : 1);
+    free(plain);
+
+    for (at = start; at < end; at++) {
+        editorRow *row = &E.row[at];
+
+        freeEditorRowText(row);
+        free(row->wrap);
+        row->wrap = NULL;
+        row->cold = block;
+    }
+}
+
+// rows waiting for colors are left alone, as the highlighter needs them.
+int isEditorRowPackable(editorRow *row) {
+    return row->cold == NULL && row->hlDone == row->hlSerial && row->hlTicket == 0;
+}
+
+int canFreezeEditorRow(editorRow *row) {
+    return isEditorRowPackable(row) && E.coldClock - row->seen >= MACHO_COLD_AGE;
+}
+
+// packs runs of unused rows in a bounded slice of the file. returns 1 if it
+// should be called again soon, 0 once a whole pass over the file found
+// nothing to pack.
+int coolEditorRows() {
+    int end = E.coldSweep + MACHO_COLD_SCAN;
+    int runStart = -1;
+    int runBytes = 0;
+    int at;
+
+    if (end > E.numRows) {
+        end = E.numRows;
+    }
+
+    for (at = E.coldSweep; at < end; at++) {
+        editorRow *row = &E.row[at];
+
+        if (!canFreezeEditorRow(row)) {
+            if (runStart >= 0 && at - runStart >= MACHO_COLD_RUN) {
+                freezeEditorRows(runStart, at);
+                E.coldLapPacked += at - runStart;
+            }
+            runStart = -1;
+            continue;
+        }
+
+        if (runStart < 0) {
+            runStart = at;
+            runBytes = 0;
+        }
+        runBytes += row->size + row->rsize + 1;
+        if (runBytes >= MACHO_COLD_BLOCK) {
+            freezeEditorRows(runStart, at + 1);
+            E.coldLapPacked += at + 1 - runStart;
+            runStart = -1;
+        }
+    }
+
+    // a run cut short by the end of the slice is picked up by the next pass.
+    if (runStart >= 0) {
+        if (end < E.numRows) {
+            end = runStart;
+        } else if (end - runStart >= MACHO_COLD_RUN) {
+            freezeEditorRows(runStart, end);
+            E.coldLapPacked += end - runStart;
+        }
+    }
+
+    if (end < E.numRows) {
+        E.coldSweep = end;
+        return 1;
+    }
+
+    int packed = E.coldLapPacked;
+    E.coldSweep = 0;
+    E.coldLapPacked = 0;
+
+#ifdef __GLIBC__
+    // the freed rows are scattered over the heap, hand their pages back.
+    if (packed) {
+        malloc_trim(0);
+    }
+#endif
+    return packed > 0;
+}
+
+/*** clipboard ***/
+
+// the clipboard holds lines by reference: a share in the cold block of a
+// packed row, or in the interned line of any other. only a large range of
+// a file that cools is packed first, so the clip takes little memory once
+// the rows are cut. pasting adds rows pointing into the same blocks, with
+// the colors they had, so a row is only unpacked into buffers of its own
+// once it is looked at or changed.
+
+// packs the rows of [at, at + count) that can be, in blocks of up to
+// MACHO_COLD_BLOCK bytes.
+void freezeEditorRange(int at, int count) {
+    int runStart = -1;
+    int runBytes = 0;
+    int j;
+
+    for (j = at; j <= at + count; j++) {
+        editorRow *row = (j < at + count) ? &E.row[j] : NULL;
+        int packable = row && isEditorRowPackable(row);
+
+        if (runStart >= 0 && (!packable || runBytes >= MACHO_COLD_BLOCK)) {
+            freezeEditorRows(runStart, j);
+            runStart = -1;
+        }
+        if (packable) {
+            if (runStart < 0) {
+                runStart = j;
+                runBytes = 0;
+            }
+            runBytes += row->size + row->rsize + 1;
+        }
+    }
+}
+
+// takes the rows of [at, at + count) into a new clip holding one reference.
+struct editorClip *makeEditorClip(int at, int count) {
+    struct editorClip *clip = (struct editorClip *)malloc(sizeof(struct editorClip));
+    clip->line = (struct clipLine *)malloc(sizeof(struct clipLine) * (count ? count : 1));
+    if (clip->line == NULL) {
+        die("malloc");
+    }
+    clip->refs = 1;
+    clip->count = count;
+
+    if (E.numRows >= MACHO_COLD_ROWS && count >= MACHO_CLIP_PACK) {
+        freezeEditorRange(at, count);
+    }
+
+    int j;
+    for (j = 0; j < count; j++) {
+        editorRow *row = &E.row[at + j];
+        struct clipLine *line = &clip->line[j];
+
+        line->cold = row->cold;
+        line->intern = NULL;
+        line->chars = NULL;
+        if (row->cold == NULL) {
+            line->intern = editorRowLine(row);
+            if (line->intern) {
+                line->intern->refs++;
+            } else {
+                line->intern = internEditorLine(row->chars, row->size);
+            }
+            line->chars = line->intern->chars;
+        }
+        line->coldAt = row->coldAt;
+        line->size = row->size;
+        line->rsize = row->rsize;
+        line->startState = row->hlStartState;
+        line->endState = row->hlEndState;
+        line->brackets = row->brackets;
+        if (row->cold) {
+            row->cold->rows++;
+        }
+    }
+    return clip;
+}
+
+void releaseEditorClip(struct editorClip *clip) {
+    if (clip == NULL || --clip->refs > 0) {
+        return;
+    }
+
+    int j;
+    for (j = 0; j < clip->count; j++) {
+        if (clip->line[j].cold) {
+            releaseColdBlock(clip->line[j].cold);
+        } else {
+            releaseEditorLine(clip->line[j].intern);
+        }
+    }
+    free(clip->line);
+    free(clip);
+}
+
+// the text of a line, not nul terminated. it stays valid until a row or a
+// line from another block is looked at.
+char *peekEditorClipLine(struct clipLine *line) {
+    return line->cold ? (char *)unpackColdBlock(line->cold) + line->coldAt : line->chars;
+}
+
+// the journal gets the text of pasted lines, a bounded run of them per
+// record, so pasting a large clip does not build one record as large.
+void journalEditorClip(int at, struct editorClip *clip) {
+    char *buf = NULL;
+    int len = 0;
+    int cap = 0;
+    int first = 0;
+    int j;
+
+    if (E.journalSuspended || E.fileName == NULL) {
+        return;
+    }
+
+    for (j = 0; j <= clip->count; j++) {
+        if (j == clip->count || (len && len + clip->line[j].size + 1 > MACHO_JOURNAL_FLUSH)) {
+            if (j > first) {
+                journalEditorEdit(EDIT_INSERT_ROWS, at + first, j - first, buf, len);
+            }
+            len = 0;
+            first = j;
+            if (j == clip->count) {
+                break;
+            }
+        }
+
+        struct clipLine *line = &clip->line[j];
+        if (len + line->size + 1 > cap) {
+            cap = (len + line->size + 1) * 2;
+            buf = (char *)realloc(buf, cap);
+            if (buf == NULL) {
+                die("realloc");
+            }
+        }
+        memcpy(&buf[len], peekEditorClipLine(line), line->size);
+        len += line->size;
+        buf[len++] = '\n';
+    }
+    free(buf);
+}
+
+// inserts the lines of the clip as rows at `at`. lines from blocks come in
+// packed, and keep their colors unless they now follow a different state.
+int pasteEditorClip(int at, struct editorClip *clip) {
+    int count = clip->count;
+    int j;
+
+    if (at < 0 || at > E.numRows) {
+        return -1;
+    }
+
+    if (!E.undoSuspended) {
+        pushEditorUndo(EDIT_INSERT_ROWS, at, count, NULL, 0);
+    }
+    journalEditorClip(at, clip);
+
+    reserveEditorRows(E.numRows + count);
+    memmove(&E.row[at + count], &E.row[at], sizeof(editorRow) * (E.numRows - at));
+    markEditorRows(at, 0, count);
+    if (at < E.numRows) {
+        E.hlEpoch = E.hlTicket;
+    }
+    E.numRows += count;
+    markEditorDiff(at, count);
+    spliceEditorFolds(at, 0, count);
+
+    for (j = 0; j < count; j++) {
+        struct clipLine *line = &clip->line[j];
+        editorRow *row = &E.row[at + j];
+
+        if (line->cold == NULL) {
+            initEditorRow(row, line->chars, line->size);
+            continue;
+        }
+        row->size = line->size;
+        row->rsize = line->rsize;
+        row->chars = NULL;
+        row->render = NULL;
+        row->highlight = NULL;
+        row->interned = 0;
+        row->hlSerial = ++E.hlSerial;
+        row->hlDone = row->hlSerial;
+        row->hlTicket = 0;
+        row->hlStartState = line->startState;
+        row->hlEndState = line->endState;
+        row->cold = line->cold;
+        row->coldAt = line->coldAt;
+        row->seen = E.coldClock;
+        row->brackets = line->brackets;
+        row->wrap = NULL;
+        row->wrapLines = 0;
+        row->hashSerial = 0;
+        row->cold->rows++;
+    }
+
+    // only once every new row is in place, as highlighting may run on.
+    for (j = 0; j < count; j++) {
+        if (clip->line[j].cold == NULL) {
+            updateEditorRow(&E.row[at + j]);
+        }
+    }
+    for (j = at; j <= at + count && j < E.numRows; j += count ? count : 1) {
+        if (E.row[j].hlStartState != ((j > 0) ? E.row[j - 1].hlEndState : HL_STATE_NORMAL)) {
+            updateEditorSyntax(&E.row[j]);
+        }
+    }
+
+    E.dirty++;
+    return 0;
+}
+
+void delEditorRows(int at, int count) {
+    int j;
+
+    recordEditorEdit(EDIT_DELETE_ROWS, at, count, NULL, 0);
+
+    for (j = at; j < at + count; j++) {
+        if (E.row[j].hlDone != E.row[j].hlSerial) {
+            E.hlPending--;
+        }
+        freeEditorRow(&E.row[j]);
+    }
+    memmove(&E.row[at], &E.row[at + count], sizeof(editorRow) * (E.numRows - at - count));
+    markEditorRows(at, count, 0);
+    E.hlEpoch = E.hlTicket;
+    E.numRows -= count;
+    markEditorDiff(at, 0);
+    spliceEditorFolds(at, count, 0);
+    E.dirty++;
+
+    if (at < E.numRows && E.row[at].hlStartState != ((at > 0) ? E.row[at - 1].hlEndState : HL_STATE_NORMAL)) {
+        updateEditorSyntax(&E.row[at]);
+    }
+}
+
+// the rows from the mark to the cursor, or the cursor row without a mark.
+int getEditorSelection(int *at, int *count) {
+    int first = E.cy;
+    int last = E.cy;
+
+    if (E.markRow >= 0) {
+        first = (E.markRow < E.cy) ? E.markRow : E.cy;
+        last = (E.markRow < E.cy) ? E.cy : E.markRow;
+    }
+    if (last >= E.numRows) {
+        last = E.numRows - 1;
+    }
+    if (first > last) {
+        return -1;
+    }
+
+    *at = first;
+    *count = last - first + 1;
+    return 0;
+}
+
+int isEditorRowSelected(int at) {
+    if (E.markRow < 0) {
+        return 0;
+    }
+    return (E.markRow < E.cy) ? (at >= E.markRow && at <= E.cy) : (at >= E.cy && at <= E.markRow);
+}
+
+void toggleEditorMark() {
+    if (E.markRow >= 0) {
+        E.markRow = -1;
+        return;
+    }
+    E.markRow = E.cy;
+    setEditorStatusMessage("Mark set, move the cursor to select lines");
+}
+
+void copyEditorLines(int cut) {
+    int at, count;
+
+    if (cut && isEditorReadOnly()) {
+        return;
+    }
+    if (getEditorSelection(&at, &count) == -1) {
+        setEditorStatusMessage("No lines to %s", cut ? "cut" : "copy");
+        return;
+    }
+
+    releaseEditorClip(E.clip);
+    E.clip = makeEditorClip(at, count);
+    E.markRow = -1;
+
+    if (cut) {
+        delEditorRows(at, count);
+        clearEditorCursors();
+        E.cy = at;
+        E.cx = 0;
+    }
+    setEditorStatusMessage("%s %d line%s", cut ? "Cut" : "Copied", count, count == 1 ? "" : "s");
+}
+
+// pastes the clipboard above the cursor row.
+void pasteEditorLines() {
+    if (isEditorReadOnly()) {
+        return;
+    }
+    if (E.clip == NULL) {
+        setEditorStatusMessage("Nothing to paste");
+        return;
+    }
+
+    int at = (E.cy < E.numRows) ? E.cy : E.numRows;
+    pasteEditorClip(at, E.clip);
+    clearEditorCursors();
+    E.markRow = -1;
+    E.cy = at + E.clip->count;
+    E.cx = 0;
+    setEditorStatusMessage("Pasted %d line%s", E.clip->count, E.clip->count == 1 ? "" : "s");
+}
+
+/*** soft wrap ***/
+
+// with wrapping on, a row longer than the screen goes on over as many
+// screen lines as it needs, broken after the last space that fits. resident
+// rows keep where they break next to their render; every row keeps how many
+// screen lines it takes, cold ones too. those counts are summed up in
+// chunks and the chunks in a segment tree, so going between rows and screen
+// lines takes O(log n) however many rows there are. as with the bracket
+// tree, a changed row or rows added or removed only update their chunk.
+
+// the screen lines the render takes at the given width. breaks, if not
+// NULL, gets where each line after the first starts.
+int countEditorWraps(const char *render, int rsize, int width, int *breaks) {
+    int start = 0;
+    int lines = 1;
+
+    while (rsize - start > width) {
+        int end = start + width;
+        int k;
+
+        for (k = end; k > start + 1 && render[k - 1] != ' '; k--);
+        if (k == start + 1) {
+            k = end;
+        }
+        if (breaks) {
+            breaks[lines - 1] = k;
+        }
+        lines++;
+        start = k;
+    }
+    return lines;
+}
+
+// works out where the render of a resident row breaks.
+void wrapEditorRow(editorRow *row) {
+    int lines = countEditorWraps(row->render, row->rsize, E.wrapWidth, NULL);
+
+    free(row->wrap);
+    row->wrap = NULL;
+    if (lines > 1) {
+        row->wrap = (int *)malloc(sizeof(int) * (lines - 1));
+        countEditorWraps(row->render, row->rsize, E.wrapWidth, row->wrap);
+    }
+
+    if (lines != row->wrapLines) {
+        row->wrapLines = lines;
+        markEditorRowChunk(row - E.row);
+    }
+}
+
+// the screen lines row at takes, 0 if it is folded away.
+int editorRowWrapLines(int at) {
+    editorRow *row = &E.row[at];
+
+    if (isEditorRowHidden(at)) {
+        return 0;
+    }
+    if (!E.wrap) {
+        return 1;
+    }
+    if (row->wrapLines == 0) {
+        row->wrapLines = countEditorWraps(peekEditorRowRender(row), row->rsize, E.wrapWidth, NULL);
+    }
+    return row->wrapLines;
+}
+
+int sumEditorWrapChunk(int first, int rows) {
+    int sum = 0;
+    int j;
+
+    for (j = first; j < first + rows; j++) {
+        sum += editorRowWrapLines(j);
+    }
+    return sum;
+}
+
+// builds the tree, if there is none, and brings its chunks up to date.
+void rebuildEditorWraps() {
+    int first = 0;
+    int j;
+
+    layoutEditorChunks();
+    flushEditorChunks();
+    if (E.wrapTree) {
+        return;
+    }
+
+    E.wrapTree = (int *)calloc(E.chunkSize * 2, sizeof(int));
+    if (E.wrapTree == NULL) {
+        die("calloc");
+    }
+    for (j = 0; j < E.numChunks; j++) {
+        E.wrapTree[E.chunkSize + j] = sumEditorWrapChunk(first, editorChunkRows(j));
+        first += editorChunkRows(j);
+    }
+    for (j = E.chunkSize - 1; j >= 1; j--) {
+        E.wrapTree[j] = E.wrapTree[2 * j] + E.wrapTree[2 * j + 1];
+    }
+}
+
+// the screen line row at starts on, counting from the top of the file.
+int editorWrapLineOf(int at) {
+    int line = 0;
+    int first;
+    int chunk;
+    int lo, hi, j;
+
+    rebuildEditorWraps();
+    if (at >= E.numRows) {
+        return E.wrapTree[1];
+    }
+    chunk = findEditorChunk(at, &first);
+    for (lo = E.chunkSize, hi = E.chunkSize + chunk; lo < hi; lo /= 2, hi /= 2) {
+        if (lo & 1) {
+            line += E.wrapTree[lo++];
+        }
+        if (hi & 1) {
+            line += E.wrapTree[--hi];
+        }
+    }
+    for (j = first; j < at; j++) {
+        line += editorRowWrapLines(j);
+    }
+    return line;
+}
+
+// the row screen line `line` belongs to, and in *seg which of its lines it
+// is. past the end that is E.numRows.
+int findEditorWrapLine(int line, int *seg) {
+    int node = 1;
+
+    rebuildEditorWraps();
+    *seg = 0;
+    if (line < 0) {
+        return 0;
+    }
+    if (E.numRows == 0 || line >= E.wrapTree[1]) {
+        return E.numRows;
+    }
+
+    while (node < E.chunkSize) {
+        if (line < E.wrapTree[2 * node]) {
+            node = 2 * node;
+        } else {
+            line -= E.wrapTree[2 * node];
+            node = 2 * node + 1;
+        }
+    }
+
+    int at = editorChunkStart(node - E.chunkSize);
+    while (line >= editorRowWrapLines(at)) {
+        line -= editorRowWrapLines(at);
+        at++;
+    }
+    *seg = line;
+    return at;
+}
+
+// where screen line seg of a resident row starts in its render.
+int editorWrapStart(editorRow *row, int seg) {
+    return (seg > 0 && row->wrap) ? row->wrap[seg - 1] : 0;
+}
+
+int editorWrapEnd(editorRow *row, int seg) {
+    return (seg + 1 < row->wrapLines && row->wrap) ? row->wrap[seg] : row->rsize;
+}
+
+// the screen line of a resident row render position rx is on.
+int editorWrapSegment(editorRow *row, int rx) {
+    int lo = 0;
+    int hi = row->wrapLines - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (row->wrap[mid - 1] <= rx) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// the screen line of the cursor, counting from the top of the file.
+int editorWrapCursorLine() {
+    int line = editorWrapLineOf(E.cy);
+    if (E.cy < E.numRows) {
+        line += editorWrapSegment(getEditorRow(E.cy), E.rx);
+    }
+    return line;
+}
+
+// wraps every row again at the columns left for the text, or unwraps them
+// when wrapping is off.
+void rewrapEditorRows() {
+    int j;
+
+    E.wrapWidth = editorTextColumns();
+    for (j = 0; j < E.numRows; j++) {
+        editorRow *row = &E.row[j];
+
+        free(row->wrap);
+        row->wrap = NULL;
+        row->wrapLines = 0;
+        if (E.wrap && row->cold == NULL) {
+            wrapEditorRow(row);
+        }
+    }
+    free(E.wrapTree);
+    E.wrapTree = NULL;
+    E.wrapOffset = 0;
+    E.colOffset = 0;
+}
+
+void toggleEditorWrap() {
+    E.wrap = !E.wrap;
+    rewrapEditorRows();
+    setEditorStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+}
+
+// moves the cursor and the screen by a page of screen lines, keeping the
+// cursor in the same column of its screen line.
+void pageEditorWrapped(int dir) {
+    int total = editorWrapLineOf(E.numRows);
+    int line = editorWrapCursorLine();
+    int col = 0;
+
+    if (E.cy < E.numRows) {
+        editorRow *row = getEditorRow(E.cy);
+        col = E.rx - editorWrapStart(row, editorWrapSegment(row, E.rx));
+    }
+
+    line += dir * E.screenRows;
+    if (line > total) {
+        line = total;
+    }
+
+    int seg;
+    E.cy = findEditorWrapLine(line, &seg);
+    E.cx = 0;
+    if (E.cy < E.numRows) {
+        editorRow *row = getEditorRow(E.cy);
+        int rx = editorWrapStart(row, seg) + col;
+        int end = editorWrapEnd(row, seg);
+
+        if (rx > end) {
+            rx = end;
+        }
+        E.cx = editorRowRxToCx(row, rx);
+        E.rx = rx;
+    }
+
+    int top = editorWrapLineOf(E.rowOffset) + E.wrapOffset + dir * E.screenRows;
+    E.rowOffset = findEditorWrapLine(top < 0 ? 0 : top, &E.wrapOffset);
+}
+
+/*** folding ***/
+
+// Ctrl-T folds the block starting on the cursor row: up to the brace that
+// closes the ones the row leaves open, or else the rows indented further
+// than it. the row stays in sight and the rows of the block are hidden. the
+// folds are kept sorted and apart, so the fold hiding a row is found by
+// binary search. a hidden row takes no screen lines in the wrap tree, which
+// then maps screen lines to rows around the folds in O(log n), wrapped or
+// not; hidden rows are never rendered or highlighted for the screen.
+
+// the fold hiding row at, -1 if it is not hidden.
+int findEditorFold(int at) {
+    int lo = 0;
+    int hi = E.numFolds - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (E.fold[mid].start >= at) {
+            hi = mid - 1;
+        } else if (E.fold[mid].end < at) {
+            lo = mid + 1;
+        } else {
+            return mid;
+        }
+    }
+    return -1;
+}
+
+int isEditorRowHidden(int at) {
+    return E.numFolds > 0 && findEditorFold(at) != -1;
+}
+
+// the first row in sight after row at.
+int nextEditorVisibleRow(int at) {
+    int k = E.numFolds ? findEditorFold(at + 1) : -1;
+    return (k == -1) ? at + 1 : E.fold[k].end + 1;
+}
+
+// the last row in sight before row at.
+int prevEditorVisibleRow(int at) {
+    int k = E.numFolds ? findEditorFold(at - 1) : -1;
+    return (k == -1) ? at - 1 : E.fold[k].start;
+}
+
+// recounts the screen lines of rows [from, to] in the wrap tree.
+void updateEditorFoldLines(int from, int to) {
+    int first;
+    int chunk;
+
+    if (E.chunkTree == NULL) {
+        return;
+    }
+    for (chunk = findEditorChunk(from, &first); chunk < E.numChunks && first <= to; chunk++) {
+        markEditorChunk(chunk);
+        first += editorChunkRows(chunk);
+    }
+}
+
+// hides rows (start, end], taking in the folds within them.
+void addEditorFold(int start, int end) {
+    int lo = 0;
+    int hi;
+
+    while (lo < E.numFolds && E.fold[lo].start < start) {
+        lo++;
+    }
+    for (hi = lo; hi < E.numFolds && E.fold[hi].start <= end; hi++) {
+        if (E.fold[hi].end > end) {
+            end = E.fold[hi].end;
+        }
+    }
+
+    if (lo == hi && E.numFolds == E.foldCap) {
+        E.foldCap = E.foldCap ? E.foldCap * 2 : 16;
+        E.fold = (struct editorFold *)realloc(E.fold, sizeof(struct editorFold) * E.foldCap);
+        if (E.fold == NULL) {
+            die("realloc");
+        }
+    }
+    memmove(&E.fold[lo + 1], &E.fold[hi], sizeof(struct editorFold) * (E.numFolds - hi));
+    E.numFolds += 1 - (hi - lo);
+    E.fold[lo].start = start;
+    E.fold[lo].end = end;
+
+    updateEditorFoldLines(start + 1, end);
+}
+
+void removeEditorFold(int k) {
+    int start = E.fold[k].start;
+    int end = E.fold[k].end;
+
+    memmove(&E.fold[k], &E.fold[k + 1], sizeof(struct editorFold) * (E.numFolds - k - 1));
+    E.numFolds--;
+    updateEditorFoldLines(start + 1, end);
+}
+
+// unfolds the folds hiding row at.
+void revealEditorRow(int at) {
+    int k;
+    while (E.numFolds && (k = findEditorFold(at)) != -1) {
+        removeEditorFold(k);
+    }
+}
+
+// rows [at, at + removed) were replaced by `lines` others. folds after them
+// move, folds around them grow or shrink, and a fold whose row in sight was
+// replaced goes, bringing the rows it hid after them back in sight.
+void spliceEditorFolds(int at, int removed, int lines) {
+    int j, k;
+
+    for (j = 0, k = 0; j < E.numFolds; j++) {
+        struct editorFold f = E.fold[j];
+
+        if (f.start >= at + removed) {
+            f.start += lines - removed;
+            f.end += lines - removed;
+        } else if (f.start >= at) {
+            if (f.end >= at + removed) {
+                updateEditorFoldLines(at, f.end + lines - removed);
+            }
+            continue;
+        } else if (f.end >= at) {
+            f.end = (f.end >= at + removed) ? f.end + lines - removed : at + lines - 1;
+            if (f.end <= f.start) {
+                continue;
+            }
+        }
+        E.fold[k++] = f;
+    }
+    E.numFolds = k;
+}
+
+// the columns a row is indented by, or -1 if it is blank.
+int editorRowIndent(int at) {
+    editorRow *row = &E.row[at];
+    char *chars = peekEditorRow(row);
+    int indent = 0;
+    int j;
+
+    for (j = 0; j < row->size; j++) {
+        if (chars[j] == '\t') {
+            indent += MACHO_TAB_STOP - indent % MACHO_TAB_STOP;
+        } else if (chars[j] == ' ') {
+            indent++;
+        } else {
+            return indent;
+        }
+    }
+    return -1;
+}
+
+// the last row of the block starting at row at, or at if there is none.
+int findEditorBlockEnd(int at) {
+    struct bracketNode *b = getEditorRowBrackets(at);
+    int braces = sizeof(b->kind) / sizeof(b->kind[0]) - 1;
+
+    // the rows up to the closing brace, which stays in sight.
+    int need = b->kind[braces].open;
+    if (need > 0) {
+        int close = findEditorBracketRow(at + 1, braces, 1, &need);
+        if (close != -1) {
+            return close - 1;
+        }
+    }
+
+    // the rows indented further, without the blank ones after them.
+    int indent = editorRowIndent(at);
+    int end = at;
+    int j;
+    for (j = at + 1; j < E.numRows; j++) {
+        int inner = editorRowIndent(j);
+        if (inner == -1) {
+            continue;
+        }
+        if (inner <= indent) {
+            break;
+        }
+        end = j;
+    }
+    return end;
+}
+
+void toggleEditorFold() {
+    if (E.view) {
+        setEditorStatusMessage("No folding in view mode");
+        return;
+    }
+    if (E.cy >= E.numRows) {
+        return;
+    }
+
+    int k = E.numFolds ? findEditorFold(E.cy + 1) : -1;
+    if (k != -1 && E.fold[k].start == E.cy) {
+        int lines = E.fold[k].end - E.fold[k].start;
+        setEditorStatusMessage("Unfolded %d line%s", lines, lines == 1 ? "" : "s");
+        removeEditorFold(k);
+        return;
+    }
+
+    int end = findEditorBlockEnd(E.cy);
+    if (end <= E.cy) {
+        setEditorStatusMessage("Nothing to fold");
+        return;
+    }
+    addEditorFold(E.cy, end);
+    setEditorStatusMessage("Folded %d line%s", end - E.cy, end - E.cy == 1 ? "" : "s");
+}
+
+// the row after the last one on the screen.
+int editorBottomRow() {
+    if (!E.wrap && E.numFolds == 0) {
+        return (E.rowOffset + E.screenRows < E.numRows) ? E.rowOffset + E.screenRows : E.numRows;
+    }
+
+    int seg;
+    int at = findEditorWrapLine(editorWrapLineOf(E.rowOffset) + E.wrapOffset + E.screenRows, &seg);
+    return (seg > 0 && at < E.numRows) ? at + 1 : at;
+}
+
+/*** goto ***/
+
+// Ctrl-G goes to a line, or with @ to a byte offset in the text as it is
+// saved, a newline after every row. the bytes of the rows are summed up in
+// chunks and the chunks in a segment tree, as the screen lines of wrapped
+// rows are, so the row holding an offset is found in O(log n). an edit
+// within a row, or rows added or removed, update their chunk and the sums
+// above it.
+
+long long sumEditorByteChunk(int first, int rows) {
+    long long sum = 0;
+    int j;
+
+    for (j = first; j < first + rows; j++) {
+        sum += E.row[j].size + 1;
+    }
+    return sum;
+}
+
+// builds the tree, if there is none, and brings its chunks up to date.
+void rebuildEditorBytes() {
+    int first = 0;
+    int j;
+
+    layoutEditorChunks();
+    flushEditorChunks();
+    if (E.byteTree) {
+        return;
+    }
+
+    E.byteTree = (long long *)calloc(E.chunkSize * 2, sizeof(long long));
+    if (E.byteTree == NULL) {
+        die("calloc");
+    }
+    for (j = 0; j < E.numChunks; j++) {
+        E.byteTree[E.chunkSize + j] = sumEditorByteChunk(first, editorChunkRows(j));
+        first += editorChunkRows(j);
+    }
+    for (j = E.chunkSize - 1; j >= 1; j--) {
+        E.byteTree[j] = E.byteTree[2 * j] + E.byteTree[2 * j + 1];
+    }
+}
+
+// the row the byte at offset is in, and in *col where in the row it is. past
+// the end that is E.numRows.
+int findEditorOffset(long long offset, long long *col) {
+    int node = 1;
+
+    rebuildEditorBytes();
+    *col = 0;
+    if (E.numRows == 0 || offset >= E.byteTree[1]) {
+        return E.numRows;
+    }
+
+    while (node < E.chunkSize) {
+        if (offset < E.byteTree[2 * node]) {
+            node = 2 * node;
+        } else {
+            offset -= E.byteTree[2 * node];
+            node = 2 * node + 1;
+        }
+    }
+
+    int at = editorChunkStart(node - E.chunkSize);
+    while (offset > E.row[at].size) {
+        offset -= E.row[at].size + 1;
+        at++;
+    }
+    *col = offset;
+    return at;
+}
+
+// scrolls the cursor row to the middle of the screen.
+void centerEditorCursor() {
+    E.rowOffset = E.cy - E.screenRows / 2;
+    if (E.rowOffset < 0) {
+        E.rowOffset = 0;
+    }
+    E.wrapOffset = 0;
+}
+
+// puts the cursor on line `line` of the file, counting from 1, or on the
+// last line if there are fewer.
+void goEditorLine(long long line) {
+    if (line < 1) {
+        line = 1;
+    }
+    if (E.view) {
+        showEditorViewLine(line - 1);
+        line -= E.viewBase;
+    }
+
+    E.cy = (line > E.numRows) ? E.numRows - 1 : line - 1;
+    if (E.cy < 0) {
+        E.cy = 0;
+    }
+    E.cx = 0;
+    centerEditorCursor();
+}
+
+// puts the cursor on the byte at offset, counting from 0. in view mode
+// offsets are in the file itself. returns -1 if it is past the end.
+int goEditorOffset(long long offset) {
+    long long col;
+    int at;
+
+    if (E.view) {
+        off_t start;
+        long long line = editorViewLineAt(offset, &start);
+
+        showEditorViewLine(line);
+        at = line - E.viewBase;
+        col = offset - start;
+    } else {
+        at = findEditorOffset(offset, &col);
+    }
+    if (offset < 0 || at >= E.numRows || col > E.row[at].size) {
+        setEditorStatusMessage("No byte at offset %lld", offset);
+        return -1;
+    }
+
+    E.cy = at;
+    E.cx = col;
+    centerEditorCursor();
+    return 0;
+}
+
+void editorGoto() {
+    char *s = editorPrompt("Go to line: %s (@ for a byte offset, ESC to cancel)", NULL);
+    if (s == NULL) {
+        return;
+    }
+
+    int offset = (s[0] == '@');
+    char *end;
+    long long n = strtoll(s + offset, &end, 10);
+    if (end == s + offset || *end) {
+        setEditorStatusMessage("Not a line number: %s", s);
+    } else if (offset) {
+        goEditorOffset(n);
+    } else {
+        goEditorLine(n);
+    }
+    free(s);
+}
+
+/*** editor operations ***/
+
+void insertEditorChar(int c) {
+    if (isEditorReadOnly()) {
+        return;
+    }
+
+    if (E.cy == E.numRows) {
+        insertEditorRow(E.numRows, "", 0);
+    }
+
+    insertEditorRowCharacter(getEditorRow(E.cy), E.cx, c);
+    E.cx++;
+}
+
+void insertEditorNewline() {
+    if (isEditorReadOnly()) {
+        return;
+    }
+
+    if (E.cx == 0) {
+        insertEditorRow(E.cy, "", 0);
+    } else {
+        editorRow *row = getEditorRow(E.cy);
+        insertEditorRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        truncateEditorRow(&E.row[E.cy], E.cx);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+void delEditorChar() {
+    if (isEditorReadOnly()) {
+        return;
+    }
+
+    if (E.cy == E.numRows) {
+        E.cy--;
+        E.cx = E.row[E.cy].size;
+        return;
+    }
+    if (E.cx == 0 && E.cy == 0) {
+        return;
+    }
+
+    editorRow *row = getEditorRow(E.cy);
+    if (E.cx > 0) {
+        delEditorRowChar(row, E.cx - 1);
+        E.cx--;
+    } else {
+        E.cx = E.row[E.cy - 1].size;
+        appendEditorRowString(getEditorRow(E.cy - 1), row->chars, row->size);
+        delEditorRow(E.cy);
+        E.cy--;
+    }
+}
+
+/*** cursors ***/
+
+// extra cursors are kept sorted, apart from the primary one. a key meant for
+// all of them is applied in one batch: the cursors on a row are handled
+// together, so the row is rebuilt once however many there are, and the
+// screen is drawn once afterwards.
+
+int compareEditorCursors(const void *a, const void *b) {
+    const struct editorCursor *x = (const struct editorCursor *)a;
+    const struct editorCursor *y = (const struct editorCursor *)b;
+
+    if (x->cy != y->cy) {
+        return (x->cy < y->cy) ? -1 : 1;
+    }
+    return (x->cx > y->cx) - (x->cx < y->cx);
+}
+
+void addEditorCursor(int cy, int cx) {
+    if (E.numCursors == E.cursorCap) {
+        E.cursorCap = E.cursorCap ? E.cursorCap * 2 : 16;
+        E.cursor = (struct editorCursor *)realloc(E.cursor, sizeof(struct editorCursor) * E.cursorCap);
+        if (E.cursor == NULL) {
+            die("realloc");
+        }
+    }
+    E.cursor[E.numCursors].cy = cy;
+    E.cursor[E.numCursors].cx = cx;
+    E.numCursors++;
+}
+
+void clearEditorCursors() {
+    E.numCursors = 0;
+}
+
+// the first extra cursor at or after the position.
+int findEditorCursor(int cy, int cx) {
+    struct editorCursor key = { cy, cx };
+    int lo = 0;
+    int hi = E.numCursors;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (compareEditorCursors(&E.cursor[mid], &key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// restores the order after the cursors moved, and drops those that landed
+// on another one. edits keep the order, so the sort is mostly skipped.
+void sortEditorCursors() {
+    int j;
+    for (j = 1; j < E.numCursors; j++) {
+        if (compareEditorCursors(&E.cursor[j - 1], &E.cursor[j]) > 0) {
+            qsort(E.cursor, E.numCursors, sizeof(struct editorCursor), compareEditorCursors);
+            break;
+        }
+    }
+
+    int n = 0;
+    for (j = 0; j < E.numCursors; j++) {
+        struct editorCursor *c = &E.cursor[j];
+        if ((c->cy == E.cy && c->cx == E.cx) || (n > 0 && compareEditorCursors(c, &E.cursor[n - 1]) == 0)) {
+            continue;
+        }
+        E.cursor[n++] = *c;
+    }
+    E.numCursors = n;
+}
+
+// inserts the key at, or deletes around, the count cursors on one row. a
+// lone cursor uses the small edits; several rebuild the row in one go.
+void editEditorCursorRow(struct editorCursor *cur, int count, int key) {
+    editorRow *row = getEditorRow(cur[0].cy);
+
+    if (count == 1) {
+        if (key == BACKSPACE) {
+            if (cur->cx > 0) {
+                delEditorRowChar(row, --cur->cx);
+            }
+        } else if (key == DEL_KEY) {
+            delEditorRowChar(row, cur->cx);
+        } else {
+            insertEditorRowCharacter(row, cur->cx++, key);
+        }
+        return;
+    }
+
+    char *chars = (char *)malloc(row->size + count + 1);
+    int size = 0;
+    int from = 0;
+    int changed = 0;
+    int j;
+
+    for (j = 0; j < count; j++) {
+        int cx = cur[j].cx;
+        int at = (key == BACKSPACE) ? cx - 1 : cx;
+
+        if (key != BACKSPACE && key != DEL_KEY) {
+            memcpy(&chars[size], &row->chars[from], at - from);
+            size += at - from;
+            chars[size++] = key;
+            from = at;
+            cur[j].cx = size;
+            changed = 1;
+        } else if (at >= from && at < row->size) {
+            memcpy(&chars[size], &row->chars[from], at - from);
+            size += at - from;
+            from = at + 1;
+            cur[j].cx = size;
+            changed = 1;
+        } else {
+            cur[j].cx = size + (cx - from);
+        }
+    }
+    memcpy(&chars[size], &row->chars[from], row->size - from);
+    size += row->size - from;
+    chars[size] = '\0';
+
+    if (changed) {
+        setEditorRowChars(row, chars, size);
+    } else {
+        free(chars);
+    }
+}
+
+// splits the line at every cursor. the new rows are all made first and put
+// in with the rows after them moved once, as spliceEditorRows does.
+void splitEditorCursorRows(struct editorCursor *cur, int count) {
+    editorRow *added = (editorRow *)malloc(sizeof(editorRow) * count);
+    int numRows = E.numRows;
+    int first = cur[0].cy;
+    int i, j, k;
+
+    // the records go from the last row up, so that the rows each one names
+    // are still where it says when they are replayed in order. a row gets
+    // the text before its first cursor, and the rest comes in after it.
+    for (i = count; i > 0; i = j) {
+        int cy = cur[i - 1].cy;
+        for (j = i - 1; j > 0 && cur[j - 1].cy == cy; j--);
+
+        if (cy == numRows) {
+            char *buf = (char *)malloc(i - j);
+            memset(buf, '\n', i - j);
+            recordEditorEdit(EDIT_INSERT_ROWS, cy, i - j, buf, i - j);
+            free(buf);
+            continue;
+        }
+
+        editorRow *row = getEditorRow(cy);
+        char *buf = (char *)malloc(row->size + i - j);
+        int len = 0;
+        for (k = j; k < i; k++) {
+            int to = (k + 1 < i) ? cur[k + 1].cx : row->size;
+            memcpy(&buf[len], &row->chars[cur[k].cx], to - cur[k].cx);
+            len += to - cur[k].cx;
+            buf[len++] = '\n';
+        }
+        recordEditorEdit(EDIT_SET_ROW, cy, 0, row->chars, cur[j].cx);
+        recordEditorEdit(EDIT_INSERT_ROWS, cy + 1, i - j, buf, len);
+        free(buf);
+    }
+
+    // the new rows, in order, and the split rows cut short.
+    for (i = 0; i < count; i = j) {
+        int cy = cur[i].cy;
+        for (j = i + 1; j < count && cur[j].cy == cy; j++);
+
+        if (cy == numRows) {
+            for (k = i; k < j; k++) {
+                initEditorRow(&added[k], "", 0);
+            }
+            continue;
+        }
+
+        editorRow *row = getEditorRow(cy);
+        for (k = i; k < j; k++) {
+            int to = (k + 1 < j) ? cur[k + 1].cx : row->size;
+            initEditorRow(&added[k], &row->chars[cur[k].cx], to - cur[k].cx);
+        }
+        ownEditorRow(row);
+        row->size = cur[i].cx;
+        row->chars[row->size] = '\0';
+    }
+
+    // from the last row up, the rows below each split move down by the new
+    // rows above them, and the new rows go in the gap left.
+    reserveEditorRows(E.numRows + count);
+    for (i = count, k = numRows; i > 0; i = j) {
+        int cy = cur[i - 1].cy;
+        int from = (cy == numRows) ? cy : cy + 1;
+        for (j = i - 1; j > 0 && cur[j - 1].cy == cy; j--);
+
+        memmove(&E.row[from + i], &E.row[from], sizeof(editorRow) * (k - from));
+        memcpy(&E.row[from + j], &added[j], sizeof(editorRow) * (i - j));
+        markEditorRows(from, 0, i - j);
+        spliceEditorFolds(from, 0, i - j);
+        k = from;
+    }
+    free(added);
+
+    if (first < numRows) {
+        E.hlEpoch = E.hlTicket;
+    }
+    E.numRows += count;
+    markEditorDiff(first, cur[count - 1].cy + count - first + (cur[count - 1].cy < numRows));
+
+    // only the split rows and the new ones below them, now all in place.
+    for (i = 0; i < count; i = j) {
+        int cy = cur[i].cy;
+        for (j = i + 1; j < count && cur[j].cy == cy; j++);
+
+        int last = (cy < numRows) ? cy + j : cy + j - 1;
+        for (k = cy + i; k <= last; k++) {
+            updateEditorRow(&E.row[k]);
+        }
+        k = last + 1;
+        if (k < E.numRows && E.row[k].hlStartState != E.row[k - 1].hlEndState) {
+            updateEditorSyntax(&E.row[k]);
+        }
+    }
+    E.dirty++;
+
+    for (j = 0; j < count; j++) {
+        cur[j].cy += j + 1;
+        cur[j].cx = 0;
+    }
+}
+
+// applies an editing or moving key at every cursor. returns 0 for the keys
+// that only concern the primary cursor. lines are not joined at the start
+// of a line or split apart at its end, except with a single cursor.
+int applyEditorCursors(int key) {
+    int typing = (key == '\t' || (key < 128 && !iscntrl(key)));
+    int moving = (key == ARROW_UP || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_RIGHT || key == HOME_KEY || key == END_KEY);
+
+    if (key == CTRL_KEY('h')) {
+        key = BACKSPACE;
+    }
+    if (!typing && !moving && key != '\r' && key != BACKSPACE && key != DEL_KEY) {
+        return 0;
+    }
+    if (!moving && isEditorReadOnly()) {
+        return 1;
+    }
+
+    // the primary cursor joins the others for the batch.
+    int primary = findEditorCursor(E.cy, E.cx);
+    addEditorCursor(0, 0);
+    memmove(&E.cursor[primary + 1], &E.cursor[primary], sizeof(struct editorCursor) * (E.numCursors - 1 - primary));
+    E.cursor[primary].cy = E.cy;
+    E.cursor[primary].cx = E.cx;
+
+    struct editorCursor *cur = E.cursor;
+    int n = E.numCursors;
+    int i, j;
+
+    if (moving) {
+        for (j = 0; j < n; j++) {
+            E.cy = cur[j].cy;
+            E.cx = cur[j].cx;
+            if (key == HOME_KEY) {
+                E.cx = 0;
+            } else if (key == END_KEY) {
+                E.cx = (E.cy < E.numRows) ? E.row[E.cy].size : 0;
+            } else {
+                moveEditorCursor(key);
+            }
+            cur[j].cy = E.cy;
+            cur[j].cx = E.cx;
+        }
+    } else if (key == '\r') {
+        splitEditorCursorRows(cur, n);
+    } else {
+        if (typing && cur[n - 1].cy == E.numRows) {
+            insertEditorRow(E.numRows, "", 0);
+        }
+        for (i = 0; i < n; i = j) {
+            for (j = i + 1; j < n && cur[j].cy == cur[i].cy; j++);
+            if (cur[i].cy < E.numRows) {
+                editEditorCursorRow(&cur[i], j - i, key);
+            }
+        }
+    }
+
+    E.cy = cur[primary].cy;
+    E.cx = cur[primary].cx;
+    memmove(&cur[primary], &cur[primary + 1], sizeof(struct editorCursor) * (n - 1 - primary));
+    E.numCursors--;
+    sortEditorCursors();
+    return 1;
+}
+
+// leaves a cursor where the primary one is and moves it a line down.
+void addEditorCursorBelow() {
+    if (isEditorReadOnly()) {
+        return;
+    }
+    if (E.cy + 1 >= E.numRows) {
+        setEditorStatusMessage("No line below");
+        return;
+    }
+
+    addEditorCursor(E.cy, E.cx);
+    moveEditorCursor(ARROW_DOWN);
+    sortEditorCursors();
+}
+
+// replaces the cursors with one at the start of every occurrence of a
+// string. the primary one goes to the first at or after where it was.
+void addEditorCursorsAtMatches() {
+    if (isEditorReadOnly()) {
+        return;
+    }
+
+    char *query = editorPrompt("Add cursors at: %s (ESC to cancel)", NULL);
+    if (query == NULL) {
+        return;
+    }
+
+    int cy = E.cy;
+    int cx = E.cx;
+    int queryLen = strlen(query);
+    int j;
+
+    clearEditorCursors();
+    for (j = 0; j < E.numRows; j++) {
+        editorRow *row = &E.row[j];
+        char *chars = peekEditorRow(row);
+        char *end = chars + row->size;
+        char *match;
+
+        for (match = (char *)memmem(chars, row->size, query, queryLen); match;
+            match = (char *)memmem(match + queryLen, end - match - queryLen, query, queryLen)) {
+            addEditorCursor(j, match - chars);
+        }
+    }
+    free(query);
+
+    if (E.numCursors == 0) {
+        setEditorStatusMessage("No match");
+        return;
+    }
+
+    int primary = findEditorCursor(cy, cx);
+    if (primary == E.numCursors) {
+        primary = 0;
+    }
+    E.cy = E.cursor[primary].cy;
+    E.cx = E.cursor[primary].cx;
+    memmove(&E.cursor[primary], &E.cursor[primary + 1], sizeof(struct editorCursor) * (E.numCursors - 1 - primary));
+    E.numCursors--;
+    setEditorStatusMessage("%d cursors", E.numCursors + 1);
+}
+
+/*** compression ***/
+
+// files starting with the gzip or zstd magic bytes are decompressed as they
+// are read, and compressed again on a second thread as they are saved. zlib
+// is linked in, libzstd is only looked for once a .zst file comes up. .zst
+// files are written as one frame per MACHO_COMPRESS_CHUNK with a seek table
+// at the end, in the zstd seekable format, so --view can read them from the
+// middle.
+
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A5EU
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1U
+
+// the buffers of the zstd streaming api, laid out as in zstd.h.
+struct zstdIn {
+    const void *src;
+    size_t size;
+    size_t pos;
+};
+
+struct zstdOut {
+    void *dst;
+    size_t size;
+    size_t pos;
+};
+
+struct zstdLib {
+    void *(*createDStream)(void);
+    size_t (*freeDStream)(void *zds);
+    size_t (*decompressStream)(void *zds, struct zstdOut *out, struct zstdIn *in);
+    size_t (*decompress)(void *dst, size_t cap, const void *src, size_t len);
+    void *(*createCStream)(void);
+    size_t (*freeCStream)(void *zcs);
+    size_t (*initCStream)(void *zcs, int level);
+    size_t (*compressStream)(void *zcs, struct zstdOut *out, struct zstdIn *in);
+    size_t (*endStream)(void *zcs, struct zstdOut *out);
+    unsigned (*isError)(size_t code);
+    int loaded;
+};
+
+struct zstdLib ZL;
+pthread_once_t zstdOnce = PTHREAD_ONCE_INIT;
+
+void loadZstdLib() {
+    void *lib = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (lib == NULL) {
+        return;
+    }
+
+    // through a data pointer, as iso c has no cast from one to a function.
+    *(void **)&ZL.createDStream = dlsym(lib, "ZSTD_createDStream");
+    *(void **)&ZL.freeDStream = dlsym(lib, "ZSTD_freeDStream");
+    *(void **)&ZL.decompressStream = dlsym(lib, "ZSTD_decompressStream");
+    *(void **)&ZL.decompress = dlsym(lib, "ZSTD_decompress");
+    *(void **)&ZL.createCStream = dlsym(lib, "ZSTD_createCStream");
+    *(void **)&ZL.freeCStream = dlsym(lib, "ZSTD_freeCStream");
+    *(void **)&ZL.initCStream = dlsym(lib, "ZSTD_initCStream");
+    *(void **)&ZL.compressStream = dlsym(lib, "ZSTD_compressStream");
+    *(void **)&ZL.endStream = dlsym(lib, "ZSTD_endStream");
+    *(void **)&ZL.isError = dlsym(lib, "ZSTD_isError");
+    ZL.loaded = ZL.createDStream && ZL.freeDStream && ZL.decompressStream && ZL.decompress &&
+        ZL.createCStream && ZL.freeCStream && ZL.initCStream && ZL.compressStream && ZL.endStream && ZL.isError;
+}
+
+int hasZstdLib() {
+    pthread_once(&zstdOnce, loadZstdLib);
+    return ZL.loaded;
+}
+
+int editorCompressionOf(int fd) {
+    unsigned char magic[4];
+
+    if (pread(fd, magic, 4, 0) != 4) {
+        return COMPRESS_NONE;
+    }
+    if (magic[0] == 0x1f && magic[1] == 0x8b && magic[2] == 8) {
+        return COMPRESS_GZIP;
+    }
+    if (memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0) {
+        return COMPRESS_ZSTD;
+    }
+    return COMPRESS_NONE;
+}
+
+// what a new file is written as, by its name.
+int editorCompressionFor(const char *fileName) {
+    int len = strlen(fileName);
+
+    if (len > 3 && strcmp(fileName + len - 3, ".gz") == 0) {
+        return COMPRESS_GZIP;
+    }
+    if (len > 4 && strcmp(fileName + len - 4, ".zst") == 0 && hasZstdLib()) {
+        return COMPRESS_ZSTD;
+    }
+    return COMPRESS_NONE;
+}
+
+uint32_t readLE32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void writeLE32(unsigned char *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+int writeEditorBytes(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// a compressed file being read from the start.
+struct editorInflate {
+    int kind;
+    int fd;
+    unsigned char *in;
+    int inEnded;        // the file has no more to read.
+    int members;        // gzip members finished, a file may have several.
+    int open;           // a member or frame is begun and not finished.
+    int padding;        // only zeros may follow the last gzip member.
+    z_stream z;
+    void *zds;
+    struct zstdIn zin;
+};
+
+int openEditorInflate(struct editorInflate *inf, int fd, int kind) {
+    memset(inf, 0, sizeof(*inf));
+    inf->kind = kind;
+    inf->fd = fd;
+    inf->in = (unsigned char *)malloc(MACHO_COMPRESS_CHUNK);
+    if (inf->in == NULL) {
+        die("malloc");
+    }
+
+    if (kind == COMPRESS_GZIP) {
+        if (inflateInit2(&inf->z, 15 + 16) != Z_OK) {
+            free(inf->in);
+            return -1;
+        }
+        return 0;
+    }
+    if (!hasZstdLib() || (inf->zds = ZL.createDStream()) == NULL) {
+        free(inf->in);
+        errno = ENOTSUP;
+        return -1;
+    }
+    inf->zin.src = inf->in;
+    return 0;
+}
+
+void closeEditorInflate(struct editorInflate *inf) {
+    if (inf->kind == COMPRESS_GZIP) {
+        inflateEnd(&inf->z);
+    } else {
+        ZL.freeDStream(inf->zds);
+    }
+    free(inf->in);
+}
+
+// decompresses up to cap bytes. returns 0 at the end and -1 if the data is
+// corrupt or the file ends inside a gzip member or zstd frame.
+ssize_t readEditorInflate(struct editorInflate *inf, char *out, size_t cap) {
+    size_t got = 0;
+
+    while (got == 0) {
+        int starved = (inf->kind == COMPRESS_GZIP) ? inf->z.avail_in == 0 : inf->zin.pos == inf->zin.size;
+        if (starved && !inf->inEnded) {
+            ssize_t n = read(inf->fd, inf->in, MACHO_COMPRESS_CHUNK);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1) {
+                return -1;
+            }
+            inf->inEnded = (n == 0);
+            inf->z.next_in = inf->in;
+            inf->z.avail_in = n;
+            inf->zin.size = n;
+            inf->zin.pos = 0;
+            continue;
+        }
+        if (starved && !inf->open) {
+            break;
+        }
+
+        // once the file is read, an open member or frame may still have
+        // output to flush. if it has none, the file was cut short.
+        if (inf->kind == COMPRESS_GZIP) {
+            // a member never starts with a zero byte, so zeros after the
+            // last one are padding. anything else there is corrupt.
+            if (!inf->open && inf->members > 0 && (inf->padding || inf->z.next_in[0] == 0)) {
+                unsigned int j;
+                for (j = 0; j < inf->z.avail_in; j++) {
+                    if (inf->z.next_in[j] != 0) {
+                        return -1;
+                    }
+                }
+                inf->padding = 1;
+                inf->z.avail_in = 0;
+                continue;
+            }
+
+            inf->z.next_out = (unsigned char *)out;
+            inf->z.avail_out = cap;
+            int r = inflate(&inf->z, Z_NO_FLUSH);
+            got = cap - inf->z.avail_out;
+            if (r == Z_STREAM_END) {
+                inf->members++;
+                inf->open = 0;
+                inflateReset(&inf->z);
+            } else if (r != Z_OK && r != Z_BUF_ERROR) {
+                return -1;
+            } else {
+                inf->open = 1;
+            }
+        } else {
+            struct zstdOut zout = { out, cap, 0 };
+            size_t r = ZL.decompressStream(inf->zds, &zout, &inf->zin);
+            if (ZL.isError(r)) {
+                return -1;
+            }
+            got = zout.pos;
+            inf->open = (r != 0);
+        }
+        if (starved && got == 0) {
+            return -1;
+        }
+    }
+    return got;
+}
+
+// the whole of a compressed file, decompressed. returns NULL if it can't be
+// read.
+char *inflateEditorFile(int fd, int kind, long long *len) {
+    struct editorInflate inf;
+    long long cap = MACHO_COMPRESS_CHUNK;
+    char *buf = (char *)malloc(cap);
+    ssize_t n;
+
+    if (buf == NULL || lseek(fd, 0, SEEK_SET) == -1 || openEditorInflate(&inf, fd, kind) == -1) {
+        free(buf);
+        return NULL;
+    }
+    *len = 0;
+    while (1) {
+        if (cap - *len < MACHO_COMPRESS_CHUNK) {
+            cap *= 2;
+            buf = (char *)realloc(buf, cap);
+            if (buf == NULL) {
+                die("realloc");
+            }
+        }
+        n = readEditorInflate(&inf, buf + *len, cap - *len);
+        if (n <= 0) {
+            break;
+        }
+        *len += n;
+    }
+    closeEditorInflate(&inf);
+    if (n == -1) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+// the encoder thread takes chunks of the text from the main thread, which
+// fills one while the other is compressed and written.
+struct editorDeflate {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int kind;
+    int fd;
+    char *chunk[2];
+    int len[2];
+    int full[2];        // handed to the encoder and not compressed yet.
+    int finished;       // no more chunks come.
+    int failed;
+    unsigned char *frames;  // seek table entries of the zstd frames written.
+    int numFrames;
+    int frameCap;
+};
+
+int addEditorSeekFrame(struct editorDeflate *d, uint32_t packedLen, uint32_t plainLen) {
+    if (d->numFrames == d->frameCap) {
+        d->frameCap = d->frameCap ? d->frameCap * 2 : 64;
+        d->frames = (unsigned char *)realloc(d->frames, d->frameCap * 8);
+        if (d->frames == NULL) {
+            die("realloc");
+        }
+    }
+    writeLE32(d->frames + d->numFrames * 8, packedLen);
+    writeLE32(d->frames + d->numFrames * 8 + 4, plainLen);
+    d->numFrames++;
+    return 0;
+}
+
+// compresses a chunk, or finishes the stream when len is -1.
+int deflateEditorChunk(struct editorDeflate *d, z_stream *z, void *zcs, unsigned char *out, const char *chunk, int len) {
+    if (d->kind == COMPRESS_GZIP) {
+        int flush = (len == -1) ? Z_FINISH : Z_NO_FLUSH;
+        int r;
+
+        z->next_in = (unsigned char *)chunk;
+        z->avail_in = (len == -1) ? 0 : len;
+        do {
+            z->next_out = out;
+            z->avail_out = MACHO_COMPRESS_CHUNK;
+            r = deflate(z, flush);
+            if (r == Z_STREAM_ERROR || writeEditorBytes(d->fd, out, MACHO_COMPRESS_CHUNK - z->avail_out) == -1) {
+                return -1;
+            }
+        } while (z->avail_out == 0 || (flush == Z_FINISH && r != Z_STREAM_END));
+        return 0;
+    }
+
+    // every chunk is a frame of its own, listed in the seek table written
+    // after the last one.
+    if (len == -1) {
+        unsigned char tail[17];
+        uint32_t tableLen = d->numFrames * 8 + 9;
+
+        writeLE32(tail, ZSTD_SKIPPABLE_MAGIC);
+        writeLE32(tail + 4, tableLen);
+        writeLE32(tail + 8, d->numFrames);
+        tail[12] = 0;
+        writeLE32(tail + 13, ZSTD_SEEKABLE_MAGIC);
+        return (writeEditorBytes(d->fd, tail, 8) == -1 ||
+            writeEditorBytes(d->fd, d->frames, d->numFrames * 8) == -1 ||
+            writeEditorBytes(d->fd, tail + 8, 9) == -1) ? -1 : 0;
+    }
+
+    struct zstdIn zin = { chunk, len, 0 };
+    uint32_t packedLen = 0;
+    size_t r;
+    do {
+        struct zstdOut zout = { out, MACHO_COMPRESS_CHUNK, 0 };
+        r = (zin.pos < zin.size) ? ZL.compressStream(zcs, &zout, &zin) : ZL.endStream(zcs, &zout);
+        if (ZL.isError(r) || writeEditorBytes(d->fd, out, zout.pos) == -1) {
+            return -1;
+        }
+        packedLen += zout.pos;
+    } while (zin.pos < zin.size || r != 0);
+    return addEditorSeekFrame(d, packedLen, len);
+}
+
+void *editorDeflateMain(void *arg) {
+    struct editorDeflate *d = (struct editorDeflate *)arg;
+    unsigned char *out = (unsigned char *)malloc(MACHO_COMPRESS_CHUNK);
+    z_stream z;
+    void *zcs = NULL;
+    int k = 0;
+
+    memset(&z, 0, sizeof(z));
+    if (out == NULL) {
+        d->failed = 1;
+    } else if (d->kind == COMPRESS_GZIP) {
+        d->failed = deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK;
+    } else {
+        zcs = ZL.createCStream();
+        d->failed = zcs == NULL || ZL.isError(ZL.initCStream(zcs, 3));
+    }
+
+    while (1) {
+        pthread_mutex_lock(&d->lock);
+        while (!d->full[k] && !d->finished) {
+            pthread_cond_wait(&d->cond, &d->lock);
+        }
+        int last = !d->full[k];
+        pthread_mutex_unlock(&d->lock);
+        if (last) {
+            break;
+        }
+
+        if (!d->failed && deflateEditorChunk(d, &z, zcs, out, d->chunk[k], d->len[k]) == -1) {
+            d->failed = 1;
+        }
+
+        pthread_mutex_lock(&d->lock);
+        d->full[k] = 0;
+        pthread_cond_signal(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+        k ^= 1;
+    }
+
+    if (!d->failed && deflateEditorChunk(d, &z, zcs, out, NULL, -1) == -1) {
+        d->failed = 1;
+    }
+    if (d->kind == COMPRESS_GZIP) {
+        deflateEnd(&z);
+    } else if (zcs) {
+        ZL.freeCStream(zcs);
+    }
+    free(out);
+    return NULL;
+}
+
+// hands chunk k to the encoder and waits for the other one to be free.
+void passEditorDeflateChunk(struct editorDeflate *d, int k) {
+    pthread_mutex_lock(&d->lock);
+    d->full[k] = 1;
+    pthread_cond_signal(&d->cond);
+    while (d->full[k ^ 1]) {
+        pthread_cond_wait(&d->cond, &d->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+// writes the rows compressed to fd, and describes what was written in disk.
+// returns the length of the text, or -1 if it couldn't be written.
+long long writeEditorCompressed(int fd, int kind, struct editorDisk *disk) {
+    struct editorDeflate d;
+    long long total = 0;
+    int k = 0;
+    int j;
+
+    memset(&d, 0, sizeof(d));
+    pthread_mutex_init(&d.lock, NULL);
+    pthread_cond_init(&d.cond, NULL);
+    d.kind = kind;
+    d.fd = fd;
+    d.chunk[0] = (char *)malloc(MACHO_COMPRESS_CHUNK);
+    d.chunk[1] = (char *)malloc(MACHO_COMPRESS_CHUNK);
+    if (d.chunk[0] == NULL || d.chunk[1] == NULL) {
+        die("malloc");
+    }
+    if (pthread_create(&d.thread, NULL, editorDeflateMain, &d) != 0) {
+        free(d.chunk[0]);
+        free(d.chunk[1]);
+        return -1;
+    }
+
+    // a line longer than a chunk is split over several.
+    for (j = 0; j < E.numRows; j++) {
+        editorRow *row = &E.row[j];
+        char *chars = peekEditorRow(row);
+        int done = 0;
+
+        while (done <= row->size) {
+            int n = row->size - done;
+            if (n > MACHO_COMPRESS_CHUNK - d.len[k]) {
+                n = MACHO_COMPRESS_CHUNK - d.len[k];
+            }
+            memcpy(d.chunk[k] + d.len[k], chars + done, n);
+            d.len[k] += n;
+            done += n;
+            if (done == row->size && d.len[k] < MACHO_COMPRESS_CHUNK) {
+                d.chunk[k][d.len[k]++] = '\n';
+                done++;
+            }
+            if (d.len[k] == MACHO_COMPRESS_CHUNK) {
+                passEditorDeflateChunk(&d, k);
+                k ^= 1;
+                d.len[k] = 0;
+            }
+        }
+        addEditorDiskRow(disk, chars, row->size);
+        total += row->size + 1;
+    }
+    if (d.len[k] > 0) {
+        passEditorDeflateChunk(&d, k);
+    }
+
+    pthread_mutex_lock(&d.lock);
+    d.finished = 1;
+    pthread_cond_signal(&d.cond);
+    pthread_mutex_unlock(&d.lock);
+    pthread_join(d.thread, NULL);
+
+    pthread_mutex_destroy(&d.lock);
+    pthread_cond_destroy(&d.cond);
+    free(d.chunk[0]);
+    free(d.chunk[1]);
+    free(d.frames);
+    return d.failed ? -1 : total;
+}
+
+// a frame of a seekable .zst file.
+struct seekFrame {
+    off_t packedAt;
+    long long plainAt;
+    uint32_t packedLen;
+    uint32_t plainLen;
+};
+
+// reads the seek table at the end of a .zst file. returns 0 if it has none.
+int readEditorSeekTable(int fd) {
+    struct stat st;
+    unsigned char foot[9];
+
+    if (!hasZstdLib() || fstat(fd, &st) == -1 || st.st_size < 17 || pread(fd, foot, 9, st.st_size - 9) != 9 ||
+        readLE32(foot + 5) != ZSTD_SEEKABLE_MAGIC || (foot[4] & 0x7c) != 0) {
+        return 0;
+    }
+
+    int numFrames = readLE32(foot);
+    int entryLen = (foot[4] & 0x80) ? 12 : 8;
+    long long tableLen = (long long)numFrames * entryLen;
+    if (numFrames <= 0 || tableLen + 17 > st.st_size) {
+        return 0;
+    }
+
+    unsigned char *table = (unsigned char *)malloc(tableLen + 8);
+    if (table == NULL) {
+        die("malloc");
+    }
+    struct seekFrame *frame = (struct seekFrame *)malloc(sizeof(struct seekFrame) * numFrames);
+    off_t packedAt = 0;
+    long long plainAt = 0;
+    int ok = frame && pread(fd, table, tableLen + 8, st.st_size - 9 - tableLen - 8) == tableLen + 8 &&
+        readLE32(table) == ZSTD_SKIPPABLE_MAGIC && readLE32(table + 4) == tableLen + 9;
+    int j;
+    for (j = 0; ok && j < numFrames; j++) {
+        frame[j].packedAt = packedAt;
+        frame[j].plainAt = plainAt;
+        frame[j].packedLen = readLE32(table + 8 + j * entryLen);
+        frame[j].plainLen = readLE32(table + 8 + j * entryLen + 4);
+        packedAt += frame[j].packedLen;
+        plainAt += frame[j].plainLen;
+        ok = frame[j].plainLen <= MACHO_COMPRESS_CHUNK * 64;
+    }
+    free(table);
+    if (!ok || packedAt != st.st_size - 17 - tableLen) {
+        free(frame);
+        return 0;
+    }
+
+    E.viewFrame = frame;
+    E.viewFrames = numFrames;
+    E.viewFrameAt = -1;
+    return 1;
+}
+
+// reads the text of a file in view mode like pread, through the frames of a
+// seekable .zst file.
+ssize_t readEditorView(char *buf, size_t len, off_t pos) {
+    if (E.viewFrame == NULL) {
+        return pread(E.viewFd, buf, len, pos);
+    }
+
+    size_t got = 0;
+    while (got < len) {
+        int lo = 0;
+        int hi = E.viewFrames;
+        while (hi - lo > 1) {
+            int mid = (lo + hi) / 2;
+            if (E.viewFrame[mid].plainAt <= pos) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        struct seekFrame *f = &E.viewFrame[lo];
+        if (pos >= f->plainAt + f->plainLen) {
+            break;
+        }
+
+        if (E.viewFrameAt != lo) {
+            char *packed = readEditorDisk(E.viewFd, f->packedAt, f->packedLen);
+            E.viewFrameBuf = (char *)realloc(E.viewFrameBuf, f->plainLen ? f->plainLen : 1);
+            if (E.viewFrameBuf == NULL) {
+                die("realloc");
+            }
+            E.viewFrameAt = -1;
+            if (packed == NULL || ZL.decompress(E.viewFrameBuf, f->plainLen, packed, f->packedLen) != f->plainLen) {
+                free(packed);
+                return got ? (ssize_t)got : -1;
+            }
+            free(packed);
+            E.viewFrameAt = lo;
+        }
+
+        size_t n = f->plainAt + f->plainLen - pos;
+        if (n > len - got) {
+            n = len - got;
+        }
+        memcpy(buf + got, E.viewFrameBuf + (pos - f->plainAt), n);
+        got += n;
+        pos += n;
+    }
+    return got;
+}
+
+off_t editorViewSize() {
+    struct stat st;
+
+    if (E.viewFrame) {
+        return E.viewFrame[E.viewFrames - 1].plainAt + E.viewFrame[E.viewFrames - 1].plainLen;
+    }
+    return (fstat(E.viewFd, &st) == 0) ? st.st_size : 0;
+}
+
+/*** file i/o ***/
+
+char *editorRowsToString(int *bufLen) {
+    int totalLen = 0;
+    int j;
+
+    for (j = 0; j < E.numRows; j++) {
+        totalLen += E.row[j].size + 1;
+    }
+    *bufLen = totalLen;
+
+    char *buf = (char *)malloc(totalLen);
+    char *p = buf;
+    for (j = 0; j < E.numRows; j++) {
+        memcpy(p, peekEditorRow(&E.row[j]), E.row[j].size);
+        p += E.row[j].size; 
+        *p = '\n';
+        p++;
+    }
+
+    return buf;
+}
+
+// adds a line read from the file, with its newline if it has one.
+void addEditorFileLine(char *line, long long len) {
+    addEditorDiskLine(&E.disk, line, len);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        len--;
+    }
+    insertEditorRow(E.numRows, line, len);
+}
+
+// reads a compressed file into rows as it is decompressed, without the
+// whole text ever being in memory.
+int readEditorCompressed(int fd) {
+    struct editorInflate inf;
+    struct stat st;
+
+    if (openEditorInflate(&inf, fd, E.compress) == -1) {
+        return -1;
+    }
+    resetEditorDisk(&E.disk);
+
+    long long cap = MACHO_COMPRESS_CHUNK * 2;
+    long long len = 0;
+    char *buf = (char *)malloc(cap);
+    ssize_t n = 0;
+    if (buf == NULL) {
+        die("malloc");
+    }
+
+    E.journalSuspended++;
+    E.undoSuspended++;
+    while (1) {
+        if (cap - len < MACHO_COMPRESS_CHUNK) {
+            cap *= 2;
+            buf = (char *)realloc(buf, cap);
+            if (buf == NULL) {
+                die("realloc");
+            }
+        }
+        n = readEditorInflate(&inf, buf + len, MACHO_COMPRESS_CHUNK);
+        if (n <= 0) {
+            break;
+        }
+
+        // an unfinished line waits for the rest of it.
+        char *p = buf;
+        char *end = buf + len + n;
+        char *nl = (char *)memchr(buf + len, '\n', n);
+        while (nl != NULL) {
+            addEditorFileLine(p, nl + 1 - p);
+            p = nl + 1;
+            nl = (char *)memchr(p, '\n', end - p);
+        }
+        len = end - p;
+        memmove(buf, p, len);
+    }
+    if (n == 0 && len > 0) {
+        addEditorFileLine(buf, len);
+    }
+    E.journalSuspended--;
+    E.undoSuspended--;
+
+    free(buf);
+    closeEditorInflate(&inf);
+    if (n == -1) {
+        errno = EILSEQ;
+        return -1;
+    }
+    if (fstat(fd, &st) == 0) {
+        statEditorDisk(&E.disk, &st);
+    }
+    E.dirty = 0;
+    return 0;
+}
+
+// reads the file into rows. returns -1 if it can't be opened.
+int readEditorFile(char *fileName) {
+    FILE *fp = fopen(fileName, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    E.compress = editorCompressionOf(fileno(fp));
+    if (E.compress != COMPRESS_NONE) {
+        int r = readEditorCompressed(fileno(fp));
+        fclose(fp);
+        return r;
+    }
+
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t lineLen;
+
+    struct stat st;
+    off_t bytesRead = 0;
+    resetEditorDisk(&E.disk);
+
+    E.journalSuspended++;
+    E.undoSuspended++;
+    while ((lineLen = getline(&line, &lineCapacity, fp)) != -1) {
+        bytesRead += lineLen;
+        addEditorFileLine(line, lineLen);
+    }
+    E.journalSuspended--;
+    E.undoSuspended--;
+
+    // what was read, even if the file grew meanwhile.
+    if (fstat(fileno(fp), &st) == 0) {
+        statEditorDisk(&E.disk, &st);
+        E.disk.size = bytesRead;
+    }
+
+    free(line);
+    fclose(fp);
+    E.dirty = 0;
+    return 0;
+}
+
+void openEditor(char *fileName) {
+    free(E.fileName);
+    E.fileName = strdup(fileName);
+    if (E.fileName == NULL) {
+        die("strdup fileName");
+    }
+
+    editorSelectSyntaxHighlight();
+
+    if (loadEditorCache(fileName) == -1 && readEditorFile(fileName) == -1) {
+        die("file open error");
+    }
+    watchEditorFile();
+    followEditorEnd(1);
+
+    recoverEditorJournal();
+}
+
+void saveEditor() {
+    if (isEditorReadOnly()) {
+        return;
+    }
+
+    if (E.fileName == NULL) {
+        E.fileName = editorPrompt("Save as : %s (ESC to cancel)", NULL);
+        if (E.fileName == NULL) {
+            setEditorStatusMessage("Save aborted...");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    // rows that were lost would be written as nul bytes.
+    if (E.fileLost) {
+        setEditorStatusMessage("Can't save! Lines were lost when the file changed on disk");
+        return;
+    }
+
+    // make sure changes someone else made on disk are overwritten on purpose.
+    if (checkEditorDisk() && E.diskConflict == 1) {
+        E.diskConflict = 2;
+        setEditorStatusMessage("File changed on disk since it was read! Ctrl-S again to overwrite");
+        return;
+    }
+
+    if (!E.disk.known) {
+        E.compress = editorCompressionFor(E.fileName);
+    }
+    int len = 0;
+    char *buf = E.compress ? NULL : editorRowsToString(&len);
+
+    // rows still read from the file need it as it was, and a compressed file
+    // is written a piece at a time, so the new contents go to a new file
+    // renamed over it.
+    char *path = E.fileName;
+    char tmp[PATH_MAX];
+    struct stat old;
+    if (E.fileFd != -1 || E.compress) {
+        char *slash = strrchr(E.fileName, '/');
+        int dirLen = slash ? slash - E.fileName + 1 : 0;
+
+        if (snprintf(tmp, sizeof(tmp), "%.*s.%s.macho-save", dirLen, E.fileName, E.fileName + dirLen) >= (int)sizeof(tmp)) {
+            free(buf);
+            setEditorStatusMessage("Can't save! Path too long");
+            return;
+        }
+        if (stat(E.fileName, &old) == -1) {
+            old.st_mode = 0644;
+        }
+        path = tmp;
+    }
+
+    /* 
+     * O_RDWR -> allows read and write operation.
+     * O_CREAT -> creates new file if it does not exists.
+     */
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd != -1) {
+        if (path == tmp) {
+            fchmod(fd, old.st_mode & 07777);
+        }
+        if (ftruncate(fd, len) != -1) {
+            struct editorDisk fresh;
+            long long written = -1;
+
+            memset(&fresh, 0, sizeof(fresh));
+            fresh.sealed = 1;
+            if (E.compress) {
+                written = writeEditorCompressed(fd, E.compress, &fresh);
+            } else if (write(fd, buf, len) == len) {
+                scanEditorDisk(&fresh, buf, len);
+                written = len;
+            }
+
+            if (written != -1 && (path != tmp || rename(tmp, E.fileName) == 0)) {
+                struct stat st;
+                resetEditorDisk(&E.disk);
+                E.disk = fresh;
+                if (fstat(fd, &st) == 0) {
+                    statEditorDisk(&E.disk, &st);
+                }
+                close(fd);
+                free(buf);
+                E.dirty = 0;
+                E.diskConflict = 0;
+                E.cacheFresh = 0;
+                watchEditorFile();
+                removeEditorJournal();
+                setEditorStatusMessage("\"%s\" %dL, %lldB written", E.fileName, E.numRows, written);
+                return;
+            }
+            free(fresh.block);
+        }
+        close(fd);
+    }
+    if (path == tmp) {
+        unlink(tmp);
+    }
+
+    free(buf);
+    setEditorStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+// takes the text from standard input, which must be a pipe or a file, and
+// puts the terminal in its place for the keys. returns the descriptor the
+// text is read from as it arrives.
+int openEditorStream() {
+    if (isatty(STDIN_FILENO)) {
+        fprintf(stderr, "macho: standard input is a terminal\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+    if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) {
+        perror("macho: /dev/tty");
+        exit(EXIT_FAILURE);
+    }
+    close(tty);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// adds what the pipe has for us, a batch of whole lines at a time. returns 1
+// if any rows were added.
+int readEditorStream() {
+    int atEnd = isEditorCursorAtEnd();
+    int eof = 0;
+
+    while (E.streamLen < MACHO_STREAM_BATCH) {
+        if (E.streamCap - E.streamLen < 65536) {
+            E.streamCap = E.streamCap ? E.streamCap * 2 : 131072;
+            E.streamBuf = (char *)realloc(E.streamBuf, E.streamCap);
+            if (E.streamBuf == NULL) {
+                die("realloc");
+            }
+        }
+
+        ssize_t n = read(E.streamFd, E.streamBuf + E.streamLen, E.streamCap - E.streamLen);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            eof = (n == 0 || errno != EAGAIN);
+            break;
+        }
+        E.streamLen += n;
+    }
+
+    // an unfinished line waits for the rest of it, unless nothing more comes.
+    int len = E.streamLen;
+    if (!eof) {
+        while (len > 0 && E.streamBuf[len - 1] != '\n') {
+            len--;
+        }
+    }
+
+    int rows = 0;
+    if (len > 0) {
+        rows = spliceEditorRows(E.numRows, 0, E.streamBuf, len);
+        memmove(E.streamBuf, E.streamBuf + len, E.streamLen - len);
+        E.streamLen -= len;
+        followEditorEnd(atEnd);
+    }
+
+    if (eof) {
+        close(E.streamFd);
+        E.streamFd = -1;
+        free(E.streamBuf);
+        E.streamBuf = NULL;
+        E.streamLen = 0;
+        E.streamCap = 0;
+        setEditorStatusMessage("%d lines read from standard input", E.numRows);
+    }
+
+    return rows > 0 || eof;
+}
+
+/*** file watch ***/
+
+// the open file and its directory are watched with inotify. a change that
+// only appends is read from where the file used to end, anything else is
+// read whole but only the blocks whose checksums differ replace rows.
+
+void resetEditorDisk(struct editorDisk *d) {
+    free(d->block);
+    memset(d, 0, sizeof(*d));
+    d->sealed = 1;
+}
+
+void statEditorDisk(struct editorDisk *d, struct stat *st) {
+    d->known = 1;
+    d->dev = st->st_dev;
+    d->ino = st->st_ino;
+    d->size = st->st_size;
+    d->mtime = st->st_mtim;
+}
+
+int isEditorDiskUnchanged(struct editorDisk *d, struct stat *st) {
+    return d->known && d->dev == st->st_dev && d->ino == st->st_ino && d->size == st->st_size &&
+        d->mtime.tv_sec == st->st_mtim.tv_sec && d->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// adds a line, with its newline if it has one.
+void addEditorDiskLine(struct editorDisk *d, const char *line, long long len) {
+    int newline = len > 0 && line[len - 1] == '\n';
+    addEditorDiskText(d, line, newline ? len - 1 : len, newline);
+}
+
+// adds the text of a row and the newline written after it.
+void addEditorDiskRow(struct editorDisk *d, const char *chars, int size) {
+    addEditorDiskText(d, chars, size, 1);
+}
+
+void addEditorDiskText(struct editorDisk *d, const char *text, long long len, int newline) {
+    if (d->sealed) {
+        if (d->numBlocks == d->blockCap) {
+            d->blockCap = d->blockCap ? d->blockCap * 2 : 64;
+            d->block = (struct diskBlock *)realloc(d->block, sizeof(struct diskBlock) * d->blockCap);
+            if (d->block == NULL) {
+                die("realloc");
+            }
+        }
+        d->block[d->numBlocks].rows = 0;
+        d->block[d->numBlocks].len = 0;
+        d->block[d->numBlocks].hash = FNV1A_INIT;
+        d->numBlocks++;
+        d->sealed = 0;
+    }
+
+    struct diskBlock *b = &d->block[d->numBlocks - 1];
+    b->rows++;
+    b->len += len + newline;
+    b->hash = fnv1a(b->hash, text, len);
+    if (newline) {
+        b->hash = fnv1a(b->hash, "\n", 1);
+    }
+
+    d->tailLen = newline ? 0 : len;
+    if (newline && (fnv1a(fnv1a(FNV1A_INIT, text, len), "\n", 1) % MACHO_DISK_BLOCK == 0 || b->rows >= MACHO_DISK_BLOCK * 8)) {
+        d->sealed = 1;
+    }
+}
+
+void scanEditorDisk(struct editorDisk *d, const char *buf, long long len) {
+    const char *end = buf + len;
+    const char *p = buf;
+
+    while (p < end) {
+        const char *nl = (const char *)memchr(p, '\n', end - p);
+        const char *next = nl ? nl + 1 : end;
+
+        addEditorDiskLine(d, p, next - p);
+        p = next;
+    }
+}
+
+int isSameDiskBlock(struct diskBlock *a, struct diskBlock *b) {
+    return a->rows == b->rows && a->len == b->len && a->hash == b->hash;
+}
+
+// reads len bytes at offset, or returns NULL if the file is shorter now.
+char *readEditorDisk(int fd, off_t offset, long long len) {
+    char *buf = (char *)malloc(len ? len : 1);
+    long long got = 0;
+
+    while (buf && got < len) {
+        ssize_t n = pread(fd, buf + got, len - got, offset + got);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(buf);
+            return NULL;
+        }
+        got += n;
+    }
+    return buf;
+}
+
+// brings in lines appended after the end of the file as it was read, after
+// checking the last block still reads the same. returns 0 if it doesn't.
+int appendEditorDisk(int fd, struct stat *st) {
+    struct editorDisk *d = &E.disk;
+    if (E.compress || E.fileLost || !d->known || d->numBlocks == 0 || d->dev != st->st_dev || d->ino != st->st_ino || st->st_size <= d->size) {
+        return 0;
+    }
+
+    struct diskBlock tail = d->block[d->numBlocks - 1];
+    off_t from = d->size - tail.len;
+    long long len = st->st_size - from;
+    char *buf = readEditorDisk(fd, from, len);
+    if (buf == NULL || fnv1a(FNV1A_INIT, buf, tail.len) != tail.hash) {
+        free(buf);
+        return 0;
+    }
+
+    // the last block is scanned again with the new lines, and a last line
+    // that had no newline is read again.
+    long long keep = tail.len - d->tailLen;
+    int reread = d->tailLen ? 1 : 0;
+
+    d->numBlocks--;
+    d->sealed = 1;
+    scanEditorDisk(d, buf, len);
+    statEditorDisk(d, st);
+    E.cacheFresh = 0;
+
+    int firstRow = E.numRows - reread;
+    int atEnd = isEditorCursorAtEnd();
+    int rows = spliceEditorRows(firstRow, reread, buf + keep, len - keep);
+    free(buf);
+    followEditorEnd(atEnd);
+
+    if (reread) {
+        clearEditorUndo();
+    }
+    setEditorStatusMessage("Lines %d-%d appended on disk", firstRow + 1, firstRow + rows);
+    return 1;
+}
+
+// reads the file again, replacing only the rows between the blocks at the
+// start and at the end that are unchanged.
+void reloadEditorDisk(int fd, struct stat *st) {
+    int kind = editorCompressionOf(fd);
+    long long len = st->st_size;
+    char *buf = kind ? inflateEditorFile(fd, kind, &len) : readEditorDisk(fd, 0, len);
+    if (buf == NULL) {
+        // a compressed file cut short, maybe still being written. it is
+        // tried again on the next change.
+        if (kind) {
+            setEditorStatusMessage("File on disk is corrupt or incomplete, not reloaded");
+        }
+        return;
+    }
+    E.compress = kind;
+
+    struct editorDisk fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    fresh.sealed = 1;
+    scanEditorDisk(&fresh, buf, len);
+    statEditorDisk(&fresh, st);
+
+    // rows still read from this file would be read from where their lines
+    // used to be, so only rows ahead of the change are kept. rows lost to a
+    // change while they were read may be anywhere, so then none are kept.
+    struct stat backing;
+    int moved = E.fileFd != -1 && fstat(E.fileFd, &backing) == 0 &&
+        backing.st_dev == st->st_dev && backing.st_ino == st->st_ino;
+
+    struct editorDisk *old = &E.disk;
+    int head = 0;
+    int tail = 0;
+    while (!E.fileLost && head < old->numBlocks && head < fresh.numBlocks && isSameDiskBlock(&old->block[head], &fresh.block[head])) {
+        head++;
+    }
+    while (!moved && !E.fileLost && tail < old->numBlocks - head && tail < fresh.numBlocks - head &&
+        isSameDiskBlock(&old->block[old->numBlocks - 1 - tail], &fresh.block[fresh.numBlocks - 1 - tail])) {
+        tail++;
+    }
+
+    int firstRow = 0;
+    long long from = 0;
+    int j;
+    for (j = 0; j < head; j++) {
+        firstRow += fresh.block[j].rows;
+        from += fresh.block[j].len;
+    }
+    int lastRow = E.numRows;
+    long long to = len;
+    for (j = 0; j < tail; j++) {
+        lastRow -= old->block[old->numBlocks - 1 - j].rows;
+        to -= fresh.block[fresh.numBlocks - 1 - j].len;
+    }
+
+    int rows = spliceEditorRows(firstRow, lastRow - firstRow, buf + from, to - from);
+    free(buf);
+    resetEditorDisk(old);
+    *old = fresh;
+    E.cacheFresh = 0;
+    E.fileLost = 0;
+
+    clearEditorUndo();
+    clearEditorCursors();
+    if (E.cy > E.numRows) {
+        E.cy = E.numRows;
+    }
+    if (E.cy < E.numRows && E.cx > E.row[E.cy].size) {
+        E.cx = E.row[E.cy].size;
+    }
+    if (rows == 0 && lastRow == firstRow) {
+        setEditorStatusMessage("File touched on disk, nothing changed");
+    } else {
+        setEditorStatusMessage("Lines %d-%d reloaded from disk", firstRow + 1, firstRow + rows);
+    }
+}
+
+// compares the file on disk with what was last read or written, and brings
+// in the changes unless there are unsaved edits. returns 1 if it changed.
+int checkEditorDisk() {
+    struct stat st;
+
+    if (E.fileName == NULL || stat(E.fileName, &st) == -1 || isEditorDiskUnchanged(&E.disk, &st)) {
+        return 0;
+    }
+
+    watchEditorFile();
+    if (E.dirty) {
+        if (E.diskConflict == 0) {
+            E.diskConflict = 1;
+            setEditorStatusMessage("Warning: file changed on disk, conflicts with unsaved edits");
+        }
+        return 1;
+    }
+
+    int fd = open(E.fileName, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    if (!appendEditorDisk(fd, &st)) {
+        reloadEditorDisk(fd, &st);
+    }
+    close(fd);
+    return 1;
+}
+
+void watchEditorFile() {
+    if (E.fileName == NULL || E.headless) {
+        return;
+    }
+    if (E.watchFd == -1) {
+        E.watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (E.watchFd == -1) {
+            return;
+        }
+    }
+
+    // the path may name another file now, after one was renamed over it.
+    int wd = inotify_add_watch(E.watchFd, E.fileName, IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (E.watchFile != -1 && E.watchFile != wd) {
+        inotify_rm_watch(E.watchFd, E.watchFile);
+    }
+    E.watchFile = wd;
+
+    if (E.watchDir == -1) {
+        char *slash = strrchr(E.fileName, '/');
+        char dir[PATH_MAX];
+
+        if (slash == NULL) {
+            strcpy(dir, ".");
+        } else {
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash - E.fileName + 1), E.fileName);
+        }
+        E.watchDir = inotify_add_watch(E.watchFd, dir, IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE);
+    }
+}
+
+// drains the pending events. returns 1 if any was about the open file, 2 if
+// it was also closed by its writer or renamed into place.
+int readEditorWatch() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char *slash = strrchr(E.fileName ? E.fileName : "", '/');
+    char *name = slash ? slash + 1 : E.fileName;
+    int relevant = 0;
+    ssize_t n;
+
+    while ((n = read(E.watchFd, buf, sizeof(buf))) > 0) {
+        char *p;
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+
+            int mine = (ev->mask & IN_Q_OVERFLOW) || ev->wd == E.watchFile ||
+                (ev->wd == E.watchDir && ev->len && name && strcmp(ev->name, name) == 0);
+            if (!mine) {
+                continue;
+            }
+
+            if (ev->wd == E.watchFile && (ev->mask & IN_IGNORED)) {
+                E.watchFile = -1;
+            }
+            if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                relevant = 2;
+            } else if (relevant == 0) {
+                relevant = 1;
+            }
+        }
+    }
+
+    return relevant;
+}
+
+/*** file cache ***/
+
+// what was worked out about a file is kept in ~/.cache/macho/files, under a
+// hash of its real path: the length of every line, the state its colors
+// start from, its brackets and where the cursor was. if the file has the
+// same size, time and sampled contents when it is opened again, the rows are
+// made from the cache and their text is only read from the file when they
+// are looked at.
+
+#define FILE_CACHE_MAGIC "MIDX"
+#define FILE_CACHE_VERSION 2
+
+struct fileCacheHeader {
+    char magic[4];
+    int version;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t sample;        // hash of the pages sampled from the file.
+    uint64_t syntax;        // hash of the syntax the states are for, 0 if none.
+    int numRows;
+    int numBlocks;          // of the file on disk, see struct editorDisk.
+    int sealed;
+    int cy;
+    int64_t tailLen;
+    int cx;
+    int rowOffset;
+    int colOffset;
+    int hlFrom;             // rows from here on were still to be highlighted, their states are guesses.
+};
+
+struct fileCacheRow {
+    uint32_t size;
+    uint32_t rsize;
+    unsigned char eol;      // bytes after the row up to the next line.
+    unsigned char endState;
+    unsigned char brackets[6];  // 255 where a count is not known.
+};
+
+int editorFileCachePath(char *fileName, char *path, size_t size) {
+    char real[PATH_MAX];
+    char dir[PATH_MAX];
+
+    if (realpath(fileName, real) == NULL || editorCacheDir(dir, sizeof(dir), "files") == -1) {
+        return -1;
+    }
+    uint64_t hash = fnv1a(FNV1A_INIT, real, strlen(real));
+    if (snprintf(path, size, "%s/%016llx.idx", dir, (unsigned long long)hash) >= (int)size) {
+        return -1;
+    }
+    return 0;
+}
+
+// hashes the first and last page of the file and MACHO_CACHE_SAMPLES in
+// between. reading all of a huge file is what the cache is there to avoid.
+uint64_t sampleEditorFile(int fd, off_t size) {
+    char page[4096];
+    uint64_t h = fnv1a(FNV1A_INIT, &size, sizeof(size));
+    off_t last = (size > (off_t)sizeof(page)) ? size - (off_t)sizeof(page) : 0;
+    int j;
+
+    for (j = 0; j <= MACHO_CACHE_SAMPLES + 1; j++) {
+        off_t at = last / (MACHO_CACHE_SAMPLES + 1) * j;
+        ssize_t n = pread(fd, page, sizeof(page), (j == MACHO_CACHE_SAMPLES + 1) ? last : at);
+
+        if (n > 0) {
+            h = fnv1a(h, page, n);
+        }
+    }
+    return h;
+}
+
+uint64_t editorCacheSyntax() {
+    return E.syntax ? hashEditorSyntax(E.syntax) : 0;
+}
+
+// reads the rows of a block still in the file into plain. the bytes must
+// hash to what the cache has for them. if the file was written over in
+// place they don't, and the rows read as nul bytes rather than as whatever
+// is there now.
+void readEditorFileBlock(struct coldBlock *block, unsigned char *plain) {
+    int got = 0;
+
+    while (got < block->plainLen) {
+        ssize_t n = pread(E.fileFd, plain + got, block->plainLen - got, block->fileAt + got);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    if (got < block->plainLen || fnv1a(FNV1A_INIT, plain, block->plainLen) != block->fileHash) {
+        memset(plain, 0, block->plainLen);
+        if (!E.fileLost) {
+            E.fileLost = 1;
+            setEditorStatusMessage("File changed on disk under unread lines! They are lost, saving is off");
+        }
+    }
+}
+
+struct coldBlock *newEditorFileBlock(off_t fileAt, uint64_t hash) {
+    struct coldBlock *block = (struct coldBlock *)malloc(sizeof(struct coldBlock));
+    if (block == NULL) {
+        die("malloc");
+    }
+    if (E.fileBlockLen == E.fileBlockCap) {
+        E.fileBlockCap = E.fileBlockCap ? E.fileBlockCap * 2 : 64;
+        E.fileBlock = (struct coldBlock **)realloc(E.fileBlock, sizeof(struct coldBlock *) * E.fileBlockCap);
+        if (E.fileBlock == NULL) {
+            die("realloc");
+        }
+    }
+    block->rows = 0;
+    block->plainLen = 0;
+    block->packedLen = 0;
+    block->packed = NULL;
+    block->fileAt = fileAt;
+    block->fileHash = hash;
+    block->fileSlot = E.fileBlockLen;
+    E.fileBlock[E.fileBlockLen++] = block;
+    E.fileBlocks++;
+    return block;
+}
+
+// the block no longer reads from the file, which is closed after the last.
+void dropEditorFileBlock(struct coldBlock *block) {
+    E.fileBlock[block->fileSlot] = NULL;
+    if (--E.fileBlocks == 0) {
+        close(E.fileFd);
+        E.fileFd = -1;
+        free(E.fileBlock);
+        E.fileBlock = NULL;
+        E.fileBlockLen = 0;
+        E.fileBlockCap = 0;
+        E.filePulled = 0;
+    }
+}
+
+// reads MACHO_PULL_BLOCKS more blocks still in the file into memory, packed,
+// so that the rows of a buffer with unsaved edits no longer depend on the
+// file staying as it was. coldPlain is left alone, as the rows peeked at
+// may point into it. returns 1 if there are blocks left.
+int pullEditorFileBlocks() {
+    unsigned char *plain = NULL;
+    int cap = 0;
+    int pulled = 0;
+
+    while (E.fileBlocks > 0 && pulled < MACHO_PULL_BLOCKS) {
+        struct coldBlock *block = E.fileBlock[E.filePulled++];
+        if (block == NULL) {
+            continue;
+        }
+
+        if (block->plainLen >= cap) {
+            cap = block->plainLen + 1;
+            plain = (unsigned char *)realloc(plain, cap);
+            if (plain == NULL) {
+                die("realloc");
+            }
+        }
+        readEditorFileBlock(block, plain);
+        block->packed = (unsigned char *)malloc(packedColdBound(block->plainLen));
+        if (block->packed == NULL) {
+            die("malloc");
+        }
+        block->packedLen = packColdBytes(plain, block->plainLen, block->packed);
+        block->packed = (unsigned char *)realloc(block->packed, block->packedLen ? block->packedLen : 1);
+        dropEditorFileBlock(block);
+        pulled++;
+    }
+    free(plain);
+    return E.fileBlocks > 0;
+}
+
+int checkEditorFileCache(const struct fileCacheHeader *h, size_t len, struct stat *st, int fd) {
+    if (len < sizeof(*h) || memcmp(h->magic, FILE_CACHE_MAGIC, 4) || h->version != FILE_CACHE_VERSION ||
+        h->numRows < 0 || h->numBlocks < 0 || h->syntax != editorCacheSyntax() ||
+        h->dev != (uint64_t)st->st_dev || h->ino != (uint64_t)st->st_ino || h->size != (int64_t)st->st_size ||
+        h->mtimeSec != (int64_t)st->st_mtim.tv_sec || h->mtimeNsec != (int64_t)st->st_mtim.tv_nsec ||
+        len != sizeof(*h) + sizeof(struct diskBlock) * (size_t)h->numBlocks + sizeof(struct fileCacheRow) * (size_t)h->numRows) {
+        return 0;
+    }
+
+    // the lengths of the rows must add up to each block and the blocks to
+    // the file, or the rows would be read from the wrong places.
+    const struct diskBlock *block = (const struct diskBlock *)(h + 1);
+    const struct fileCacheRow *cr = (const struct fileCacheRow *)(block + h->numBlocks);
+    long long total = 0;
+    int at = 0;
+    int j;
+    if (h->hlFrom < 0 || h->hlFrom > h->numRows) {
+        return 0;
+    }
+    for (j = 0; j < h->numBlocks; j++) {
+        long long blockLen = 0;
+        int k;
+
+        if (block[j].rows < 1 || block[j].rows > h->numRows - at || block[j].len > INT_MAX / 2) {
+            return 0;
+        }
+        for (k = 0; k < block[j].rows; k++, at++) {
+            if (cr[at].size > INT_MAX / 2 || cr[at].rsize > INT_MAX / 2 || cr[at].endState >= HL_STATE_COUNT) {
+                return 0;
+            }
+            blockLen += cr[at].size + cr[at].eol;
+        }
+        if (blockLen != block[j].len) {
+            return 0;
+        }
+        total += blockLen;
+    }
+    return at == h->numRows && total == h->size && sampleEditorFile(fd, st->st_size) == h->sample;
+}
+
+// makes the rows from the cache of the file, if there is one that matches
+// it. returns -1 if the file has to be read instead.
+int loadEditorCache(char *fileName) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (E.headless || editorFileCachePath(fileName, path, sizeof(path)) == -1) {
+        return -1;
+    }
+
+    int cacheFd = open(path, O_RDONLY);
+    if (cacheFd == -1) {
+        return -1;
+    }
+    struct stat cacheSt;
+    void *map = MAP_FAILED;
+    if (fstat(cacheFd, &cacheSt) == 0 && cacheSt.st_size >= (off_t)sizeof(struct fileCacheHeader)) {
+        map = mmap(NULL, cacheSt.st_size, PROT_READ, MAP_PRIVATE, cacheFd, 0);
+    }
+    close(cacheFd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    const struct fileCacheHeader *h = (const struct fileCacheHeader *)map;
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1 || !checkEditorFileCache(h, cacheSt.st_size, &st, fd)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        munmap(map, cacheSt.st_size);
+        return -1;
+    }
+    const struct diskBlock *diskBlock = (const struct diskBlock *)(h + 1);
+    const struct fileCacheRow *cr = (const struct fileCacheRow *)(diskBlock + h->numBlocks);
+
+    // the rows of each block of the file on disk are read from it together,
+    // so what is read can be checked against the hash of the block.
+    reserveEditorRows(h->numRows);
+    struct coldBlock *block = NULL;
+    off_t offset = 0;
+    int blockAt = -1;
+    int blockLeft = 0;
+    int j;
+    for (j = 0; j < h->numRows; j++) {
+        editorRow *row = &E.row[j];
+        int len = cr[j].size + cr[j].eol;
+
+        while (blockLeft == 0) {
+            blockAt++;
+            blockLeft = diskBlock[blockAt].rows;
+            block = newEditorFileBlock(offset, diskBlock[blockAt].hash);
+        }
+        memset(row, 0, sizeof(*row));
+        row->size = cr[j].size;
+        row->rsize = cr[j].rsize;
+        row->hlSerial = ++E.hlSerial;
+        row->hlDone = row->hlSerial;
+        if (j >= h->hlFrom) {
+            row->hlDone = 0;
+            E.hlPending++;
+        }
+        row->hlStartState = (j > 0) ? cr[j - 1].endState : HL_STATE_NORMAL;
+        row->hlEndState = cr[j].endState;
+        row->cold = block;
+        row->coldAt = block->plainLen;
+        row->seen = E.coldClock;
+
+        int k;
+        for (k = 0; k < 3; k++) {
+            row->brackets.kind[k].close = (cr[j].brackets[2 * k] == 255) ? -1 : cr[j].brackets[2 * k];
+            row->brackets.kind[k].open = (cr[j].brackets[2 * k + 1] == 255) ? -1 : cr[j].brackets[2 * k + 1];
+            if (row->brackets.kind[k].close < 0 || row->brackets.kind[k].open < 0) {
+                row->brackets.kind[0].close = -1;
+            }
+        }
+
+        block->plainLen += len;
+        block->rows++;
+        blockLeft--;
+        offset += len;
+    }
+    E.numRows = h->numRows;
+    E.fileFd = fd;
+    E.cacheFresh = 1;
+    E.cacheHlFrom = h->hlFrom;
+    E.hlSweep = h->hlFrom;
+    resetEditorChunks();
+
+    resetEditorDisk(&E.disk);
+    E.disk.block = (struct diskBlock *)malloc(sizeof(struct diskBlock) * (h->numBlocks ? h->numBlocks : 1));
+    if (E.disk.block == NULL) {
+        die("malloc");
+    }
+    memcpy(E.disk.block, diskBlock, sizeof(struct diskBlock) * h->numBlocks);
+    E.disk.numBlocks = E.disk.blockCap = h->numBlocks;
+    E.disk.sealed = h->sealed;
+    E.disk.tailLen = h->tailLen;
+    statEditorDisk(&E.disk, &st);
+
+    E.cy = (h->cy < 0) ? 0 : (h->cy > E.numRows) ? E.numRows : h->cy;
+    E.cx = (E.cy < E.numRows && h->cx >= 0 && h->cx <= E.row[E.cy].size) ? h->cx : 0;
+    E.rowOffset = (h->rowOffset < 0 || h->rowOffset > E.cy) ? E.cy : h->rowOffset;
+    E.colOffset = (h->colOffset < 0) ? 0 : h->colOffset;
+
+    munmap(map, cacheSt.st_size);
+    E.dirty = 0;
+    return 0;
+}
+
+// fills in the row part of the cache from the file itself, which must be
+// what the rows were read from. returns -1 if a line doesn't match its row.
+int scanEditorFileCache(int fd, struct fileCacheRow *cr) {
+    char *buf = (char *)malloc(MACHO_VIEW_CHUNK);
+    long long lineLen = 0;
+    int at = 0;
+    ssize_t n;
+
+    if (buf == NULL) {
+        die("malloc");
+    }
+    while (at < E.numRows && (n = read(fd, buf, MACHO_VIEW_CHUNK)) > 0) {
+        char *p = buf;
+        char *end = buf + n;
+
+        while (p < end && at < E.numRows) {
+            char *nl = (char *)memchr(p, '\n', end - p);
+            if (nl == NULL) {
+                lineLen += end - p;
+                break;
+            }
+            lineLen += nl + 1 - p;
+            p = nl + 1;
+            if (lineLen - E.row[at].size < 1 || lineLen - E.row[at].size > 255) {
+                free(buf);
+                return -1;
+            }
+            cr[at].eol = lineLen - E.row[at].size;
+            at++;
+            lineLen = 0;
+        }
+    }
+    free(buf);
+
+    // the last line may have no newline.
+    if (at == E.numRows - 1 && lineLen - E.row[at].size >= 0 && lineLen - E.row[at].size <= 255) {
+        cr[at].eol = lineLen - E.row[at].size;
+        at++;
+        lineLen = 0;
+    }
+    return (at == E.numRows && lineLen == 0) ? 0 : -1;
+}
+
+// remembers the file for the next time it is opened. if it was opened from
+// the cache and is unchanged, only the position is written. rows from the
+// first one still to be highlighted on may yet change state, so their
+// states are only guesses and they are highlighted again once loaded.
+void saveEditorCache() {
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (E.fileName == NULL || E.dirty || E.view || E.streamed || E.headless || E.compress ||
+        editorFileCachePath(E.fileName, path, sizeof(path)) == -1 ||
+        stat(E.fileName, &st) == -1 || !isEditorDiskUnchanged(&E.disk, &st)) {
+        return;
+    }
+
+    struct fileCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FILE_CACHE_MAGIC, 4);
+    h.version = FILE_CACHE_VERSION;
+    h.dev = st.st_dev;
+    h.ino = st.st_ino;
+    h.size = st.st_size;
+    h.mtimeSec = st.st_mtim.tv_sec;
+    h.mtimeNsec = st.st_mtim.tv_nsec;
+    h.syntax = editorCacheSyntax();
+    h.numRows = E.numRows;
+    h.numBlocks = E.disk.numBlocks;
+    h.sealed = E.disk.sealed;
+    h.tailLen = E.disk.tailLen;
+    h.cy = E.cy;
+    h.cx = E.cx;
+    h.rowOffset = E.rowOffset;
+    h.colOffset = E.colOffset;
+    while (h.hlFrom < E.numRows && E.row[h.hlFrom].hlDone == E.row[h.hlFrom].hlSerial) {
+        h.hlFrom++;
+    }
+
+    int fd = open(E.fileName, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    h.sample = sampleEditorFile(fd, st.st_size);
+
+    if (E.cacheFresh && h.hlFrom == E.cacheHlFrom) {
+        int cacheFd = open(path, O_WRONLY);
+        if (cacheFd != -1) {
+            if (pwrite(cacheFd, &h, sizeof(h), 0) != sizeof(h)) {
+                unlink(path);
+            }
+            close(cacheFd);
+        }
+        close(fd);
+        return;
+    }
+
+    struct fileCacheRow *cr = (struct fileCacheRow *)malloc(sizeof(struct fileCacheRow) * (E.numRows ? E.numRows : 1));
+    if (cr == NULL) {
+        die("malloc");
+    }
+    int ok = scanEditorFileCache(fd, cr) == 0;
+    close(fd);
+
+    int j;
+    for (j = 0; ok && j < E.numRows; j++) {
+        struct bracketNode *b = &E.row[j].brackets;
+        int k;
+
+        cr[j].size = E.row[j].size;
+        cr[j].rsize = E.row[j].rsize;
+        cr[j].endState = E.row[j].hlEndState;
+        for (k = 0; k < 3; k++) {
+            int known = b->kind[0].close >= 0 && j < h.hlFrom;
+
+            cr[j].brackets[2 * k] = (known && b->kind[k].close < 255) ? b->kind[k].close : 255;
+            cr[j].brackets[2 * k + 1] = (known && b->kind[k].open < 255) ? b->kind[k].open : 255;
+        }
+    }
+
+    char tmp[PATH_MAX];
+    FILE *fp = NULL;
+    if (ok && snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) < (int)sizeof(tmp)) {
+        fp = fopen(tmp, "wb");
+    }
+    if (fp) {
+        ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+            fwrite(E.disk.block, sizeof(struct diskBlock), E.disk.numBlocks, fp) == (size_t)E.disk.numBlocks &&
+            fwrite(cr, sizeof(struct fileCacheRow), E.numRows, fp) == (size_t)E.numRows;
+        if (fclose(fp) != 0 || !ok || rename(tmp, path) == -1) {
+            unlink(tmp);
+        }
+    }
+    free(cr);
+}
+
+/*** diff ***/
+
+// Ctrl-D marks the rows that differ from the file on disk. rows and lines are
+// compared by their hashes. the hashes of the lines on disk are kept until
+// the file changes, and those of the rows until they are edited, so after an
+// edit only the rows between the first and the last one edited are hashed
+// again. the rows at the start and end that match the file are skipped, and what is left goes through Myers' diff
+// in linear space, which splits it where the shortest edit script crosses
+// the middle and recurses on both halves.
+
+uint64_t editorRowHash(int at) {
+    editorRow *row = &E.row[at];
+
+    if (row->interned) {
+        return editorRowLine(row)->hash;
+    }
+    if (row->hashSerial != row->hlSerial || row->hlSerial == 0) {
+        row->hash = fnv1a(FNV1A_INIT, peekEditorRow(row), row->size);
+        row->hashSerial = row->hlSerial;
+    }
+    return row->hash;
+}
+
+// lines of the file removed above a row.
+struct diffRemoval {
+    int at;
+    int lines;
+};
+
+struct editorDiff {
+    uint64_t *a;        // lines of the file.
+    uint64_t *b;        // rows.
+    struct diffRemoval *removal;    // in the order of the rows.
+    int numRemovals;
+    int removalCap;
+    int *v1;            // furthest line of the file reached on each diagonal,
+    int *v2;            // going forwards and going backwards.
+};
+
+// finds a point (x, y) the shortest edit script from a[aLo, aHi) to
+// b[bLo, bHi) goes through, near its middle. returns -1 if that takes more
+// than MACHO_DIFF_COST edits from either end.
+static int bisectEditorDiff(struct editorDiff *df, int aLo, int aHi, int bLo, int bHi, int *x, int *y) {
+    uint64_t *a = df->a + aLo;
+    uint64_t *b = df->b + bLo;
+    int n = aHi - aLo;
+    int m = bHi - bLo;
+    int maxD = (n + m + 1) / 2;
+    if (maxD > MACHO_DIFF_COST) {
+        maxD = MACHO_DIFF_COST;
+    }
+    int off = maxD;
+    int len = 2 * maxD + 2;
+    int delta = n - m;
+    int front = (delta % 2 != 0);   // which way the paths meet first.
+    int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+    int d, k;
+
+    for (k = 0; k < len; k++) {
+        df->v1[k] = -1;
+        df->v2[k] = -1;
+    }
+    df->v1[off + 1] = 0;
+    df->v2[off + 1] = 0;
+
+    for (d = 0; d < maxD; d++) {
+        for (k = -d + k1start; k <= d - k1end; k += 2) {
+            int i = off + k;
+            int x1 = (k == -d || (k != d && df->v1[i - 1] < df->v1[i + 1])) ? df->v1[i + 1] : df->v1[i - 1] + 1;
+            int y1 = x1 - k;
+
+            while (x1 < n && y1 < m && a[x1] == b[y1]) {
+                x1++;
+                y1++;
+            }
+            df->v1[i] = x1;
+            if (x1 > n) {
+                k1end += 2;
+            } else if (y1 > m) {
+                k1start += 2;
+            } else if (front) {
+                int j = off + delta - k;
+                if (j >= 0 && j < len && df->v2[j] != -1 && x1 >= n - df->v2[j]) {
+                    *x = x1;
+                    *y = y1;
+                    return 0;
+                }
+            }
+        }
+
+        for (k = -d + k2start; k <= d - k2end; k += 2) {
+            int i = off + k;
+            int x2 = (k == -d || (k != d && df->v2[i - 1] < df->v2[i + 1])) ? df->v2[i + 1] : df->v2[i - 1] + 1;
+            int y2 = x2 - k;
+
+            while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1]) {
+                x2++;
+                y2++;
+            }
+            df->v2[i] = x2;
+            if (x2 > n) {
+                k2end += 2;
+            } else if (y2 > m) {
+                k2start += 2;
+            } else if (!front) {
+                int j = off + delta - k;
+                if (j >= 0 && j < len && df->v1[j] != -1 && df->v1[j] >= n - x2) {
+                    *x = df->v1[j];
+                    *y = off + df->v1[j] - j;
+                    return 0;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+// marks the rows of b[bLo, bHi) that aren't lines of a[aLo, aHi).
+static void diffEditorRange(struct editorDiff *df, int aLo, int aHi, int bLo, int bHi) {
+    while (aLo < aHi && bLo < bHi && df->a[aLo] == df->b[bLo]) {
+        aLo++;
+        bLo++;
+    }
+    while (aLo < aHi && bLo < bHi && df->a[aHi - 1] == df->b[bHi - 1]) {
+        aHi--;
+        bHi--;
+    }
+
+    int x, y;
+    if (aLo < aHi && bLo < bHi && bisectEditorDiff(df, aLo, aHi, bLo, bHi, &x, &y) == 0 &&
+        (x > 0 || y > 0) && (x < aHi - aLo || y < bHi - bLo)) {
+        diffEditorRange(df, aLo, aLo + x, bLo, bLo + y);
+        diffEditorRange(df, aLo + x, aHi, bLo + y, bHi);
+        return;
+    }
+
+    // one side is empty, or the two differ too much to be worth telling apart.
+    if (aHi > aLo) {
+        if (df->numRemovals == df->removalCap) {
+            df->removalCap = df->removalCap ? df->removalCap * 2 : 64;
+            df->removal = (struct diffRemoval *)realloc(df->removal, sizeof(struct diffRemoval) * df->removalCap);
+            if (df->removal == NULL) {
+                die("realloc");
+            }
+        }
+        df->removal[df->numRemovals].at = bLo;
+        df->removal[df->numRemovals].lines = aHi - aLo;
+        df->numRemovals++;
+    }
+    memset(&E.diffMark[bLo], DIFF_ADDED, bHi - bLo);
+    E.diffAdded += bHi - bLo;
+}
+
+// hashes the lines of the file on disk, unless it is the file hashed last.
+// returns 1 if the hashes changed.
+int hashEditorDiskLines() {
+    struct stat st;
+
+    // a file not saved yet has no lines.
+    if (E.fileName == NULL || stat(E.fileName, &st) == -1) {
+        memset(&st, 0, sizeof(st));
+    }
+    if (isEditorDiskUnchanged(&E.diffDisk, &st)) {
+        return 0;
+    }
+    statEditorDisk(&E.diffDisk, &st);
+    free(E.diffLine);
+    E.diffLine = NULL;
+    E.diffLines = 0;
+
+    int fd = (st.st_ino != 0) ? open(E.fileName, O_RDONLY) : -1;
+    if (fd == -1) {
+        return 1;
+    }
+
+    int kind = editorCompressionOf(fd);
+    long long len = st.st_size;
+    char *buf = NULL;
+    if (kind) {
+        buf = inflateEditorFile(fd, kind, &len);
+    } else if (len > 0) {
+        buf = (char *)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) {
+            buf = NULL;
+        }
+    }
+    close(fd);
+
+    int cap = 0;
+    char *p = buf;
+    char *end = buf + (buf ? len : 0);
+    while (p < end) {
+        char *nl = (char *)memchr(p, '\n', end - p);
+        char *stop = nl ? nl : end;
+        long long n = stop - p;
+
+        // as in rows, without the line ending.
+        while (n > 0 && p[n - 1] == '\r') {
+            n--;
+        }
+        if (E.diffLines == cap) {
+            cap = cap ? cap * 2 : 1024;
+            E.diffLine = (uint64_t *)realloc(E.diffLine, sizeof(uint64_t) * cap);
+            if (E.diffLine == NULL) {
+                die("realloc");
+            }
+        }
+        E.diffLine[E.diffLines++] = fnv1a(FNV1A_INIT, p, n);
+        p = stop + 1;
+    }
+
+    if (kind) {
+        free(buf);
+    } else if (buf) {
+        munmap(buf, len);
+    }
+    return 1;
+}
+
+// brings the hashes of the rows up to date. the rows left in place at
+// either end since the last diff keep theirs.
+void hashEditorDiffRows() {
+    int from = E.diffFrom;
+    int after = E.diffAfter;
+    int j;
+
+    if (from > E.numRows) {
+        from = E.numRows;
+    }
+    if (from > E.diffRows) {
+        from = E.diffRows;
+    }
+    if (after > E.numRows - from) {
+        after = E.numRows - from;
+    }
+    if (after > E.diffRows - from) {
+        after = E.diffRows - from;
+    }
+
+    if (E.numRows > E.diffRowCap) {
+        E.diffRowCap = E.numRows * 2;
+        E.diffRow = (uint64_t *)realloc(E.diffRow, sizeof(uint64_t) * E.diffRowCap);
+        if (E.diffRow == NULL) {
+            die("realloc");
+        }
+    }
+    if (after > 0) {
+        memmove(&E.diffRow[E.numRows - after], &E.diffRow[E.diffRows - after], sizeof(uint64_t) * after);
+    }
+    for (j = from; j < E.numRows - after; j++) {
+        E.diffRow[j] = editorRowHash(j);
+    }
+    E.diffRows = E.numRows;
+    E.diffFrom = INT_MAX;
+    E.diffAfter = INT_MAX;
+}
+
+// works out the marks of the rows and the counts shown in the status bar.
+void diffEditorRows() {
+    struct editorDiff df;
+    int j;
+
+    hashEditorDiffRows();
+    E.diffMark = (unsigned char *)realloc(E.diffMark, E.numRows + 1);
+    df.a = E.diffLine;
+    df.b = E.diffRow;
+    df.removal = NULL;
+    df.numRemovals = 0;
+    df.removalCap = 0;
+    df.v1 = (int *)malloc(sizeof(int) * (2 * MACHO_DIFF_COST + 2));
+    df.v2 = (int *)malloc(sizeof(int) * (2 * MACHO_DIFF_COST + 2));
+    if (E.diffMark == NULL || df.v1 == NULL || df.v2 == NULL) {
+        die("malloc");
+    }
+
+    memset(E.diffMark, 0, E.numRows + 1);
+    E.diffAdded = 0;
+    E.diffChanged = 0;
+    E.diffRemoved = 0;
+    diffEditorRange(&df, 0, E.diffLines, 0, E.numRows);
+
+    // lines removed where rows were added count as changed rows.
+    for (j = 0; j < df.numRemovals; j++) {
+        int at = df.removal[j].at;
+        int left = df.removal[j].lines;
+        int k;
+
+        for (k = at; left > 0 && k < E.numRows && E.diffMark[k] == DIFF_ADDED; k++, left--) {
+            E.diffMark[k] = DIFF_CHANGED;
+            E.diffAdded--;
+            E.diffChanged++;
+        }
+        for (k = at - 1; left > 0 && k >= 0 && E.diffMark[k] == DIFF_ADDED; k--, left--) {
+            E.diffMark[k] = DIFF_CHANGED;
+            E.diffAdded--;
+            E.diffChanged++;
+        }
+        if (left > 0) {
+            E.diffMark[at] |= DIFF_REMOVED;
+            E.diffRemoved += left;
+        }
+    }
+
+    free(df.removal);
+    free(df.v1);
+    free(df.v2);
+}
+
+// brings the marks up to date with the rows and the file, before a frame.
+void refreshEditorDiff() {
+    if (!E.diff) {
+        return;
+    }
+    if (hashEditorDiskLines() || E.diffFrom != INT_MAX) {
+        diffEditorRows();
+    }
+}
+
+void toggleEditorDiff() {
+    if (E.view || E.fileName == NULL) {
+        setEditorStatusMessage("No file on disk to compare with");
+        return;
+    }
+
+    E.diff = !E.diff;
+    free(E.diffMark);
+    E.diffMark = NULL;
+    free(E.diffRow);
+    E.diffRow = NULL;
+    E.diffRows = 0;
+    E.diffRowCap = 0;
+    E.diffFrom = 0;
+    E.diffAfter = 0;
+    free(E.diffLine);
+    E.diffLine = NULL;
+    E.diffLines = 0;
+    memset(&E.diffDisk, 0, sizeof(E.diffDisk));
+    updateEditorGutter();
+
+    setEditorStatusMessage("Diff %s", E.diff ? "on" : "off");
+}
+
+/*** view ***/
+
+// --view opens a file read only and keeps just a window of it in rows, so
+// memory does not grow with the file. lines are found through an index of
+// the offset of every MACHO_VIEW_CHECKPOINT-th line, built as the file is
+// gone through, and scanning on from the nearest one.
+
+int isEditorKeyPending() {
+    struct pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&fd, 1, 0) > 0;
+}
+
+int isEditorReadOnly() {
+    if (E.view) {
+        setEditorStatusMessage("Read only, opened with --view");
+    }
+    return E.view;
+}
+
+// called for each line start passed while going through the file.
+void addEditorViewCheckpoint(long long line, off_t offset) {
+    if (line % MACHO_VIEW_CHECKPOINT != 0 || line / MACHO_VIEW_CHECKPOINT != E.viewIndexLen) {
+        return;
+    }
+
+    if (E.viewIndexLen == E.viewIndexCap) {
+        E.viewIndexCap = E.viewIndexCap ? E.viewIndexCap * 2 : 1024;
+        E.viewIndex = (off_t *)realloc(E.viewIndex, sizeof(off_t) * E.viewIndexCap);
+        if (E.viewIndex == NULL) {
+            die("realloc");
+        }
+    }
+    E.viewIndex[E.viewIndexLen++] = offset;
+}
+
+// moves from the start of *line at *offset on to the start of target, or as
+// far as the file goes. returns 0 if it ends first.
+int scanEditorView(long long *line, off_t *offset, long long target) {
+    off_t pos = *offset;
+
+    while (*line < target) {
+        ssize_t n = readEditorView(E.viewBuf, MACHO_VIEW_CHUNK, pos);
+        if (n <= 0) {
+            // the last line may have no newline.
+            E.viewLines = *line + (pos > *offset ? 1 : 0);
+            return 0;
+        }
+
+        char *p = E.viewBuf;
+        char *end = E.viewBuf + n;
+        while (*line < target && (p = (char *)memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            (*line)++;
+            *offset = pos + (p - E.viewBuf);
+            addEditorViewCheckpoint(*line, *offset);
+        }
+        pos += n;
+    }
+
+    return 1;
+}
+
+// finds where a line starts. returns 0 if the file has no such line.
+int seekEditorView(long long line, off_t *offset) {
+    long long k = line / MACHO_VIEW_CHECKPOINT;
+    if (k >= E.viewIndexLen) {
+        k = E.viewIndexLen - 1;
+    }
+
+    long long at = k * MACHO_VIEW_CHECKPOINT;
+    *offset = E.viewIndex[k];
+    return scanEditorView(&at, offset, line) && (E.viewLines < 0 || line < E.viewLines);
+}
+
+// puts lines [first, first + MACHO_VIEW_WINDOW) of the file in the rows, or
+// the last window of the file if it is shorter than that.
+void loadEditorView(long long first) {
+    off_t offset;
+
+    if (first < 0) {
+        first = 0;
+    }
+    if (!seekEditorView(first, &offset)) {
+        first = (E.viewLines > MACHO_VIEW_WINDOW) ? E.viewLines - MACHO_VIEW_WINDOW : 0;
+        if (!seekEditorView(first, &offset)) {
+            first = 0;
+            offset = 0;
+        }
+    }
+
+    char *buf = NULL;
+    long long len = 0;
+    long long cap = 0;
+    long long line = first;
+    int atEnd = 0;
+
+    while (line < first + MACHO_VIEW_WINDOW) {
+        if (cap - len < MACHO_VIEW_CHUNK) {
+            cap = cap ? cap * 2 : MACHO_VIEW_CHUNK * 2;
+            buf = (char *)realloc(buf, cap);
+            if (buf == NULL) {
+                die("realloc");
+            }
+        }
+
+        ssize_t n = readEditorView(buf + len, MACHO_VIEW_CHUNK, offset + len);
+        if (n <= 0) {
+            atEnd = 1;
+            break;
+        }
+
+        // cut the window after its last line.
+        char *p = buf + len;
+        char *end = p + n;
+        len += n;
+        while (line < first + MACHO_VIEW_WINDOW && (p = (char *)memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            line++;
+            addEditorViewCheckpoint(line, offset + (p - buf));
+        }
+        if (line == first + MACHO_VIEW_WINDOW) {
+            len = p - buf;
+        }
+    }
+
+    int rows = spliceEditorRows(0, E.numRows, buf, len);
+    free(buf);
+
+    E.viewBase = first;
+    E.viewAtEnd = atEnd;
+    if (atEnd) {
+        E.viewLines = first + rows;
+    }
+}
+
+// reloads the window around the cursor when it gets near an edge of it and
+// there is more of the file beyond.
+void slideEditorView() {
+    int margin = MACHO_VIEW_WINDOW / 4;
+
+    if (!(E.cy < margin && E.viewBase > 0) && !(E.cy >= E.numRows - margin && !E.viewAtEnd)) {
+        return;
+    }
+
+    long long line = E.viewBase + E.cy;
+    long long top = E.viewBase + E.rowOffset;
+
+    loadEditorView(line - MACHO_VIEW_WINDOW / 2);
+
+    E.cy = line - E.viewBase;
+    if (E.cy > E.numRows) {
+        E.cy = E.numRows;
+    }
+    E.rowOffset = (top > E.viewBase) ? top - E.viewBase : 0;
+}
+
+// makes sure the line is in the window.
+void showEditorViewLine(long long line) {
+    if (line < E.viewBase || line >= E.viewBase + E.numRows) {
+        loadEditorView(line - MACHO_VIEW_WINDOW / 2);
+    }
+}
+
+// the line holding the byte at offset, and where that line starts. the
+// index is extended up to it if needed.
+long long editorViewLineAt(off_t offset, off_t *lineStart) {
+    int lo = 0;
+    int hi = E.viewIndexLen - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (E.viewIndex[mid] <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    long long line = (long long)lo * MACHO_VIEW_CHECKPOINT;
+    off_t pos = E.viewIndex[lo];
+    *lineStart = pos;
+    while (pos <= offset) {
+        ssize_t n = readEditorView(E.viewBuf, MACHO_VIEW_CHUNK, pos);
+        if (n <= 0) {
+            break;
+        }
+
+        char *p = E.viewBuf;
+        char *end = E.viewBuf + ((offset - pos < n) ? offset - pos : n);
+        while ((p = (char *)memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            line++;
+            *lineStart = pos + (p - E.viewBuf);
+            addEditorViewCheckpoint(line, *lineStart);
+        }
+        pos += n;
+    }
+
+    return line;
+}
+
+// looks for the query in lines [start, end) of the file, reading it as it
+// goes. the first match is returned, or the last one if last is set. the
+// query has no newline, so the bytes can be searched without minding where
+// lines are, and only the line of a match is worked out from the index. a
+// key pressed meanwhile stops the search, as it starts a new one.
+int findEditorViewRange(char *query, long long start, long long end, int last, long long *matchLine, int *matchCol) {
+    int queryLen = strlen(query);
+    off_t from;
+    off_t to;
+    off_t found = -1;
+
+    if (!seekEditorView(start, &from)) {
+        return 0;
+    }
+    if (end == LLONG_MAX || !seekEditorView(end, &to)) {
+        to = editorViewSize();
+    }
+
+    // chunks overlap by a query length so no match is cut in two.
+    while (from + queryLen <= to) {
+        if (isEditorKeyPending()) {
+            E.viewSearchCut = 1;
+            return 0;
+        }
+
+        ssize_t n = readEditorView(E.viewBuf, MACHO_VIEW_CHUNK, from);
+        if (n <= 0) {
+            break;
+        }
+        if (n > to - from) {
+            n = to - from;
+        }
+
+        char *match = (char *)memmem(E.viewBuf, n, query, queryLen);
+        while (match) {
+            found = from + (match - E.viewBuf);
+            if (!last) {
+                break;
+            }
+            match = (char *)memmem(match + 1, E.viewBuf + n - match - 1, query, queryLen);
+        }
+        if ((found != -1 && !last) || n < queryLen || from + n >= to) {
+            break;
+        }
+        from += n - queryLen + 1;
+    }
+
+    if (found == -1) {
+        return 0;
+    }
+
+    off_t lineStart;
+    *matchLine = editorViewLineAt(found, &lineStart);
+    *matchCol = found - lineStart;
+    return 1;
+}
+
+// the last match in lines [start, end), going back a checkpoint at a time.
+int findEditorViewBackward(char *query, long long start, long long end, long long *line, int *col) {
+    while (end > start && !E.viewSearchCut) {
+        long long from = ((end - 1) / MACHO_VIEW_CHECKPOINT) * MACHO_VIEW_CHECKPOINT;
+        if (from < start) {
+            from = start;
+        }
+        if (findEditorViewRange(query, from, end, 1, line, col)) {
+            return 1;
+        }
+        end = from;
+    }
+    return 0;
+}
+
+// the next match after line `from` in the direction given, wrapping around
+// the ends of the file. a forward search from -1 starts at the top.
+int findEditorViewMatch(char *query, long long from, int direction, long long *line, int *col) {
+    E.viewSearchCut = 0;
+    if (direction == 1) {
+        return findEditorViewRange(query, from + 1, LLONG_MAX, 0, line, col) ||
+            (from >= 0 && !E.viewSearchCut && findEditorViewRange(query, 0, from + 1, 0, line, col));
+    }
+
+    if (findEditorViewBackward(query, 0, from, line, col) || E.viewSearchCut) {
+        return !E.viewSearchCut;
+    }
+
+    // going on from the end needs to know where it is.
+    off_t offset;
+    seekEditorView(LLONG_MAX, &offset);
+    return findEditorViewBackward(query, from, E.viewLines, line, col);
+}
+
+void openEditorView(char *fileName) {
+    E.fileName = strdup(fileName);
+    E.viewFd = open(fileName, O_RDONLY);
+    E.viewBuf = (char *)malloc(MACHO_VIEW_CHUNK);
+    if (E.fileName == NULL || E.viewFd == -1 || E.viewBuf == NULL) {
+        die("file open error");
+    }
+
+    // a compressed file can only be read from the middle through the seek
+    // table of a seekable .zst, anything else is read whole.
+    int kind = editorCompressionOf(E.viewFd);
+    if (kind != COMPRESS_NONE && !(kind == COMPRESS_ZSTD && readEditorSeekTable(E.viewFd))) {
+        close(E.viewFd);
+        E.viewFd = -1;
+        free(E.viewBuf);
+        E.viewBuf = NULL;
+        openEditor(fileName);
+        setEditorStatusMessage("Compressed without a seek table, read whole");
+        return;
+    }
+
+    E.view = 1;
+    E.viewLines = -1;
+    addEditorViewCheckpoint(0, 0);
+    editorSelectSyntaxHighlight();
+    loadEditorView(0);
+}
+
+/*** journal ***/
+
+// every edit since the last save is appended to .<name>.macho-journal next to
+// the file, and replayed when the file is opened again after a crash. records
+// are written out when the editor goes idle and synced at most every
+// MACHO_JOURNAL_SYNC_MS, so an edit itself only costs a memcpy.
+
+#define JOURNAL_MAGIC "MJNL"
+#define JOURNAL_VERSION 2
+#define JOURNAL_RECORD_HEADER 13    // op, row, at, length.
+
+struct journalHeader {
+    char magic[4];
+    int version;
+    long long baseSize;     // size and mtime of the file the edits apply to.
+    int64_t baseMtimeSec;
+    int64_t baseMtimeNsec;
+};
+
+int countEditorLines(const char *data, int len) {
+    int lines = 0;
+    const char *p = data;
+    const char *end = data + len;
+
+    while ((p = (const char *)memchr(p, '\n', end - p)) != NULL) {
+        lines++;
+        p++;
+    }
+    return lines;
+}
+
+// performs an edit described the way the journal records it.
+int applyEditorEdit(int op, int row, int at, char *data, int len) {
+    if (op != EDIT_INSERT_ROW && op != EDIT_INSERT_ROWS && (row < 0 || row >= E.numRows)) {
+        return -1;
+    }
+
+    switch (op) {
+        case EDIT_INSERT_ROW:
+            if (row < 0 || row > E.numRows) {
+                return -1;
+            }
+            insertEditorRow(row, data, len);
+            return 0;
+        case EDIT_DELETE_ROW:
+            delEditorRow(row);
+            return 0;
+        case EDIT_INSERT_CHAR:
+            if (len != 1) {
+                return -1;
+            }
+            insertEditorRowCharacter(getEditorRow(row), at, data[0]);
+            return 0;
+        case EDIT_DELETE_CHAR:
+            delEditorRowChar(getEditorRow(row), at);
+            return 0;
+        case EDIT_APPEND_STRING:
+            appendEditorRowString(getEditorRow(row), data, len);
+            return 0;
+        case EDIT_TRUNCATE_ROW:
+            truncateEditorRow(getEditorRow(row), at);
+            return 0;
+        case EDIT_SET_ROW:
+            {
+                char *chars = (char *)malloc(len + 1);
+                memcpy(chars, data, len);
+                chars[len] = '\0';
+                setEditorRowChars(getEditorRow(row), chars, len);
+            }
+            return 0;
+        case EDIT_PERMUTE_ROWS:
+            if (at < 0 || at > E.numRows - row || len != at * (int)sizeof(int32_t) || !isEditorPermutation((int32_t *)data, at)) {
+                return -1;
+            }
+            permuteEditorRows(row, at, (int32_t *)data);
+            return 0;
+        case EDIT_DELETE_ROWS:
+            if (at < 1 || at > E.numRows - row) {
+                return -1;
+            }
+            delEditorRows(row, at);
+            return 0;
+        case EDIT_INSERT_ROWS:
+            // only replayed from the journal, undo puts back the clip it kept.
+            if (row < 0 || row > E.numRows || len < 1 || data[len - 1] != '\n' || countEditorLines(data, len) != at) {
+                return -1;
+            }
+            spliceEditorRows(row, 0, data, len);
+            return 0;
+    }
+    return -1;
+}
+
+long long editorNowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+char *editorJournalPath(char *fileName) {
+    char *slash = strrchr(fileName, '/');
+    int dirLen = slash ? slash - fileName + 1 : 0;
+    char *base = slash ? slash + 1 : fileName;
+    size_t size = strlen(fileName) + 32;
+    char *path = (char *)malloc(size);
+
+    snprintf(path, size, "%.*s.%s.macho-journal", dirLen, fileName, base);
+    return path;
+}
+
+int openEditorJournal() {
+    char *path = editorJournalPath(E.fileName);
+    E.journalFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    free(path);
+
+    if (E.journalFd == -1) {
+        return -1;
+    }
+
+    struct journalHeader header;
+    struct stat st;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, 4);
+    header.version = JOURNAL_VERSION;
+    header.baseSize = -1;
+    if (stat(E.fileName, &st) == 0) {
+        header.baseSize = st.st_size;
+        header.baseMtimeSec = st.st_mtim.tv_sec;
+        header.baseMtimeNsec = st.st_mtim.tv_nsec;
+    }
+
+    if (write(E.journalFd, &header, sizeof(header)) != sizeof(header)) {
+        close(E.journalFd);
+        E.journalFd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// called by the row operations before they change anything.
+void recordEditorEdit(int op, int row, int at, const char *data, int len) {
+    if (!E.undoSuspended) {
+        pushEditorUndo(op, row, at, data, len);
+    }
+    journalEditorEdit(op, row, at, data, len);
+}
+
+void journalEditorEdit(int op, int row, int at, const char *data, int len) {
+    if (E.journalSuspended || E.fileName == NULL) {
+        return;
+    }
+    if (E.journalFd == -1 && openEditorJournal() == -1) {
+        return;
+    }
+
+    if (E.journalLen + JOURNAL_RECORD_HEADER + len > E.journalCap) {
+        E.journalCap = (E.journalLen + JOURNAL_RECORD_HEADER + len) * 2;
+        E.journalBuf = (char *)realloc(E.journalBuf, E.journalCap);
+    }
+
+    char *p = &E.journalBuf[E.journalLen];
+    int32_t fields[3] = { row, at, len };
+    p[0] = op;
+    memcpy(&p[1], fields, sizeof(fields));
+    if (len) {
+        memcpy(&p[JOURNAL_RECORD_HEADER], data, len);
+    }
+    E.journalLen += JOURNAL_RECORD_HEADER + len;
+
+    if (E.journalLen >= MACHO_JOURNAL_FLUSH) {
+        flushEditorJournal();
+    }
+}
+
+// hands buffered records to the kernel. they survive the editor dying from
+// here on, and a power loss once synced.
+void flushEditorJournal() {
+    if (E.journalFd == -1 || E.journalLen == 0) {
+        return;
+    }
+
+    int written = 0;
+    while (written < E.journalLen) {
+        ssize_t n = write(E.journalFd, &E.journalBuf[written], E.journalLen - written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += n;
+    }
+    E.journalLen = 0;
+
+    if (E.journalSyncAt == 0) {
+        E.journalSyncAt = editorNowMs() + MACHO_JOURNAL_SYNC_MS;
+    }
+}
+
+void syncEditorJournal() {
+    flushEditorJournal();
+    if (E.journalFd != -1 && E.journalSyncAt) {
+        fdatasync(E.journalFd);
+    }
+    E.journalSyncAt = 0;
+}
+
+// the file on disk has every edit now, or they were thrown away.
+void removeEditorJournal() {
+    if (E.journalFd != -1) {
+        close(E.journalFd);
+        E.journalFd = -1;
+    }
+    E.journalLen = 0;
+    E.journalSyncAt = 0;
+
+    // a script leaves the journal of someone editing the file alone.
+    if (E.fileName && !E.headless) {
+        char *path = editorJournalPath(E.fileName);
+        unlink(path);
+        free(path);
+    }
+}
+
+// replays the journal left behind by an editor that didn't get to save, if
+// it is newer than the file and was started from the file as it is now.
+void recoverEditorJournal() {
+    char *path = editorJournalPath(E.fileName);
+    struct stat fst, jst;
+    struct journalHeader header;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        free(path);
+        return;
+    }
+
+    if (fstat(fd, &jst) == -1 || stat(E.fileName, &fst) == -1 ||
+        read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, JOURNAL_MAGIC, 4) || header.version != JOURNAL_VERSION ||
+        jst.st_mtime < fst.st_mtime || header.baseSize != fst.st_size ||
+        header.baseMtimeSec != (int64_t)fst.st_mtim.tv_sec || header.baseMtimeNsec != (int64_t)fst.st_mtim.tv_nsec) {
+        setEditorStatusMessage("Ignoring stale journal %s", path);
+        close(fd);
+        free(path);
+        return;
+    }
+
+    size_t size = jst.st_size - sizeof(header);
+    char *buf = (char *)malloc(size ? size : 1);
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, &buf[got], size - got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+
+    // a record cut short by the crash ends the replay.
+    int applied = 0;
+    size_t pos = 0;
+    E.journalSuspended = 1;
+    E.undoSuspended = 1;
+    while (pos + JOURNAL_RECORD_HEADER <= got) {
+        int op = (unsigned char)buf[pos];
+        int32_t fields[3];
+        memcpy(fields, &buf[pos + 1], sizeof(fields));
+
+        int row = fields[0];
+        int at = fields[1];
+        int len = fields[2];
+        char *data = &buf[pos + JOURNAL_RECORD_HEADER];
+
+        if (len < 0 || pos + JOURNAL_RECORD_HEADER + len > got) {
+            break;
+        }
+        pos += JOURNAL_RECORD_HEADER + len;
+
+        if (applyEditorEdit(op, row, at, data, len) == 0) {
+            applied++;
+        }
+    }
+    E.journalSuspended = 0;
+    E.undoSuspended = 0;
+    free(buf);
+
+    // keep appending to the journal, past whatever was cut short.
+    E.journalFd = open(path, O_WRONLY);
+    if (E.journalFd != -1) {
+        if (ftruncate(E.journalFd, sizeof(header) + pos) == -1 || lseek(E.journalFd, 0, SEEK_END) == -1) {
+            close(E.journalFd);
+            E.journalFd = -1;
+        }
+    }
+
+    E.dirty = applied;
+    if (applied) {
+        setEditorStatusMessage("Recovered %d changes from %s", applied, path);
+    }
+    free(path);
+}
+
+/*** undo ***/
+
+// every edit pushes its inverse. the edits made by one keypress share a
+// group, and typing a run of characters keeps extending the same group.
+
+char *copyEditorBytes(const char *s, int len) {
+    char *copy = (char *)malloc(len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void freeUndoRecord(struct undoRecord *u) {
+    free(u->data);
+    releaseEditorClip(u->clip);
+}
+
+void pushEditorUndo(int op, int row, int at, const char *data, int len) {
+    struct undoRecord u;
+    int rows = (op == EDIT_INSERT_ROW || op == EDIT_INSERT_ROWS || op == EDIT_DELETE_ROWS);
+    editorRow *r;
+
+    if (E.undoGroup == E.undoLost) {
+        return;
+    }
+    r = (!rows && row < E.numRows) ? getEditorRow(row) : NULL;
+
+    u.group = E.undoGroup;
+    u.row = row;
+    u.at = at;
+    u.len = 0;
+    u.data = NULL;
+    u.clip = NULL;
+
+    switch (op) {
+        case EDIT_INSERT_ROW:
+            u.op = EDIT_DELETE_ROW;
+            break;
+        case EDIT_DELETE_ROW:
+            u.op = EDIT_INSERT_ROW;
+            u.len = r->size;
+            u.data = copyEditorBytes(r->chars, r->size);
+            break;
+        case EDIT_INSERT_CHAR:
+            u.op = EDIT_DELETE_CHAR;
+            break;
+        case EDIT_DELETE_CHAR:
+            u.op = EDIT_INSERT_CHAR;
+            u.len = 1;
+            u.data = copyEditorBytes(&r->chars[at], 1);
+            break;
+        case EDIT_APPEND_STRING:
+            u.op = EDIT_TRUNCATE_ROW;
+            u.at = r->size;
+            break;
+        case EDIT_TRUNCATE_ROW:
+            u.op = EDIT_APPEND_STRING;
+            u.len = r->size - at;
+            u.data = copyEditorBytes(&r->chars[at], u.len);
+            break;
+        case EDIT_SET_ROW:
+            u.op = EDIT_SET_ROW;
+            u.len = r->size;
+            u.data = copyEditorBytes(r->chars, r->size);
+            break;
+        case EDIT_PERMUTE_ROWS:
+            {
+                const int32_t *perm = (const int32_t *)data;
+                int32_t *inverse = (int32_t *)malloc(len ? len : 1);
+                int j;
+                for (j = 0; j < at; j++) {
+                    inverse[perm[j]] = j;
+                }
+                u.op = EDIT_PERMUTE_ROWS;
+                u.len = len;
+                u.data = (char *)inverse;
+            }
+            break;
+        case EDIT_INSERT_ROWS:
+            u.op = EDIT_DELETE_ROWS;
+            break;
+        case EDIT_DELETE_ROWS:
+            u.op = EDIT_INSERT_ROWS;
+            u.clip = makeEditorClip(row, at);
+            break;
+        default:
+            return;
+    }
+
+    // past the limit about the oldest half goes, in whole groups. the group
+    // being made is never cut: if it fills the limit alone, it can't be
+    // undone, and all the history goes along with it.
+    if (E.undoLen >= MACHO_UNDO_LIMIT) {
+        int drop = E.undoLen / 2;
+        int j;
+        while (drop < E.undoLen && E.undo[drop].group == E.undo[drop - 1].group) {
+            drop++;
+        }
+        while (drop > 0 && E.undo[drop - 1].group == u.group) {
+            drop--;
+        }
+        if (drop == 0) {
+            freeUndoRecord(&u);
+            clearEditorUndo();
+            E.undoLost = u.group;
+            setEditorStatusMessage("Change too large to undo, undo history cleared");
+            return;
+        }
+        for (j = 0; j < drop; j++) {
+            freeUndoRecord(&E.undo[j]);
+        }
+        memmove(E.undo, &E.undo[drop], sizeof(struct undoRecord) * (E.undoLen - drop));
+        E.undoLen -= drop;
+    }
+
+    if (E.undoLen == E.undoCap) {
+        E.undoCap = E.undoCap ? E.undoCap * 2 : 256;
+        E.undo = (struct undoRecord *)realloc(E.undo, sizeof(struct undoRecord) * E.undoCap);
+    }
+    E.undo[E.undoLen++] = u;
+}
+
+// starts the undo group for a keypress, unless it just types on where the
+// previous keypress typed.
+void beginEditorUndoGroup(int typing) {
+    if (typing && E.undoTyping && E.undoTypingRow == E.cy && E.undoTypingCol == E.cx) {
+        return;
+    }
+    E.undoGroup++;
+}
+
+// the rows the records point at changed under them.
+void clearEditorUndo() {
+    int j;
+    for (j = 0; j < E.undoLen; j++) {
+        freeUndoRecord(&E.undo[j]);
+    }
+    E.undoLen = 0;
+    E.undoTyping = 0;
+}
+
+void editorUndo() {
+    if (isEditorReadOnly()) {
+        return;
+    }
+
+    if (E.undoLen == 0 && E.undoLost != -1 && E.undoLost == E.undoGroup - 1) {
+        setEditorStatusMessage("Nothing to undo, the last change was too large");
+        return;
+    }
+    if (E.undoLen == 0) {
+        setEditorStatusMessage("Nothing to undo");
+        return;
+    }
+
+    int group = E.undo[E.undoLen - 1].group;
+    int count = 0;
+    int cy = -1;
+    int cx = 0;
+
+    // the cursor goes to the earliest position touched.
+    E.undoSuspended = 1;
+    while (E.undoLen > 0 && E.undo[E.undoLen - 1].group == group) {
+        struct undoRecord *u = &E.undo[--E.undoLen];
+        int x = (u->op == EDIT_INSERT_ROW || u->op == EDIT_DELETE_ROW || u->op == EDIT_SET_ROW || u->op == EDIT_PERMUTE_ROWS ||
+            u->op == EDIT_INSERT_ROWS || u->op == EDIT_DELETE_ROWS) ? 0 : u->at;
+        int done = u->clip ? pasteEditorClip(u->row, u->clip) : applyEditorEdit(u->op, u->row, u->at, u->data, u->len);
+
+        if (done == 0 && (cy == -1 || u->row < cy || (u->row == cy && x < cx))) {
+            cy = u->row;
+            cx = x;
+        }
+        freeUndoRecord(u);
+        count++;
+    }
+    E.undoSuspended = 0;
+    clearEditorCursors();
+    E.markRow = -1;
+
+    if (cy != -1) {
+        E.cy = cy;
+        E.cx = cx;
+    }
+
+    if (E.cy > E.numRows) {
+        E.cy = E.numRows;
+    }
+    if (E.cy < E.numRows && E.cx > E.row[E.cy].size) {
+        E.cx = E.row[E.cy].size;
+    }
+    E.undoTyping = 0;
+    setEditorStatusMessage("Undid %d change%s", count, count == 1 ? "" : "s");
+}
+
+/*** find ***/
+
+// whether the query shows up in the render of a row, without bringing the
+// row back in.
+int editorRowMayContain(editorRow *row, char *query) {
+    return memmem(peekEditorRowRender(row), row->rsize, query, strlen(query)) != NULL;
+}
+
+// every match on screen is drawn over the colors of the row, which are left
+// as they are. the matches of a row are looked for once per version of the
+// row, so scrolling over rows seen before doesn't search them again.
+void setEditorMatchQuery(char *query) {
+    int j;
+
+    if (E.matchQuery && query && strcmp(E.matchQuery, query) == 0) {
+        return;
+    }
+
+    free(E.matchQuery);
+    E.matchQuery = (query && *query) ? strdup(query) : NULL;
+    E.matchQueryLen = E.matchQuery ? strlen(E.matchQuery) : 0;
+
+    if (E.matchCache == NULL) {
+        E.matchCache = (struct matchCacheEntry *)calloc(MACHO_MATCH_CACHE, sizeof(struct matchCacheEntry));
+    }
+    for (j = 0; j < MACHO_MATCH_CACHE; j++) {
+        E.matchCache[j].serial = 0;
+    }
+}
+
+// the render offsets of the matches in the row, in order.
+struct matchCacheEntry *getEditorRowMatches(editorRow *row) {
+    struct matchCacheEntry *e = &E.matchCache[row->hlSerial % MACHO_MATCH_CACHE];
+    if (e->serial == row->hlSerial) {
+        return e;
+    }
+
+    char *end = row->render + row->rsize;
+    char *match;
+
+    e->serial = row->hlSerial;
+    e->count = 0;
+    for (match = (char *)memmem(row->render, row->rsize, E.matchQuery, E.matchQueryLen); match;
+        match = (char *)memmem(match + E.matchQueryLen, end - match - E.matchQueryLen, E.matchQuery, E.matchQueryLen)) {
+        if (e->count == e->cap) {
+            e->cap = e->cap ? e->cap * 2 : 8;
+            e->at = (int *)realloc(e->at, sizeof(int) * e->cap);
+        }
+        e->at[e->count++] = match - row->render;
+    }
+    return e;
+}
+
+void editorFindCallback(char *query, int key) {
+    static long long lastMatch = -1;    // line of the file, not row, in view mode.
+    static int direction = 1;
+
+    // a search in view mode cut short by enter is finished first.
+    int finishing = (key == '\r' && E.view && E.viewSearchCut);
+
+    if ((key == '\x1b' || key == '\r') && !finishing) {
+        lastMatch = -1;
+        direction = 1;
+        E.viewSearchCut = 0;
+        setEditorMatchQuery(NULL);
+        return;
+    } else if (finishing) {
+        direction = 1;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        direction = 1;
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        direction = -1;
+    } else {
+        lastMatch = -1;
+        direction = 1;
+    }
+
+    if (lastMatch == -1) {
+        direction = 1;
+    }
+    setEditorMatchQuery(finishing ? NULL : query);
+
+    // in view mode the file is read through instead of the rows.
+    if (E.view) {
+        long long line;
+        int col;
+
+        if (findEditorViewMatch(query, lastMatch, direction, &line, &col)) {
+            showEditorViewLine(line);
+
+            lastMatch = line;
+            E.cy = line - E.viewBase;
+            E.cx = col;
+            E.rowOffset = E.numRows;
+        }
+        if (finishing) {
+            lastMatch = -1;
+            E.viewSearchCut = 0;
+        }
+        return;
+    }
+
+    int current = lastMatch;
+    int i;
+    for (i = 0; i < E.numRows; i++) {
+        current += direction;
+        if (current == -1) {
+            current = E.numRows - 1;
+        } else if (current == E.numRows) {
+            current = 0;
+        }
+
+        // cold rows are only brought back in when they may hold a match.
+        if (E.row[current].cold && !editorRowMayContain(&E.row[current], query)) {
+            continue;
+        }
+
+        editorRow *row = getEditorRow(current);
+        char *match = strstr(row->render, query);
+
+        if (match) {
+            lastMatch = current;
+            E.cy = current;
+            E.cx = editorRowRxToCx(row, match - row->render);
+            E.rowOffset = E.numRows;
+            break;
+        }
+    }
+}
+
+void editorFind() {
+    int prevCx = E.cx;
+    int prevCy = E.cy;
+    int prevColOffset = E.colOffset;
+    int prevRowOffset = E.rowOffset;
+    long long prevViewBase = E.viewBase;
+
+    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+
+    if (query) {
+        free(query);
+    } else {
+        if (E.view && E.viewBase != prevViewBase) {
+            loadEditorView(prevViewBase);
+        }
+        E.cx = prevCx;
+        E.cy = prevCy;
+        E.colOffset = prevColOffset;
+        E.rowOffset = prevRowOffset;
+    }
+}
+
+/*** replace ***/
+
+// rewrites every occurrence of query in the row in a single pass, so the row
+// is re-rendered once however many there are. returns the number replaced.
+int replaceEditorRow(editorRow *row, char *query, int queryLen, char *with, int withLen) {
+    if (memmem(peekEditorRow(row), row->size, query, queryLen) == NULL) {
+        return 0;
+    }
+    if (row->cold) {
+        thawEditorRow(row);
+    }
+
+    char *end = row->chars + row->size;
+    char *first = (char *)memmem(row->chars, row->size, query, queryLen);
+    char *match;
+
+    int count = 0;
+    for (match = first; match; match = (char *)memmem(match + queryLen, end - match - queryLen, query, queryLen)) {
+        count++;
+    }
+
+    int size = row->size + count * (withLen - queryLen);
+    char *chars = (char *)malloc(size + 1);
+    char *out = chars;
+    char *from = row->chars;
+
+    for (match = first; match; match = (char *)memmem(match + queryLen, end - match - queryLen, query, queryLen)) {
+        memcpy(out, from, match - from);
+        out += match - from;
+        memcpy(out, with, withLen);
+        out += withLen;
+        from = match + queryLen;
+    }
+    memcpy(out, from, end - from);
+    chars[size] = '\0';
+
+    setEditorRowChars(row, chars, size);
+    return count;
+}
+
+// replaces every occurrence in the file. the rows changed are undone
+// together as they are all recorded in the group of the current keypress.
+void editorReplaceAll(char *query, char *with) {
+    int queryLen = strlen(query);
+    int withLen = strlen(with);
+    int count = 0;
+    int rows = 0;
+    int j;
+
+    clearEditorCursors();
+    for (j = 0; j < E.numRows; j++) {
+        int n = replaceEditorRow(&E.row[j], query, queryLen, with, withLen);
+        if (n) {
+            count += n;
+            rows++;
+        }
+    }
+
+    if (E.cy < E.numRows && E.cx > E.row[E.cy].size) {
+        E.cx = E.row[E.cy].size;
+    }
+    setEditorStatusMessage("Replaced %d occurrence%s on %d line%s", count, count == 1 ? "" : "s", rows, rows == 1 ? "" : "s");
+}
+
+void editorReplace() {
+    if (isEditorReadOnly()) {
+        return;
+    }
+
+    char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL);
+    if (query == NULL) {
+        return;
+    }
+
+    char *with = editorPromptInput("Replace with: %s (ESC to cancel)", NULL, 1);
+    if (with) {
+        editorReplaceAll(query, with);
+        free(with);
+    }
+    free(query);
+}
+
+/*** line operations ***/
+
+// sort, uniq, reverse, keep and drop work on an array of row pointers and
+// end in a single permutation of E.row, so no text is copied. sorting and
+// matching are split over threads; they only see the pointers, E being
+// per thread.
+
+// a line to sort, with its first bytes at hand so that most comparisons
+// don't have to go to the row.
+struct lineKey {
+    uint64_t head[2];
+    const char *chars;
+    int size;
+    editorRow *row;
+};
+
+struct lineJob {
+    editorRow **line;
+    struct lineKey *key;
+    struct lineKey *scratch;
+    unsigned char *keep;    // set for the lines a filter keeps.
+    const char *pattern;
+    int patternLen;
+    int wanted;             // whether lines with the pattern are kept.
+    int start;
+    int mid;                // end of the first run when merging.
+    int end;
+};
+
+int compareEditorLines(const void *a, const void *b) {
+    const struct lineKey *p = (const struct lineKey *)a;
+    const struct lineKey *q = (const struct lineKey *)b;
+
+    if (p->head[0] != q->head[0]) {
+        return (p->head[0] < q->head[0]) ? -1 : 1;
+    }
+    if (p->head[1] != q->head[1]) {
+        return (p->head[1] < q->head[1]) ? -1 : 1;
+    }
+
+    int n = (p->size < q->size) ? p->size : q->size;
+    int c = (n > 16) ? memcmp(p->chars + 16, q->chars + 16, n - 16) : 0;
+
+    if (c) {
+        return c;
+    }
+    if (p->size != q->size) {
+        return (p->size < q->size) ? -1 : 1;
+    }
+    // equal lines keep their order.
+    return (p->row > q->row) - (p->row < q->row);
+}
+
+// the first 16 bytes of the line as two big endian numbers, padded with
+// zeros, so that they compare the way memcmp would.
+void makeLineKey(struct lineKey *key, editorRow *row) {
+    int j;
+
+    key->head[0] = 0;
+    key->head[1] = 0;
+    for (j = 0; j < 16; j++) {
+        uint64_t c = (j < row->size) ? (unsigned char)row->chars[j] : 0;
+        key->head[j / 8] |= c << (56 - (j % 8) * 8);
+    }
+    key->chars = row->chars;
+    key->size = row->size;
+    key->row = row;
+}
+
+// merges the sorted runs [0, mid) and [mid, end) of key into out.
+void mergeLineKeys(const struct lineKey *key, int mid, int end, struct lineKey *out) {
+    int i = 0;
+    int j = mid;
+    int k = 0;
+
+    while (i < mid && j < end) {
+        out[k++] = (compareEditorLines(&key[j], &key[i]) < 0) ? key[j++] : key[i++];
+    }
+    memcpy(&out[k], &key[i], sizeof(struct lineKey) * (mid - i));
+    k += mid - i;
+    memcpy(&out[k], &key[j], sizeof(struct lineKey) * (end - j));
+}
+
+// a merge sort, which beats qsort here as it compares keys without a call
+// through a pointer. scratch is as long as key.
+void sortLineKeys(struct lineKey *key, struct lineKey *scratch, int n) {
+    int j;
+
+    if (n <= 16) {
+        for (j = 1; j < n; j++) {
+            struct lineKey k = key[j];
+            int i = j;
+            while (i > 0 && compareEditorLines(&key[i - 1], &k) > 0) {
+                key[i] = key[i - 1];
+                i--;
+            }
+            key[i] = k;
+        }
+        return;
+    }
+
+    int half = n / 2;
+    sortLineKeys(key, scratch, half);
+    sortLineKeys(key + half, scratch + half, n - half);
+    if (compareEditorLines(&key[half - 1], &key[half]) <= 0) {
+        return;
+    }
+    mergeLineKeys(key, half, n, scratch);
+    memcpy(key, scratch, sizeof(struct lineKey) * n);
+}
+
+void *sortLineJob(void *arg) {
+    struct lineJob *job = (struct lineJob *)arg;
+    int j;
+
+    for (j = job->start; j < job->end; j++) {
+        makeLineKey(&job->key[j], job->line[j]);
+    }
+    sortLineKeys(&job->key[job->start], &job->scratch[job->start], job->end - job->start);
+    return NULL;
+}
+
+void *mergeLineJob(void *arg) {
+    struct lineJob *job = (struct lineJob *)arg;
+    mergeLineKeys(&job->key[job->start], job->mid - job->start, job->end - job->start, &job->scratch[job->start]);
+    return NULL;
+}
+
+void *matchLineJob(void *arg) {
+    struct lineJob *job = (struct lineJob *)arg;
+    int j;
+
+    for (j = job->start; j < job->end; j++) {
+        editorRow *row = job->line[j];
+        int found = (memmem(row->chars, row->size, job->pattern, job->patternLen) != NULL);
+        job->keep[j] = (found == job->wanted);
+    }
+    return NULL;
+}
+
+void *uniqLineJob(void *arg) {
+    struct lineJob *job = (struct lineJob *)arg;
+    int j;
+
+    for (j = job->start; j < job->end; j++) {
+        editorRow *row = job->line[j];
+        editorRow *prev = (j > 0) ? job->line[j - 1] : NULL;
+        job->keep[j] = !(prev && prev->size == row->size && memcmp(prev->chars, row->chars, row->size) == 0);
+    }
+    return NULL;
+}
+
+// the number of threads worth using on count lines.
+int editorLineParts(int count) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int parts = count / MACHO_LINES_PART;
+
+    if (parts > cpus) {
+        parts = cpus;
+    }
+    return (parts < 1) ? 1 : parts;
+}
+
+// runs the jobs, the first on this thread and the rest on threads of their
+// own, or here too if one can't be started.
+void runLineJobs(struct lineJob *jobs, int n, void *(*fn)(void *)) {
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * n);
+    char *started = (char *)calloc(n, 1);
+    int j;
+
+    for (j = 1; j < n; j++) {
+        started[j] = (pthread_create(&threads[j], NULL, fn, &jobs[j]) == 0);
+    }
+    fn(&jobs[0]);
+    for (j = 1; j < n; j++) {
+        if (started[j]) {
+            pthread_join(threads[j], NULL);
+        } else {
+            fn(&jobs[j]);
+        }
+    }
+    free(started);
+    free(threads);
+}
+
+// splits [0, count) evenly over the jobs.
+void splitLineJobs(struct lineJob *jobs, int n, int count, struct lineJob *proto) {
+    int j;
+    for (j = 0; j < n; j++) {
+        jobs[j] = *proto;
+        jobs[j].start = (long long)count * j / n;
+        jobs[j].end = (long long)count * (j + 1) / n;
+    }
+}
+
+// pointers to rows [at, at + count). the first resident of them are
+// brought in, so that the threads never meet a cold row.
+editorRow **gatherEditorLines(int at, int count, int resident) {
+    editorRow **line = (editorRow **)malloc(sizeof(editorRow *) * (count ? count : 1));
+    int j;
+    for (j = 0; j < count; j++) {
+        line[j] = (j < resident) ? getEditorRow(at + j) : &E.row[at + j];
+    }
+    return line;
+}
+
+// puts the lines in the order given by the pointers.
+void orderEditorLines(int at, int count, editorRow **line) {
+    int32_t *perm = (int32_t *)malloc(sizeof(int32_t) * (count ? count : 1));
+    int j;
+    for (j = 0; j < count; j++) {
+        perm[j] = line[j] - &E.row[at];
+    }
+    permuteEditorRows(at, count, perm);
+    free(perm);
+}
+
+void sortEditorLines(int at, int count) {
+    editorRow **line = gatherEditorLines(at, count, count);
+    struct lineKey *key = (struct lineKey *)malloc(sizeof(struct lineKey) * (count ? count : 1));
+    struct lineKey *scratch = (struct lineKey *)malloc(sizeof(struct lineKey) * (count ? count : 1));
+    int n = editorLineParts(count);
+    struct lineJob *jobs = (struct lineJob *)malloc(sizeof(struct lineJob) * n);
+    struct lineJob proto;
+    int j;
+
+    // each thread sorts a part, then neighbouring runs are merged in pairs.
+    memset(&proto, 0, sizeof(proto));
+    proto.line = line;
+    proto.key = key;
+    proto.scratch = scratch;
+    splitLineJobs(jobs, n, count, &proto);
+    runLineJobs(jobs, n, sortLineJob);
+
+    while (n > 1) {
+        int pairs = 0;
+
+        for (j = 0; j + 1 < n; j += 2) {
+            struct lineJob *merge = &jobs[pairs++];
+            int end = jobs[j + 1].end;
+            merge->start = jobs[j].start;
+            merge->mid = jobs[j].end;
+            merge->end = end;
+            merge->key = key;
+            merge->scratch = scratch;
+        }
+        runLineJobs(jobs, pairs, mergeLineJob);
+
+        // an odd run out is carried over as it is.
+        if (n % 2) {
+            struct lineJob *last = &jobs[pairs++];
+            *last = jobs[n - 1];
+            memcpy(&scratch[last->start], &key[last->start], sizeof(struct lineKey) * (last->end - last->start));
+        }
+
+        struct lineKey *swap = key;
+        key = scratch;
+        scratch = swap;
+        n = pairs;
+    }
+
+    for (j = 0; j < count; j++) {
+        line[j] = key[j].row;
+    }
+    orderEditorLines(at, count, line);
+    free(jobs);
+    free(scratch);
+    free(key);
+    free(line);
+}
+
+void reverseEditorLines(int at, int count) {
+    int32_t *perm = (int32_t *)malloc(sizeof(int32_t) * (count ? count : 1));
+    int j;
+    for (j = 0; j < count; j++) {
+        perm[j] = count - 1 - j;
+    }
+    permuteEditorRows(at, count, perm);
+    free(perm);
+}
+
+// keeps the lines of [at, at + count) picked by fn, in their order. the
+// others are moved to the end of the file and deleted from there at once, so
+// no row after them is shifted, and undone, once per line deleted. returns the
+// number dropped.
+int filterEditorLines(int at, int count, void *(*fn)(void *), const char *pattern, int wanted) {
+    int total = E.numRows - at;
+    editorRow **line = gatherEditorLines(at, total, count);
+    unsigned char *keep = (unsigned char *)malloc(count ? count : 1);
+    int n = editorLineParts(count);
+    struct lineJob *jobs = (struct lineJob *)malloc(sizeof(struct lineJob) * n);
+    struct lineJob proto;
+
+    memset(&proto, 0, sizeof(proto));
+    proto.line = line;
+    proto.keep = keep;
+    proto.pattern = pattern;
+    proto.patternLen = pattern ? strlen(pattern) : 0;
+    proto.wanted = wanted;
+    splitLineJobs(jobs, n, count, &proto);
+    runLineJobs(jobs, n, fn);
+    free(jobs);
+
+    editorRow **order = (editorRow **)malloc(sizeof(editorRow *) * (total ? total : 1));
+    int kept = 0;
+    int j;
+    for (j = 0; j < count; j++) {
+        if (keep[j]) {
+            order[kept++] = line[j];
+        }
+    }
+    int dropped = count - kept;
+    memcpy(&order[kept], &line[count], sizeof(editorRow *) * (total - count));
+    int k = kept + total - count;
+    for (j = 0; j < count; j++) {
+        if (!keep[j]) {
+            order[k++] = line[j];
+        }
+    }
+
+    if (dropped) {
+        orderEditorLines(at, total, order);
+        delEditorRows(E.numRows - dropped, dropped);
+    }
+
+    free(order);
+    free(keep);
+    free(line);
+    return dropped;
+}
+
+/*** commands ***/
+
+// a small line based language, run by --exec over files and by Ctrl-E on
+// the open one:
+//
+//   goto N | goto $     go to line N, or the last line
+//   offset N            go to the byte at offset N, counting from 0
+//   find TEXT           go to the end of the next occurrence
+//   replace /OLD/NEW/   replace every occurrence, any delimiter will do
+//   insert TEXT         add a line above the current one
+//   append TEXT         add a line below the current one and go to it
+//   delete [N]          delete N lines from the current one, 1 by default
+//   save                write the file if it changed
+//
+// and on lines N to M, or on every line without a range:
+//
+//   [N,M] sort          sort the lines byte by byte
+//   [N,M] uniq          drop lines the same as the one before
+//   [N,M] reverse       reverse the order of the lines
+//   [N,M] keep TEXT     drop the lines without TEXT
+//   [N,M] drop TEXT     drop the lines with TEXT
+//
+// M may be $ for the last line. blank lines and lines starting with # are
+// skipped.
+
+enum editorCommandOp {
+    CMD_GOTO,
+    CMD_OFFSET,
+    CMD_FIND,
+    CMD_REPLACE,
+    CMD_INSERT,
+    CMD_APPEND,
+    CMD_DELETE,
+    CMD_SAVE,
+    CMD_SORT,
+    CMD_UNIQ,
+    CMD_REVERSE,
+    CMD_KEEP,
+    CMD_DROP
+};
+
+struct editorCommand {
+    int op;
+    int line;       // line of the script it came from.
+    long count;     // line or offset to go to, -1 for the last line, or lines to delete.
+    long first;     // range of lines, 0 if none was given.
+    long last;      // -1 for the last line.
+    char *text;
+    char *with;
+};
+
+// fills in cmd from a line of a script. returns 0, 1 for a line with
+// nothing to run, or -1 if the line makes no sense.
+int parseEditorCommand(char *s, struct editorCommand *cmd) {
+    static const char *names[] = { "goto", "offset", "find", "replace", "insert", "append", "delete", "save",
+        "sort", "uniq", "reverse", "keep", "drop" };
+    int len = strlen(s);
+    int j;
+
+    while (len > 0 && (s[len - 1] == '\n' || s[len - 1] == '\r')) {
+        s[--len] = '\0';
+    }
+    if (s[strspn(s, " \t")] == '\0' || s[strspn(s, " \t")] == '#') {
+        return 1;
+    }
+
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->op = -1;
+
+    char *end;
+    if (isdigit((unsigned char)*s)) {
+        cmd->first = strtol(s, &end, 10);
+        if (*end != ',' || cmd->first < 1) {
+            return -1;
+        }
+        s = end + 1;
+        if (*s == '$') {
+            cmd->last = -1;
+            s++;
+        } else {
+            cmd->last = strtol(s, &end, 10);
+            if (end == s || cmd->last < cmd->first) {
+                return -1;
+            }
+            s = end;
+        }
+        if (*s++ != ' ') {
+            return -1;
+        }
+    }
+
+    for (j = 0; j < (int)(sizeof(names) / sizeof(names[0])); j++) {
+        int n = strlen(names[j]);
+        if (strncmp(s, names[j], n) == 0 && (s[n] == '\0' || s[n] == ' ')) {
+            cmd->op = j;
+            s += n;
+            break;
+        }
+    }
+    if (*s == ' ') {
+        s++;
+    }
+    if (cmd->first && cmd->op < CMD_SORT) {
+        return -1;
+    }
+
+    switch (cmd->op) {
+        case CMD_GOTO:
+            if (strcmp(s, "$") == 0) {
+                cmd->count = -1;
+                return 0;
+            }
+            cmd->count = strtol(s, &end, 10);
+            return (end == s || *end || cmd->count < 1) ? -1 : 0;
+        case CMD_OFFSET:
+            cmd->count = strtol(s, &end, 10);
+            return (end == s || *end || cmd->count < 0) ? -1 : 0;
+        case CMD_DELETE:
+            cmd->count = 1;
+            if (*s) {
+                cmd->count = strtol(s, &end, 10);
+                return (*end || cmd->count < 1) ? -1 : 0;
+            }
+            return 0;
+        case CMD_FIND:
+        case CMD_INSERT:
+        case CMD_APPEND:
+            cmd->text = strdup(s);
+            return (cmd->op == CMD_FIND && *s == '\0') ? -1 : 0;
+        case CMD_REPLACE:
+            {
+                char delim = *s;
+                char *mid = delim ? strchr(s + 1, delim) : NULL;
+                char *last = mid ? strchr(mid + 1, delim) : NULL;
+                if (last == NULL || last[1] || mid == s + 1) {
+                    return -1;
+                }
+                cmd->text = strndup(s + 1, mid - s - 1);
+                cmd->with = strndup(mid + 1, last - mid - 1);
+            }
+            return 0;
+        case CMD_SAVE:
+        case CMD_SORT:
+        case CMD_UNIQ:
+        case CMD_REVERSE:
+            return *s ? -1 : 0;
+        case CMD_KEEP:
+        case CMD_DROP:
+            cmd->text = strdup(s);
+            return *s ? 0 : -1;
+    }
+    return -1;
+}
+
+void freeEditorCommand(struct editorCommand *cmd) {
+    free(cmd->text);
+    free(cmd->with);
+}
+
+// runs a command on the file in E. returns -1, with the reason in the
+// status message, if it failed.
+int runEditorCommand(struct editorCommand *cmd) {
+    if (cmd->op != CMD_GOTO && cmd->op != CMD_OFFSET && cmd->op != CMD_FIND && isEditorReadOnly()) {
+        return -1;
+    }
+
+    switch (cmd->op) {
+        case CMD_GOTO:
+            goEditorLine(cmd->count == -1 ? LLONG_MAX : cmd->count);
+            return 0;
+
+        case CMD_OFFSET:
+            return goEditorOffset(cmd->count);
+
+        case CMD_FIND:
+            {
+                int len = strlen(cmd->text);
+                int at = E.cx;
+                int j;
+
+                for (j = E.cy; j < E.numRows; j++, at = 0) {
+                    editorRow *row = &E.row[j];
+                    char *chars = peekEditorRow(row);
+                    char *match = (at <= row->size) ? (char *)memmem(chars + at, row->size - at, cmd->text, len) : NULL;
+
+                    if (match) {
+                        E.cy = j;
+                        E.cx = match - chars + len;
+                        return 0;
+                    }
+                }
+                setEditorStatusMessage("No match for \"%s\"", cmd->text);
+                return -1;
+            }
+
+        case CMD_REPLACE:
+            editorReplaceAll(cmd->text, cmd->with);
+            return 0;
+
+        case CMD_INSERT:
+            insertEditorRow(E.cy, cmd->text, strlen(cmd->text));
+            E.cy++;
+            E.cx = 0;
+            return 0;
+
+        case CMD_APPEND:
+            E.cy = (E.cy < E.numRows) ? E.cy + 1 : E.numRows;
+            insertEditorRow(E.cy, cmd->text, strlen(cmd->text));
+            E.cx = 0;
+            return 0;
+
+        case CMD_DELETE:
+            {
+                long n;
+                for (n = 0; n < cmd->count && E.cy < E.numRows; n++) {
+                    delEditorRow(E.cy);
+                }
+                E.cx = 0;
+            }
+            return 0;
+
+        case CMD_SAVE:
+            if (E.dirty) {
+                saveEditor();
+            }
+            return E.dirty ? -1 : 0;
+
+        case CMD_SORT:
+        case CMD_UNIQ:
+        case CMD_REVERSE:
+        case CMD_KEEP:
+        case CMD_DROP:
+            {
+                int first = cmd->first ? cmd->first - 1 : 0;
+                int last = (cmd->first == 0 || cmd->last == -1 || cmd->last > E.numRows) ? E.numRows : cmd->last;
+                int count = last - first;
+                if (count < 1) {
+                    setEditorStatusMessage("No lines in range");
+                    return -1;
+                }
+
+                clearEditorCursors();
+                if (cmd->op == CMD_SORT) {
+                    sortEditorLines(first, count);
+                    setEditorStatusMessage("Sorted %d lines", count);
+                } else if (cmd->op == CMD_REVERSE) {
+                    reverseEditorLines(first, count);
+                    setEditorStatusMessage("Reversed %d lines", count);
+                } else {
+                    int dropped = (cmd->op == CMD_UNIQ) ? filterEditorLines(first, count, uniqLineJob, NULL, 0) :
+                        filterEditorLines(first, count, matchLineJob, cmd->text, cmd->op == CMD_KEEP);
+                    setEditorStatusMessage("Dropped %d of %d lines", dropped, count);
+                }
+
+                if (E.cy > E.numRows) {
+                    E.cy = E.numRows;
+                }
+                E.cx = 0;
+            }
+            return 0;
+    }
+    return -1;
+}
+
+// runs a single command typed at the prompt.
+void editorCommand() {
+    char *line = editorPrompt("Command: %s (ESC to cancel)", NULL);
+    if (line == NULL) {
+        return;
+    }
+
+    struct editorCommand cmd;
+    int parsed = parseEditorCommand(line, &cmd);
+    if (parsed == -1) {
+        setEditorStatusMessage("Unknown command: %s", line);
+    } else if (parsed == 0) {
+        runEditorCommand(&cmd);
+    }
+    if (parsed != 1) {
+        freeEditorCommand(&cmd);
+    }
+    free(line);
+
+    if (E.cy < E.numRows && E.cx > E.row[E.cy].size) {
+        E.cx = E.row[E.cy].size;
+    }
+}
+
+/*** append buffer ***/
+
+struct abuf {
+    char *b;
+    int length;
+};
+
+#define ABUF_INIT {NULL, 0}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+    char *new = (char *)realloc(ab->b, ab->length + len);
+
+    if (new == NULL) {
+        return;
+    }
+
+    memcpy(&new[ab->length], s, len);
+    ab->b = new;
+    ab->length += len;
+}
+
+void abFree(struct abuf *ab) {
+    free(ab->b);
+}
+
+/*** output ***/
+
+// columns left for the text, right of the gutter.
+int editorTextColumns() {
+    int columns = E.screenColumns - E.gutter;
+    return (columns > 0) ? columns : 1;
+}
+
+// columns of the line numbers in the gutter, 0 if they are off.
+int editorNumberColumns() {
+    if (!E.lineNumbers) {
+        return 0;
+    }
+
+    long long last = E.viewBase + E.numRows;
+    int digits = 1;
+    while (last >= 10) {
+        last /= 10;
+        digits++;
+    }
+    return (digits < 3) ? 3 : digits;
+}
+
+// sizes the gutter for what it shows: line numbers and a space, then the
+// diff marks. wrapped rows are wrapped again when the width left for them
+// changes, so when the line numbers get another digit.
+void updateEditorGutter() {
+    int gutter = E.diff ? 2 : 0;
+
+    if (E.lineNumbers) {
+        gutter += editorNumberColumns() + 1;
+    }
+
+    if (gutter != E.gutter) {
+        E.gutter = gutter;
+        if (E.wrap) {
+            rewrapEditorRows();
+        }
+    }
+}
+
+void scrollEditor() {
+    // the cursor row is never left folded away.
+    if (E.numFolds && E.cy < E.numRows) {
+        revealEditorRow(E.cy);
+    }
+
+    E.rx = E.cx;
+    if (E.cy < E.numRows) {
+        E.rx = editorRowCxToRx(getEditorRow(E.cy), E.cx);
+    }
+
+    // wrapped or folded, the screen scrolls by screen lines rather than rows.
+    if (E.wrap || E.numFolds) {
+        int line = editorWrapCursorLine();
+        int top = editorWrapLineOf(E.rowOffset < E.numRows ? E.rowOffset : E.numRows) + E.wrapOffset;
+
+        if (line < top) {
+            top = line;
+        }
+        if (line >= top + E.screenRows) {
+            top = line - E.screenRows + 1;
+        }
+        E.rowOffset = findEditorWrapLine(top, &E.wrapOffset);
+        if (E.wrap) {
+            E.colOffset = 0;
+            return;
+        }
+    } else {
+        if (E.cy < E.rowOffset) {
+            E.rowOffset = E.cy;
+        }
+        if (E.cy >= E.rowOffset + E.screenRows) {
+            E.rowOffset = E.cy - E.screenRows + 1;
+        }
+    }
+    if (E.rx < E.colOffset) {
+        E.colOffset = E.rx;
+    }
+    if (E.rx >= E.colOffset + editorTextColumns()) {
+        E.colOffset = E.rx - editorTextColumns() + 1;
+    }
+}
+
+// the render position of the next extra cursor on the row from `from` on,
+// -1 if there is none.
+static int nextEditorCursorRx(editorRow *row, int fileRow, int *k, int from) {
+    while (*k < E.numCursors && E.cursor[*k].cy == fileRow) {
+        int rx = editorRowCxToRx(row, E.cursor[(*k)++].cx);
+        if (rx >= from) {
+            return rx;
+        }
+    }
+    return -1;
+}
+
+// draws [from, to) of the render of a row on one screen line. last is set
+// for the part the row ends on.
+void drawEditorRowSpan(struct abuf *ab, editorRow *row, int fileRow, int from, int to, int last) {
+    char *c = row->render;
+    unsigned char *highlight = row->highlight;
+    int currColor = -1;
+    int j;
+
+    // selected rows get a grey background, out to the edge.
+    if (isEditorRowSelected(fileRow)) {
+        abAppend(ab, "\x1b[100m", 6);
+    }
+
+    // extra cursors are drawn in reverse video.
+    int k = findEditorCursor(fileRow, 0);
+    int cursorRx = nextEditorCursorRx(row, fileRow, &k, from);
 
-struct abuf {
-    char *b;
-    int length;
-};
+    // search matches are drawn over the colors of the row.
+    struct matchCacheEntry *matches = E.matchQuery ? getEditorRowMatches(row) : NULL;
+    int m = 0;
 
-#define ABUF_INIT {NULL, 0}
+    for (j = from; j < to; j++) {
+        int hl = highlight[j];
+        if (matches) {
+            while (m < matches->count && matches->at[m] + E.matchQueryLen <= j) {
+                m++;
+            }
+            if (m < matches->count && matches->at[m] <= j) {
+                hl = HL_MATCH;
+            }
+        }
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = (char *)realloc(ab->b, ab->length + len);
+        if (hl == HL_NORMAL) {
+            if (currColor != -1) {
+                abAppend(ab, "\x1b[39m", 5);
+                currColor = -1;
+            }
+        } else {
+            int color = editorSyntaxToColor(hl);
+            if (color != currColor) {
+                currColor = color;
+                char buf[16];
 
-    if (new == NULL) {
-        return;
-    }
+                int writeLen = snprintf(buf, sizeof(buf),   "\x1b[%dm", color);
+                abAppend(ab, buf, writeLen);
+            }
+        }
 
-    memcpy(&new[ab->length], s, len);
-    ab->b = new;
-    ab->length += len;
+        if (fileRow == E.bracketRow && j == E.bracketRx) {
+            abAppend(ab, "\x1b[4m", 4);
+            abAppend(ab, &c[j], 1);
+            abAppend(ab, "\x1b[24m", 5);
+        } else if (j == cursorRx) {
+            abAppend(ab, "\x1b[7m", 4);
+            abAppend(ab, &c[j], 1);
+            abAppend(ab, "\x1b[27m", 5);
+            cursorRx = nextEditorCursorRx(row, fileRow, &k, from);
+        } else {
+            abAppend(ab, &c[j], 1);
+        }
+    }
+    abAppend(ab, "\x1b[39m", 5);
+    if (last && cursorRx == row->rsize && cursorRx - from < editorTextColumns()) {
+        abAppend(ab, "\x1b[7m \x1b[27m", 10);
+    }
 }
 
-void abFree(struct abuf *ab) {
-    free(ab->b);
-}
+// draws the gutter left of a screen line, with the number and the diff mark
+// of the row on the first line it takes. lines removed below the last row
+// are marked on the line after it.
+void drawEditorGutter(struct abuf *ab, int fileRow, int first) {
+    if (E.gutter == 0) {
+        return;
+    }
 
-/*** output ***/
+    if (E.lineNumbers) {
+        int width = E.gutter - (E.diff ? 2 : 0) - 1;
+        char buf[48];
+        int len;
 
-void scrollEditor() {
-    E.rx = E.cx;
-    if (E.cy < E.numRows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        // the number of the cursor row stands out from the dimmed others.
+        if (first && fileRow < E.numRows) {
+            len = snprintf(buf, sizeof(buf), "%s%*lld\x1b[39m ", (fileRow == E.cy) ? "" : "\x1b[90m", width, E.viewBase + fileRow + 1);
+        } else {
+            len = snprintf(buf, sizeof(buf), "%*s", width + 1, "");
+        }
+        abAppend(ab, buf, len);
     }
-
-    if (E.cy < E.rowOffset) {
-        E.rowOffset = E.cy;
+    if (!E.diff) {
+        return;
     }
-    if (E.cy >= E.rowOffset + E.screenRows) {
-        E.rowOffset = E.cy - E.screenRows + 1;
+
+    int mark = (first && E.diffMark && fileRow <= E.diffRows) ? E.diffMark[fileRow] : 0;
+    if (mark & DIFF_ADDED) {
+        abAppend(ab, "\x1b[32m+\x1b[39m ", 12);
+    } else if (mark & DIFF_CHANGED) {
+        abAppend(ab, "\x1b[33m~\x1b[39m ", 12);
+    } else if (mark & DIFF_REMOVED) {
+        abAppend(ab, "\x1b[31m-\x1b[39m ", 12);
+    } else {
+        abAppend(ab, "  ", 2);
     }
-    if (E.rx < E.colOffset) {
-        E.colOffset = E.rx;
+}
+
+// after a row with a fold below it, how many lines are folded, in as much
+// of the room left on the screen line as it takes.
+void drawEditorFoldTail(struct abuf *ab, int fileRow, int room) {
+    int k = E.numFolds ? findEditorFold(fileRow + 1) : -1;
+    if (k == -1 || room <= 0) {
+        return;
     }
-    if (E.rx >= E.colOffset + E.screenColumns) {
-        E.colOffset = E.rx - E.screenColumns + 1;
+
+    int lines = E.fold[k].end - E.fold[k].start;
+    char buf[48];
+    int len = snprintf(buf, sizeof(buf), " ... %d line%s", lines, lines == 1 ? "" : "s");
+    if (len > room) {
+        len = room;
     }
+    abAppend(ab, "\x1b[90m", 5);
+    abAppend(ab, buf, len);
+    abAppend(ab, "\x1b[39m", 5);
 }
 
 void drawEditorRows(struct abuf *ab) {
+    int fileRow = E.rowOffset;
+    int seg = E.wrap ? E.wrapOffset : 0;
+    int columns = editorTextColumns();
     int y;
 
     for (y = 0; y < E.screenRows; y++) {
-        int fileRow = y + E.rowOffset;
+        drawEditorGutter(ab, fileRow, seg == 0);
         if (fileRow >= E.numRows) {
+            fileRow++;
             if (E.numRows == 0 && y == E.screenRows / 3) {
                 char welcome[80];
                 int welcomeLen = snprintf(welcome, sizeof(welcome), "Macho Editor -- version %s", MACHO_VERSION);
 
-                if (welcomeLen > E.screenColumns) {
-                    welcomeLen = E.screenColumns;
+                if (welcomeLen > columns) {
+                    welcomeLen = columns;
                 }
 
-                int padding = (E.screenColumns - welcomeLen) / 2;
+                int padding = (columns - welcomeLen) / 2;
                 if (padding) {
                     abAppend(ab, "~", 1);
                     padding--;
@@ -873,43 +9014,37 @@ void drawEditorRows(struct abuf *ab) {
             } else {
                 abAppend(ab, "~", 1);
             }
-        } else {
-            int len = E.row[fileRow].rsize - E.colOffset;
-            if (len < 0) {
-                len = 0;
-            }
-            if (len > E.screenColumns) {
-                len = E.screenColumns;
+        } else if (E.wrap) {
+            editorRow *row = getEditorRow(fileRow);
+            if (seg >= row->wrapLines) {
+                seg = row->wrapLines - 1;
             }
 
-            char *c = &E.row[fileRow].render[E.colOffset];
-            unsigned char *highlight = &E.row[fileRow].highlight[E.colOffset];
-            int currColor = -1;
-            int j;
-
-            for (j = 0; j < len; j++) {
-                if (highlight[j] == HL_NORMAL) {
-                    if (currColor != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        currColor = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(highlight[j]);
-                    if (color != currColor) {
-                        currColor = color;
-                        char buf[16];
-
-                        int writeLen = snprintf(buf, sizeof(buf),   "\x1b[%dm", color);
-                        abAppend(ab, buf, writeLen);
-                    }
-                    abAppend(ab, &c[j], 1);
-                }
+            int last = (seg + 1 >= row->wrapLines);
+            int from = editorWrapStart(row, seg);
+            int to = editorWrapEnd(row, seg);
+            drawEditorRowSpan(ab, row, fileRow, from, to, last);
+            if (last) {
+                drawEditorFoldTail(ab, fileRow, columns - (to - from));
+                fileRow = nextEditorVisibleRow(fileRow);
+                seg = 0;
+            } else {
+                seg++;
             }
-            abAppend(ab, "\x1b[39m", 5);
+        } else {
+            editorRow *row = getEditorRow(fileRow);
+            int to = row->rsize;
+            if (to > E.colOffset + columns) {
+                to = E.colOffset + columns;
+            }
+
+            drawEditorRowSpan(ab, row, fileRow, E.colOffset, to, 1);
+            drawEditorFoldTail(ab, fileRow, columns - (to > E.colOffset ? to - E.colOffset : 0));
+            fileRow = nextEditorVisibleRow(fileRow);
         }
 
         abAppend(ab, "\x1b[K", 3);
+        abAppend(ab, "\x1b[49m", 5);
         abAppend(ab, "\r\n", 2);
     }
 }
@@ -918,8 +9053,33 @@ void drawEditorStatusBar(struct abuf *ab) {
     abAppend(ab, "\x1b[7m", 4);
 
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.fileName ? E.fileName : "[No Name]", E.numRows, E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->fileType : "no filetype", E.cy + 1, E.numRows);
+    char lines[24];
+    long long numLines = E.view ? E.viewLines : E.numRows;
+    if (numLines < 0) {
+        strcpy(lines, "?");
+    } else {
+        snprintf(lines, sizeof(lines), "%lld", numLines);
+    }
+
+    char cursors[32] = "";
+    int at, count;
+    if (E.numCursors) {
+        snprintf(cursors, sizeof(cursors), " (%d cursors)", E.numCursors + 1);
+    } else if (E.markRow >= 0 && getEditorSelection(&at, &count) == 0) {
+        snprintf(cursors, sizeof(cursors), " (%d selected)", count);
+    }
+
+    char diff[48] = "";
+    if (E.diff) {
+        snprintf(diff, sizeof(diff), " (+%d ~%d -%d)", E.diffAdded, E.diffChanged, E.diffRemoved);
+    }
+
+    int len = snprintf(status, sizeof(status), "%.20s - %s lines%s%s%s%s%s", E.fileName ? E.fileName : (E.streamed ? "[stdin]" : "[No Name]"),
+        lines, E.dirty ? " (modified)" : "", E.follow ? " (following)" : "", E.view ? " (view)" : "", diff, cursors);
+    if (len > (int)sizeof(status) - 1) {
+        len = sizeof(status) - 1;
+    }
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %lld/%s", E.syntax ? E.syntax->fileType : "no filetype", E.viewBase + E.cy + 1, lines);
     if (len > E.screenColumns) {
         len = E.screenColumns;
     }
@@ -953,8 +9113,17 @@ void drawEditorMessageBox(struct abuf *ab) {
 }
 
 void refreshEditorScreen() {
+    refreshEditorDiff();
+    updateEditorGutter();
     scrollEditor();
 
+    if (findEditorCursorBracket(&E.bracketRow, &E.bracketRx) == -1) {
+        E.bracketRow = -1;
+    }
+
+    publishEditorHighlights();
+    scheduleEditorHighlights();
+
     struct abuf ab = ABUF_INIT;
 
     abAppend(&ab, "\x1b[?25l", 6);
@@ -964,8 +9133,24 @@ void refreshEditorScreen() {
     drawEditorStatusBar(&ab);
     drawEditorMessageBox(&ab);
 
+    int y = E.cy - E.rowOffset;
+    int x = E.rx - E.colOffset;
+    if (E.numFolds && !E.wrap) {
+        y = editorWrapLineOf(E.cy) - editorWrapLineOf(E.rowOffset);
+    }
+    if (E.wrap) {
+        int seg = (E.cy < E.numRows) ? editorWrapSegment(getEditorRow(E.cy), E.rx) : 0;
+
+        y = editorWrapCursorLine() - editorWrapLineOf(E.rowOffset) - E.wrapOffset;
+        x = E.rx - ((E.cy < E.numRows) ? editorWrapStart(getEditorRow(E.cy), seg) : 0);
+        if (x >= editorTextColumns()) {
+            x = editorTextColumns() - 1;
+        }
+    }
+    x += E.gutter;
+
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowOffset) + 1, (E.rx - E.colOffset) + 1);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
     abAppend(&ab, buf, strlen(buf));
 
     abAppend(&ab, "\x1b[?25h", 6);
@@ -975,6 +9160,38 @@ void refreshEditorScreen() {
     abFree(&ab);
 }
 
+// frames are drawn by waitEditorInput, once the keys waiting have been
+// handled, at most every MACHO_FRAME_MS, and not while the terminal is still
+// taking in the last one. frames in between are skipped, so the screen
+// shows the latest state without a backlog building up in the tty.
+void requestEditorFrame() {
+    E.frameWanted = 1;
+}
+
+// how long until a frame can be drawn, 0 for now, -1 if none is wanted.
+int editorFrameWait(long long now) {
+    if (!E.frameWanted) {
+        return -1;
+    }
+
+    long long wait = E.frameAt + MACHO_FRAME_MS - now;
+    if (wait > 0) {
+        return wait;
+    }
+
+    int queued = 0;
+    if (ioctl(STDOUT_FILENO, TIOCOUTQ, &queued) == 0 && queued > 0 && now - E.frameAt < MACHO_FRAME_STALL_MS) {
+        return MACHO_FRAME_MS;
+    }
+    return 0;
+}
+
+void drawEditorFrame() {
+    refreshEditorScreen();
+    E.frameWanted = 0;
+    E.frameAt = editorNowMs();
+}
+
 void setEditorStatusMessage(const char *message, ...) {
     va_list args;
     va_start(args, message);
@@ -987,16 +9204,134 @@ void setEditorStatusMessage(const char *message, ...) {
 
 /*** input ***/
 
+// blocks until stdin is readable. finished background highlighting is
+// published meanwhile, redrawing the screen if visible rows changed.
+void waitEditorInput() {
+    struct pollfd fds[4];
+
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = HW.wakeFd[0];
+    fds[1].events = POLLIN;
+    fds[2].events = POLLIN;
+    fds[3].events = POLLIN;
+
+    while (1) {
+        flushEditorJournal();
+
+        long long now = editorNowMs();
+        E.coldClock = now / 1000;
+
+        // changes on disk wait until no prompt holds on to rows.
+        if (E.diskCheckAt && now >= E.diskCheckAt && !E.coldHold) {
+            E.diskCheckAt = 0;
+            if (checkEditorDisk()) {
+                requestEditorFrame();
+            }
+        }
+
+        // a frame waits for the keys already typed, unless it is late.
+        int frameWait = editorFrameWait(now);
+        if (frameWait == 0 && (!isEditorKeyPending() || now - E.frameAt >= MACHO_FRAME_LATE_MS)) {
+            drawEditorFrame();
+            frameWait = -1;
+        }
+        fds[2].fd = E.coldHold ? -1 : E.watchFd;
+        fds[3].fd = E.coldHold ? -1 : E.streamFd;
+
+        int timeout = frameWait;
+        if (E.journalSyncAt) {
+            long long wait = E.journalSyncAt - now;
+            if (timeout == -1 || wait < timeout) {
+                timeout = wait > 0 ? (int)wait : 0;
+            }
+        }
+        if (E.diskCheckAt && !E.coldHold) {
+            long long wait = E.diskCheckAt - now;
+            if (timeout == -1 || wait < timeout) {
+                timeout = wait > 0 ? (int)wait : 0;
+            }
+        }
+
+        // once the buffer is edited, the rows still in the file are read in
+        // while nothing else happens.
+        int pulling = (E.dirty && E.fileBlocks > 0);
+        if (pulling) {
+            timeout = 0;
+        }
+
+        // unused rows of a large file are packed while nothing else happens.
+        int cooling = (E.numRows >= MACHO_COLD_ROWS && !E.coldHold);
+        if (cooling) {
+            long long wait = E.coldNextAt - now;
+            if (timeout == -1 || wait < timeout) {
+                timeout = wait > 0 ? (int)wait : 0;
+            }
+        }
+
+        int ready = poll(fds, 4, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("poll error");
+        }
+        if (ready == 0) {
+            now = editorNowMs();
+            if (E.journalSyncAt && now >= E.journalSyncAt) {
+                syncEditorJournal();
+            }
+            if (pulling) {
+                pullEditorFileBlocks();
+            }
+            if (cooling && now >= E.coldNextAt) {
+                E.coldNextAt = now + (coolEditorRows() ? MACHO_COLD_TICK_MS : MACHO_COLD_AGE * 1000);
+            }
+            continue;
+        }
+
+        if ((fds[3].revents & (POLLIN | POLLHUP | POLLERR)) && readEditorStream()) {
+            requestEditorFrame();
+        }
+        if (fds[2].revents & POLLIN) {
+            // a writer may truncate before it writes, give it a moment.
+            int event = readEditorWatch();
+            now = editorNowMs();
+            if (event == 2) {
+                E.diskCheckAt = now;
+            } else if (event && E.diskCheckAt == 0) {
+                E.diskCheckAt = now + MACHO_DISK_SETTLE_MS;
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            if (publishEditorHighlights()) {
+                requestEditorFrame();
+            } else {
+                scheduleEditorHighlights();
+            }
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            return;
+        }
+    }
+}
+
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+    return editorPromptInput(prompt, callback, 0);
+}
+
+char *editorPromptInput(char *prompt, void (*callback)(char *, int), int allowEmpty) {
     size_t bufSize = 128;
     char *buf = (char *)malloc(bufSize);
 
     size_t bufLen = 0;
     buf[0] = '\0';
 
+    // callbacks keep rows around between keys.
+    E.coldHold++;
     while(1) {
         setEditorStatusMessage(prompt, buf);
-        refreshEditorScreen();
+        requestEditorFrame();
 
         int c = readEditorKey();
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -1008,14 +9343,16 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
             if (callback) {
                 callback(buf, c);
             }
+            E.coldHold--;
             free(buf);
             return NULL;
         } else if (c == '\r') {
-            if (bufLen != 0) {
+            if (bufLen != 0 || allowEmpty) {
                 setEditorStatusMessage("");
                 if (callback) {
                     callback(buf, c);
                 }
+                E.coldHold--;
                 return buf;
             }
         } else if (!iscntrl(c) && c < 128) {
@@ -1042,7 +9379,7 @@ void moveEditorCursor(int key) {
             if (E.cx != 0) {
                 E.cx--;
             } else if (E.cy > 0) {
-                E.cy--;
+                E.cy = prevEditorVisibleRow(E.cy);
                 E.cx = E.row[E.cy].size;
             }
             break;
@@ -1050,18 +9387,18 @@ void moveEditorCursor(int key) {
             if (row && E.cx < row->size) {
                 E.cx++;
             } else if (row && E.cy < E.numRows) {
-                E.cy++;
+                E.cy = nextEditorVisibleRow(E.cy);
                 E.cx = 0;
             }
             break;
         case ARROW_UP:
             if (E.cy != 0) {
-                E.cy--;
+                E.cy = prevEditorVisibleRow(E.cy);
             }
             break;
         case ARROW_DOWN:
             if (E.cy < E.numRows) {
-                E.cy++;
+                E.cy = nextEditorVisibleRow(E.cy);
             }
             break;
     }
@@ -1076,6 +9413,18 @@ void moveEditorCursor(int key) {
 void processEditorKeypress() {
     static int quitTimes = MACHO_QUIT_NUM_TIMES;
     int c = readEditorKey();
+    int typing = (c == '\t' || (c < 128 && !iscntrl(c)));
+
+    beginEditorUndoGroup(typing);
+    E.undoTyping = 0;
+
+    if (E.numCursors && applyEditorCursors(c)) {
+        E.undoTyping = typing;
+        E.undoTypingRow = E.cy;
+        E.undoTypingCol = E.cx;
+        quitTimes = MACHO_QUIT_NUM_TIMES;
+        return;
+    }
 
     switch (c) {
         case '\r':
@@ -1088,6 +9437,8 @@ void processEditorKeypress() {
                 quitTimes--;
                 return;
             }
+            removeEditorJournal();
+            saveEditorCache();
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -1122,6 +9473,10 @@ void processEditorKeypress() {
 
         case PAGE_UP:
         case PAGE_DOWN:
+            if (E.wrap || E.numFolds) {
+                pageEditorWrapped(c == PAGE_UP ? -1 : 1);
+                break;
+            }
             {
                 if (c == PAGE_UP) {
                     E.cy = E.rowOffset;
@@ -1147,16 +9502,247 @@ void processEditorKeypress() {
             break;
 
         case CTRL_KEY('l'):
+            E.lineNumbers = !E.lineNumbers;
+            updateEditorGutter();
+            break;
+
+        case CTRL_KEY('g'):
+            editorGoto();
+            break;
+
         case '\x1b':
-            /* TODO */
+            clearEditorCursors();
+            E.markRow = -1;
+            break;
+
+        case CTRL_KEY('b'):
+            toggleEditorMark();
+            break;
+
+        case CTRL_KEY('c'):
+        case CTRL_KEY('x'):
+            copyEditorLines(c == CTRL_KEY('x'));
+            break;
+
+        case CTRL_KEY('v'):
+            pasteEditorLines();
+            break;
+
+        case CTRL_KEY('w'):
+            toggleEditorWrap();
+            break;
+
+        case CTRL_KEY('d'):
+            toggleEditorDiff();
+            break;
+
+        case CTRL_KEY('t'):
+            toggleEditorFold();
+            break;
+
+        case CTRL_KEY('n'):
+            addEditorCursorBelow();
+            break;
+
+        case CTRL_KEY('a'):
+            addEditorCursorsAtMatches();
+            break;
+
+        case CTRL_KEY('e'):
+            editorCommand();
+            break;
+
+        case CTRL_KEY(']'):
+            jumpEditorBracket();
+            break;
+
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
             break;
 
         default:
             insertEditorChar(c);
+            E.undoTyping = typing;
+            E.undoTypingRow = E.cy;
+            E.undoTypingCol = E.cx;
             break;
     }
 
     quitTimes = MACHO_QUIT_NUM_TIMES;
+    if (E.view) {
+        slideEditorView();
+    }
+    if (E.numCursors) {
+        sortEditorCursors();
+    }
+
+    // paging starts from the top row, which has to follow the cursor even
+    // when frames are skipped.
+    scrollEditor();
+    requestEditorFrame();
+}
+
+/*** batch ***/
+
+// macho --exec script files... runs the script over every file without a
+// terminal. the files are shared out to a pool of threads; E is per thread,
+// so each one goes through the row operations on its own file.
+
+struct editorBatch {
+    struct editorCommand *cmd;
+    int numCmds;
+    char **files;
+    int numFiles;
+    int next;           // next file to be taken.
+    int failed;
+    pthread_mutex_t lock;
+};
+
+// reads the script into commands, or returns -1 after saying what is wrong.
+int readEditorScript(char *path, struct editorBatch *b) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "macho: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    int cap = 0;
+    int lineNo = 0;
+    int result = 0;
+
+    while (getline(&line, &lineCapacity, fp) != -1) {
+        struct editorCommand cmd;
+        int parsed = parseEditorCommand(line, &cmd);
+
+        lineNo++;
+        if (parsed == 1) {
+            continue;
+        }
+        if (parsed == -1) {
+            fprintf(stderr, "macho: %s:%d: can't make sense of \"%s\"\n", path, lineNo, line);
+            freeEditorCommand(&cmd);
+            result = -1;
+            break;
+        }
+
+        if (b->numCmds == cap) {
+            cap = cap ? cap * 2 : 16;
+            b->cmd = (struct editorCommand *)realloc(b->cmd, sizeof(struct editorCommand) * cap);
+        }
+        cmd.line = lineNo;
+        b->cmd[b->numCmds++] = cmd;
+    }
+
+    free(line);
+    fclose(fp);
+    return result;
+}
+
+// runs the script on one file in a fresh E. returns -1 if it failed, and
+// then nothing is saved after the failing command.
+int runEditorScript(struct editorBatch *b, char *fileName) {
+    int result = 0;
+    int j;
+
+    initEditor();
+    E.headless = 1;
+    E.journalSuspended = 1;
+    E.undoSuspended = 1;
+    E.fileName = strdup(fileName);
+
+    if (readEditorFile(fileName) == -1) {
+        fprintf(stderr, "macho: %s: %s\n", fileName, strerror(errno));
+        freeEditor();
+        return -1;
+    }
+
+    for (j = 0; j < b->numCmds; j++) {
+        E.statusMsg[0] = '\0';
+        if (runEditorCommand(&b->cmd[j]) == -1) {
+            fprintf(stderr, "macho: %s: line %d of the script: %s\n", fileName, b->cmd[j].line, E.statusMsg);
+            result = -1;
+            break;
+        }
+        if (b->cmd[j].op == CMD_SAVE && E.statusMsg[0]) {
+            printf("%s\n", E.statusMsg);
+        }
+    }
+
+    freeEditor();
+    return result;
+}
+
+void *batchWorkerMain(void *arg) {
+    struct editorBatch *b = (struct editorBatch *)arg;
+
+    while (1) {
+        pthread_mutex_lock(&b->lock);
+        int at = b->next++;
+        pthread_mutex_unlock(&b->lock);
+
+        if (at >= b->numFiles) {
+            return NULL;
+        }
+
+        if (runEditorScript(b, b->files[at]) == -1) {
+            pthread_mutex_lock(&b->lock);
+            b->failed++;
+            pthread_mutex_unlock(&b->lock);
+        }
+    }
+}
+
+// returns the exit status: failure if the script or any file failed.
+int runEditorBatch(char *script, char **files, int numFiles) {
+    struct editorBatch b;
+    memset(&b, 0, sizeof(b));
+    pthread_mutex_init(&b.lock, NULL);
+    b.files = files;
+    b.numFiles = numFiles;
+
+    if (readEditorScript(script, &b) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > numFiles) {
+        threads = numFiles;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    pthread_t *pool = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    long started = 0;
+    long j;
+    for (j = 0; j < threads; j++) {
+        if (pthread_create(&pool[started], NULL, batchWorkerMain, &b) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        batchWorkerMain(&b);
+    }
+    for (j = 0; j < started; j++) {
+        pthread_join(pool[j], NULL);
+    }
+    free(pool);
+
+    for (j = 0; j < b.numCmds; j++) {
+        freeEditorCommand(&b.cmd[j]);
+    }
+    free(b.cmd);
+
+    if (b.failed) {
+        fprintf(stderr, "macho: %d of %d files failed\n", b.failed, numFiles);
+    }
+    return b.failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 /*** init ***/
@@ -1174,28 +9760,218 @@ void initEditor() {
     E.statusMsg[0] = '\0';
     E.statusMsgTime = 0;
     E.syntax = NULL;
+    E.hlSerial = 0;
+    E.hlTicket = 0;
+    E.hlEpoch = 0;
+    E.hlPending = 0;
+    E.hlSweep = 0;
+    E.journalFd = -1;
+    E.journalBuf = NULL;
+    E.journalLen = 0;
+    E.journalCap = 0;
+    E.journalSyncAt = 0;
+    E.journalSuspended = 0;
+    E.undo = NULL;
+    E.undoLen = 0;
+    E.undoCap = 0;
+    E.undoGroup = 0;
+    E.undoSuspended = 0;
+    E.undoLost = -1;
+    E.undoTyping = 0;
+    E.coldClock = editorNowMs() / 1000;
+    E.coldSweep = 0;
+    E.coldLapPacked = 0;
+    E.coldNextAt = 0;
+    E.coldHold = 0;
+    E.coldCache = NULL;
+    E.coldPlain = NULL;
+    E.coldPlainCap = 0;
+    memset(&E.disk, 0, sizeof(E.disk));
+    E.disk.sealed = 1;
+    E.watchFd = -1;
+    E.watchFile = -1;
+    E.watchDir = -1;
+    E.diskConflict = 0;
+    E.diskCheckAt = 0;
+    E.follow = 0;
+    E.streamFd = -1;
+    E.streamed = 0;
+    E.streamBuf = NULL;
+    E.streamLen = 0;
+    E.streamCap = 0;
+    E.rowCap = 0;
+    E.view = 0;
+    E.viewFd = -1;
+    E.viewBase = 0;
+    E.viewAtEnd = 1;
+    E.viewLines = -1;
+    E.viewIndex = NULL;
+    E.viewIndexLen = 0;
+    E.viewIndexCap = 0;
+    E.viewBuf = NULL;
+    E.viewSearchCut = 0;
+    E.cursor = NULL;
+    E.numCursors = 0;
+    E.cursorCap = 0;
+    E.headless = 0;
+    E.frameWanted = 1;
+    E.frameAt = 0;
+    E.matchQuery = NULL;
+    E.matchQueryLen = 0;
+    E.matchCache = NULL;
+    E.chunkTree = NULL;
+    E.chunkSize = 0;
+    E.numChunks = 0;
+    E.chunkDirty = NULL;
+    E.numChunkDirty = 0;
+    E.chunkDirtyCap = 0;
+    E.chunkMarked = NULL;
+    E.bracketTree = NULL;
+    E.bracketRow = -1;
+    E.bracketRx = 0;
+    E.clip = NULL;
+    E.markRow = -1;
+    E.wrap = 0;
+    E.wrapWidth = 0;
+    E.wrapTree = NULL;
+    E.wrapOffset = 0;
+    E.byteTree = NULL;
+    E.lineNumbers = 1;
+    E.fold = NULL;
+    E.numFolds = 0;
+    E.foldCap = 0;
+    E.internSlot = NULL;
+    E.internCap = 0;
+    E.internCount = 0;
+    E.fileFd = -1;
+    E.fileBlocks = 0;
+    E.fileBlock = NULL;
+    E.fileBlockLen = 0;
+    E.fileBlockCap = 0;
+    E.filePulled = 0;
+    E.fileLost = 0;
+    E.cacheFresh = 0;
+    E.cacheHlFrom = 0;
+    E.compress = COMPRESS_NONE;
+    E.viewFrame = NULL;
+    E.viewFrames = 0;
+    E.viewFrameAt = -1;
+    E.viewFrameBuf = NULL;
+    E.gutter = 0;
+    E.diff = 0;
+    E.diffMark = NULL;
+    E.diffRow = NULL;
+    E.diffRows = 0;
+    E.diffRowCap = 0;
+    E.diffFrom = INT_MAX;
+    E.diffAfter = INT_MAX;
+    memset(&E.diffDisk, 0, sizeof(E.diffDisk));
+    E.diffLine = NULL;
+    E.diffLines = 0;
+    E.diffAdded = 0;
+    E.diffChanged = 0;
+    E.diffRemoved = 0;
+    E.screenRows = 0;
+    E.screenColumns = 0;
+}
 
-    if (getWindowSize(&E.screenRows, &E.screenColumns) == -1) {
-        die("getWindowSize error");
+// frees the rows and everything else held for the file.
+void freeEditor() {
+    int j;
+
+    // shared lines are freed with their last row, not taken out of the
+    // table one by one.
+    free(E.internSlot);
+    E.internSlot = NULL;
+    E.internCap = 0;
+    E.internCount = 0;
+    for (j = 0; j < E.numRows; j++) {
+        freeEditorRow(&E.row[j]);
     }
-    E.screenRows -= 2;
+    free(E.row);
+    free(E.fileName);
+    clearEditorUndo();
+    free(E.undo);
+    free(E.cursor);
+    resetEditorDisk(&E.disk);
+    free(E.journalBuf);
+    free(E.coldPlain);
+    resetEditorChunks();
+    free(E.chunkDirty);
+    releaseEditorClip(E.clip);
+    free(E.fold);
+    free(E.diffMark);
+    free(E.diffRow);
+    free(E.diffLine);
 }
 
+// built with -DMACHO_LIBRARY there is no main, and the program including
+// this file sets up E and calls the row operations itself, as tests/ does.
+#ifndef MACHO_LIBRARY
 int main(int argc, char *argv[]) {
+    char *fileName = NULL;
+    int follow = 0;
+    int view = 0;
+    int streamFd = -1;
+    int j;
 
-    enableRawMode();
-    initEditor();
+    if (argc > 1 && strcmp(argv[1], "--exec") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "usage: macho --exec script file...\n");
+            exit(EXIT_FAILURE);
+        }
+        return runEditorBatch(argv[2], &argv[3], argc - 3);
+    }
+
+    for (j = 1; j < argc; j++) {
+        if (strcmp(argv[j], "--follow") == 0) {
+            follow = 1;
+        } else if (strcmp(argv[j], "--view") == 0) {
+            view = 1;
+        } else if (strncmp(argv[j], "--", 2) == 0 || fileName) {
+            fprintf(stderr, "usage: macho [--follow] [file | -]\n       macho --view file\n       macho --exec script file...\n");
+            exit(EXIT_FAILURE);
+        } else {
+            fileName = argv[j];
+        }
+    }
+
+    if (view && (fileName == NULL || strcmp(fileName, "-") == 0 || follow)) {
+        fprintf(stderr, "macho: --view needs a file, and does not follow it\n");
+        exit(EXIT_FAILURE);
+    }
 
-    if (argc >= 2) {
-        openEditor(argv[1]);
+    // the terminal has to be in place before raw mode is set on it.
+    if (fileName && strcmp(fileName, "-") == 0) {
+        streamFd = openEditorStream();
+        fileName = NULL;
     }
 
-    setEditorStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    enableRawMode();
+    initEditor();
+    if (getWindowSize(&E.screenRows, &E.screenColumns) == -1) {
+        die("getWindowSize error");
+    }
+    E.screenRows -= 2;
+    atexit(syncEditorJournal);
+    loadSyntaxDefinitions();
+    startHighlightWorker();
+    E.follow = follow;
+    E.streamFd = streamFd;
+    E.streamed = (streamFd != -1);
+
+    setEditorStatusMessage("HELP: Ctrl-S save | Ctrl-Q quit | Ctrl-F find | Ctrl-R replace | Ctrl-Z undo");
+
+    if (view && fileName) {
+        openEditorView(fileName);
+    } else if (fileName) {
+        openEditor(fileName);
+    }
 
     while (1) {
-        refreshEditorScreen();
         processEditorKeypress();
     }
 
     return 0;
 }
+#endif
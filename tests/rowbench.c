@@ -0,0 +1,184 @@
+/* Microbenchmark of the row operations.
+ *
+ * Each operation is timed over many rows of a C file, for several line
+ * lengths and shares of tabs, and the calls to malloc, calloc and realloc it
+ * makes are counted. The allocator is wrapped at link time, see the Makefile.
+ * The lines are all different, so none of them are shared.
+ *
+ *   rowbench [rows]
+ */
+
+/*** includes ***/
+
+#define MACHO_LIBRARY
+#include "../macho.c"
+
+/*** defines ***/
+
+#define BENCH_ROWS 20000        // rows each operation is timed over.
+#define BENCH_TO_STRING 20      // times the whole buffer is gathered.
+
+/*** allocations ***/
+
+long benchAllocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    benchAllocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    benchAllocs++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    benchAllocs++;
+    return __real_realloc(p, size);
+}
+
+/*** timing ***/
+
+struct benchMark {
+    long long ns;
+    long allocs;
+};
+
+long long benchNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void startBench(struct benchMark *m) {
+    m->allocs = benchAllocs;
+    m->ns = benchNow();
+}
+
+void reportBench(struct benchMark *m, const char *op, int len, int tabs, long ops) {
+    long long ns = benchNow() - m->ns;
+    long allocs = benchAllocs - m->allocs;
+
+    printf("%-20s %5d %4d%% %10.1f %10.2f\n", op, len, tabs, (double)ns / ops, (double)allocs / ops);
+}
+
+/*** lines ***/
+
+// C-like text with no comments or strings, so that editing a row never
+// changes the state carried to the rows below it and every operation costs
+// one row. tabs is the percentage of tab characters. the number of the line
+// up front keeps the lines apart.
+char *benchLine(int at, int len, int tabs, unsigned int *seed) {
+    static const char text[] = "abcdefghijklmnopqrstuvwxyz_0123456789 (){};,=+";
+    char *s = (char *)malloc(len + 1);
+    char num[16];
+    int numLen = snprintf(num, sizeof(num), "%d ", at);
+    int j;
+
+    for (j = 0; j < len; j++) {
+        *seed = *seed * 1103515245 + 12345;
+        if ((int)((*seed >> 16) % 100) < tabs) {
+            s[j] = '\t';
+        } else {
+            s[j] = text[(*seed >> 8) % (sizeof(text) - 1)];
+        }
+    }
+    memcpy(s, num, numLen < len ? numLen : len);
+    s[len] = '\0';
+    return s;
+}
+
+/*** benchmark ***/
+
+void benchRows(int rows, int len, int tabs) {
+    char **line = (char **)malloc(sizeof(char *) * rows);
+    unsigned int seed = 1;
+    struct benchMark m;
+    int j;
+
+    for (j = 0; j < rows; j++) {
+        line[j] = benchLine(j, len, tabs, &seed);
+    }
+
+    initEditor();
+    E.headless = 1;
+    E.journalSuspended = 1;
+    E.undoSuspended = 1;
+    E.fileName = strdup("bench.c");
+    editorSelectSyntaxHighlight();
+
+    startBench(&m);
+    for (j = 0; j < rows; j++) {
+        insertEditorRow(E.numRows, line[j], len);
+    }
+    reportBench(&m, "insertEditorRow", len, tabs, rows);
+
+    startBench(&m);
+    for (j = 0; j < rows; j++) {
+        insertEditorRowCharacter(getEditorRow(j), len / 2, 'x');
+    }
+    reportBench(&m, "insertEditorRowChar", len, tabs, rows);
+
+    startBench(&m);
+    for (j = 0; j < rows; j++) {
+        delEditorRowChar(getEditorRow(j), len / 2);
+    }
+    reportBench(&m, "delEditorRowChar", len, tabs, rows);
+
+    startBench(&m);
+    for (j = 0; j < rows; j++) {
+        updateEditorRow(getEditorRow(j));
+    }
+    reportBench(&m, "updateEditorRow", len, tabs, rows);
+
+    startBench(&m);
+    for (j = 0; j < rows; j++) {
+        updateEditorSyntax(getEditorRow(j));
+    }
+    reportBench(&m, "updateEditorSyntax", len, tabs, rows);
+
+    // per row gathered, not per call.
+    startBench(&m);
+    for (j = 0; j < BENCH_TO_STRING; j++) {
+        int bufLen;
+        free(editorRowsToString(&bufLen));
+    }
+    reportBench(&m, "editorRowsToString", len, tabs, (long)rows * BENCH_TO_STRING);
+
+    startBench(&m);
+    for (j = 0; j < rows; j++) {
+        delEditorRow(E.numRows - 1);
+    }
+    reportBench(&m, "delEditorRow", len, tabs, rows);
+
+    freeEditor();
+    for (j = 0; j < rows; j++) {
+        free(line[j]);
+    }
+    free(line);
+}
+
+int main(int argc, char *argv[]) {
+    static const int lens[] = {8, 80, 1000};
+    static const int tabs[] = {0, 10, 50};
+    int rows = (argc > 1) ? atoi(argv[1]) : BENCH_ROWS;
+    int l;
+    int t;
+
+    if (rows < 1) {
+        fprintf(stderr, "usage: rowbench [rows]\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-20s %5s %5s %10s %10s\n", "op", "len", "tabs", "ns/op", "allocs/op");
+    for (l = 0; l < (int)(sizeof(lens) / sizeof(lens[0])); l++) {
+        for (t = 0; t < (int)(sizeof(tabs) / sizeof(tabs[0])); t++) {
+            benchRows(rows, lens[l], tabs[t]);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,495 @@
+/* Differential fuzzer of the row operations.
+ *
+ * Random edits are made both to the editor rows and to a plain array of
+ * strings, and after every edit the rows are checked against the array: the
+ * text, the render, the carried highlight states and, for rows in memory,
+ * the colors, which must be those of highlighting the whole array from the
+ * top, and the sums in the bracket, wrap and byte trees. Lines are often repeated, so shared lines and their copy on edit are
+ * exercised too, and runs of rows are packed cold and brought back in.
+ *
+ *   rowfuzz [-s seed] [-n steps]
+ */
+
+/*** includes ***/
+
+#define MACHO_LIBRARY
+#include "../macho.c"
+
+/*** defines ***/
+
+#define FUZZ_MAX_ROWS 96        // the model is kept around this size.
+#define FUZZ_MAX_LEN 40         // longest random line.
+#define FUZZ_ROUND 2000         // steps before the editor is started afresh.
+
+/*** data ***/
+
+struct fuzzModel {
+    char **line;
+    int *len;
+    int numLines;
+};
+
+struct fuzzModel M;
+uint64_t fuzzState;
+unsigned int fuzzSeed;
+long fuzzStep;
+char fuzzOp[128];           // the last edit, printed when a check fails.
+
+// short lines that turn up often, so rows share them.
+const char *fuzzCommon[] = {
+    "", "}", "\t{", "\treturn 0;", "/*", " */", "\"", "\t\t// x", "int j;", "\t",
+};
+
+/*** random ***/
+
+// xorshift64*, the same steps for the same seed on every machine.
+uint32_t fuzzRandom() {
+    fuzzState ^= fuzzState >> 12;
+    fuzzState ^= fuzzState << 25;
+    fuzzState ^= fuzzState >> 27;
+    return (uint32_t)((fuzzState * 2685821657736338717ULL) >> 32);
+}
+
+int fuzzBelow(int n) {
+    return n > 0 ? (int)(fuzzRandom() % (uint32_t)n) : 0;
+}
+
+// a character of C-like text, with the ones that change the carried state
+// (comments, strings) and the brackets more likely than others.
+int fuzzChar() {
+    static const char special[] = "\t{}()[]\"'/*\\ ";
+    if (fuzzBelow(3) == 0) {
+        return special[fuzzBelow(sizeof(special) - 1)];
+    }
+    return "abcdefghijklmnopqrstuvwxyz0123456789_;,=+"[fuzzBelow(41)];
+}
+
+// fills s with a new line and returns its length.
+int fuzzLine(char *s) {
+    int pick = fuzzBelow(8);
+    int from = fuzzBelow(M.numLines);
+    int len;
+    int j;
+
+    // a copy of a line already there, unless edits made it too long.
+    if (pick == 0 && M.numLines > 0 && M.len[from] <= FUZZ_MAX_LEN) {
+        memcpy(s, M.line[from], M.len[from]);
+        return M.len[from];
+    }
+    if (pick <= 2) {
+        const char *common = fuzzCommon[fuzzBelow(sizeof(fuzzCommon) / sizeof(fuzzCommon[0]))];
+        len = strlen(common);
+        memcpy(s, common, len);
+        return len;
+    }
+    len = fuzzBelow(FUZZ_MAX_LEN + 1);
+    for (j = 0; j < len; j++) {
+        s[j] = fuzzChar();
+    }
+    return len;
+}
+
+/*** model ***/
+
+void insertModelLine(int at, const char *s, int len) {
+    M.line = (char **)realloc(M.line, sizeof(char *) * (M.numLines + 1));
+    M.len = (int *)realloc(M.len, sizeof(int) * (M.numLines + 1));
+    memmove(&M.line[at + 1], &M.line[at], sizeof(char *) * (M.numLines - at));
+    memmove(&M.len[at + 1], &M.len[at], sizeof(int) * (M.numLines - at));
+    M.line[at] = (char *)malloc(len + 1);
+    memcpy(M.line[at], s, len);
+    M.len[at] = len;
+    M.numLines++;
+}
+
+void delModelLine(int at) {
+    free(M.line[at]);
+    memmove(&M.line[at], &M.line[at + 1], sizeof(char *) * (M.numLines - at - 1));
+    memmove(&M.len[at], &M.len[at + 1], sizeof(int) * (M.numLines - at - 1));
+    M.numLines--;
+}
+
+void insertModelChar(int row, int at, int c) {
+    M.line[row] = (char *)realloc(M.line[row], M.len[row] + 2);
+    memmove(&M.line[row][at + 1], &M.line[row][at], M.len[row] - at);
+    M.line[row][at] = c;
+    M.len[row]++;
+}
+
+void delModelChar(int row, int at) {
+    memmove(&M.line[row][at], &M.line[row][at + 1], M.len[row] - at - 1);
+    M.len[row]--;
+}
+
+void appendModelString(int row, const char *s, int len) {
+    M.line[row] = (char *)realloc(M.line[row], M.len[row] + len + 1);
+    memcpy(&M.line[row][M.len[row]], s, len);
+    M.len[row] += len;
+}
+
+void freeModel() {
+    while (M.numLines > 0) {
+        delModelLine(M.numLines - 1);
+    }
+}
+
+// tabs expanded to the tab stop, written by hand rather than with
+// renderEditorChars so the two can disagree.
+char *renderModelLine(int row, int *rsize) {
+    char *render = (char *)malloc(M.len[row] * MACHO_TAB_STOP + 1);
+    int len = 0;
+    int j;
+
+    for (j = 0; j < M.len[row]; j++) {
+        if (M.line[row][j] == '\t') {
+            do {
+                render[len++] = ' ';
+            } while (len % MACHO_TAB_STOP != 0);
+        } else {
+            render[len++] = M.line[row][j];
+        }
+    }
+    *rsize = len;
+    return render;
+}
+
+/*** checks ***/
+
+void fuzzFail(const char *fmt, ...) {
+    va_list ap;
+
+    fprintf(stderr, "rowfuzz: seed %u, step %ld, after %s: ", fuzzSeed, fuzzStep, fuzzOp);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+// every shared line is held by exactly the resident rows pointing at it,
+// and the table holds no others.
+void checkEditorLines() {
+    struct internLine **seen = (struct internLine **)malloc(sizeof(*seen) * (E.numRows + 1));
+    int *refs = (int *)malloc(sizeof(int) * (E.numRows + 1));
+    int numSeen = 0;
+    int at;
+    int j;
+
+    for (at = 0; at < E.numRows; at++) {
+        editorRow *row = &E.row[at];
+        struct internLine *line = row->cold ? NULL : editorRowLine(row);
+
+        if (line == NULL) {
+            continue;
+        }
+        if (line->size != row->size || line->rsize != row->rsize || row->render != line->render) {
+            fuzzFail("row %d does not match its shared line", at);
+        }
+        for (j = 0; j < numSeen && seen[j] != line; j++) {
+        }
+        if (j == numSeen) {
+            seen[numSeen] = line;
+            refs[numSeen++] = 0;
+        }
+        refs[j]++;
+    }
+    for (j = 0; j < numSeen; j++) {
+        if (seen[j]->refs != refs[j]) {
+            fuzzFail("a shared line has %d references, %d rows use it", seen[j]->refs, refs[j]);
+        }
+    }
+    if (E.internCount != numSeen) {
+        fuzzFail("%d lines are shared, the table counts %d", numSeen, E.internCount);
+    }
+    free(seen);
+    free(refs);
+}
+
+// the chunks cover the rows, and every sum in the bracket, wrap and byte
+// trees is that of the rows below it.
+void checkEditorTrees() {
+    struct bracketNode brackets;
+    int lines = 0;
+    long long bytes = 0;
+    int first = 0;
+    int at;
+    int j;
+
+    rebuildEditorBrackets();
+    rebuildEditorWraps();
+    rebuildEditorBytes();
+
+    if (E.chunkTree[1] != E.numRows) {
+        fuzzFail("the chunks hold %d rows", E.chunkTree[1]);
+    }
+    for (j = 0; j < E.chunkSize; j++) {
+        int rows = editorChunkRows(j);
+        int i = E.chunkSize + j;
+
+        if ((j < E.numChunks) ? (rows < 1 || rows > 2 * MACHO_CHUNK_ROWS) : rows != 0) {
+            fuzzFail("chunk %d of %d holds %d rows", j, E.numChunks, rows);
+        }
+        sumEditorBracketChunk(first, rows, &brackets);
+        if (memcmp(&brackets, &E.bracketTree[i], sizeof(brackets)) != 0) {
+            fuzzFail("chunk %d has the wrong brackets", j);
+        }
+        if (E.wrapTree[i] != sumEditorWrapChunk(first, rows) || E.byteTree[i] != sumEditorByteChunk(first, rows)) {
+            fuzzFail("chunk %d has the wrong screen lines or bytes", j);
+        }
+        first += rows;
+    }
+    for (j = E.chunkSize - 1; j >= 1; j--) {
+        brackets = E.bracketTree[2 * j];
+        addBracketNode(&brackets, &E.bracketTree[2 * j + 1]);
+        if (E.chunkTree[j] != E.chunkTree[2 * j] + E.chunkTree[2 * j + 1] ||
+            memcmp(&brackets, &E.bracketTree[j], sizeof(brackets)) != 0 ||
+            E.wrapTree[j] != E.wrapTree[2 * j] + E.wrapTree[2 * j + 1] ||
+            E.byteTree[j] != E.byteTree[2 * j] + E.byteTree[2 * j + 1]) {
+            fuzzFail("node %d is not the sum of the two below", j);
+        }
+    }
+
+    for (at = 0; at < E.numRows; at++) {
+        long long col;
+        int seg;
+
+        if (editorWrapLineOf(at) != lines || findEditorWrapLine(lines, &seg) != at) {
+            fuzzFail("row %d is not at screen line %d", at, lines);
+        }
+        if (findEditorOffset(bytes, &col) != at || col != 0) {
+            fuzzFail("row %d is not at byte %lld", at, bytes);
+        }
+        lines += editorRowWrapLines(at);
+        bytes += E.row[at].size + 1;
+    }
+}
+
+void checkEditorRows() {
+    unsigned char *highlight = NULL;
+    int state = HL_STATE_NORMAL;
+    int at;
+
+    if (E.numRows != M.numLines) {
+        fuzzFail("%d rows, the model has %d", E.numRows, M.numLines);
+    }
+    if (E.hlPending != 0) {
+        fuzzFail("%d rows wait for colors", E.hlPending);
+    }
+
+    for (at = 0; at < E.numRows; at++) {
+        editorRow *row = &E.row[at];
+        int rsize;
+        char *render = renderModelLine(at, &rsize);
+
+        if (row->size != M.len[at] || memcmp(peekEditorRow(row), M.line[at], M.len[at]) != 0) {
+            fuzzFail("row %d is \"%.*s\", the model has \"%.*s\"", at,
+                row->size, peekEditorRow(row), M.len[at], M.line[at]);
+        }
+        if (!row->cold && row->chars[row->size] != '\0') {
+            fuzzFail("row %d is not nul terminated", at);
+        }
+        if (row->rsize != rsize) {
+            fuzzFail("row %d renders to %d bytes, %d expected", at, row->rsize, rsize);
+        }
+        if (memcmp(peekEditorRowRender(row), render, rsize) != 0) {
+            fuzzFail("row %d renders to \"%.*s\"", at, rsize, peekEditorRowRender(row));
+        }
+        if (row->hlDone != row->hlSerial) {
+            fuzzFail("row %d has no colors", at);
+        }
+
+        highlight = (unsigned char *)realloc(highlight, rsize + 1);
+        if (row->hlStartState != state) {
+            fuzzFail("row %d is highlighted from state %d, %d expected", at, row->hlStartState, state);
+        }
+        state = highlightEditorRender(E.syntax, state, render, rsize, highlight);
+        if (row->hlEndState != state) {
+            fuzzFail("row %d carries state %d, %d expected", at, row->hlEndState, state);
+        }
+        if (!row->cold && memcmp(row->highlight, highlight, rsize) != 0) {
+            fuzzFail("row %d has the wrong colors", at);
+        }
+        free(render);
+    }
+    free(highlight);
+
+    int bufLen;
+    char *buf = editorRowsToString(&bufLen);
+    char *p = buf;
+    for (at = 0; at < M.numLines; at++) {
+        if (memcmp(p, M.line[at], M.len[at]) != 0 || p[M.len[at]] != '\n') {
+            fuzzFail("line %d of the text differs", at);
+        }
+        p += M.len[at] + 1;
+    }
+    if (p - buf != bufLen) {
+        fuzzFail("the text is %d bytes, %ld expected", bufLen, (long)(p - buf));
+    }
+    free(buf);
+
+    checkEditorLines();
+    checkEditorTrees();
+}
+
+/*** edits ***/
+
+void fuzzEdit() {
+    char s[FUZZ_MAX_LEN + 1];
+    int grow = M.numLines < FUZZ_MAX_ROWS;
+    int op = fuzzBelow(11);
+    int at;
+    int len;
+
+    if (M.numLines == 0) {
+        op = 0;
+    }
+    at = fuzzBelow(M.numLines);
+
+    switch (op) {
+        case 0:
+        case 1:
+            if (!grow) {
+                goto del;
+            }
+            at = fuzzBelow(M.numLines + 1);
+            len = fuzzLine(s);
+            snprintf(fuzzOp, sizeof(fuzzOp), "insertEditorRow(%d, \"%.*s\")", at, len, s);
+            insertEditorRow(at, s, len);
+            insertModelLine(at, s, len);
+            break;
+
+        case 2:
+        del:
+            snprintf(fuzzOp, sizeof(fuzzOp), "delEditorRow(%d)", at);
+            delEditorRow(at);
+            delModelLine(at);
+            break;
+
+        case 3:
+        case 4: {
+            // positions past the end insert at the end.
+            int pos = fuzzBelow(M.len[at] + 3) - 1;
+            int c = fuzzChar();
+            snprintf(fuzzOp, sizeof(fuzzOp), "insertEditorRowCharacter(%d, %d, '%c')", at, pos, c);
+            insertEditorRowCharacter(getEditorRow(at), pos, c);
+            insertModelChar(at, (pos < 0 || pos > M.len[at]) ? M.len[at] : pos, c);
+            break;
+        }
+
+        case 5:
+        case 6: {
+            // positions out of the row are ignored.
+            int pos = fuzzBelow(M.len[at] + 2) - 1;
+            snprintf(fuzzOp, sizeof(fuzzOp), "delEditorRowChar(%d, %d)", at, pos);
+            delEditorRowChar(getEditorRow(at), pos);
+            if (pos >= 0 && pos < M.len[at]) {
+                delModelChar(at, pos);
+            }
+            break;
+        }
+
+        case 7:
+            if (fuzzBelow(2)) {
+                len = fuzzLine(s);
+                snprintf(fuzzOp, sizeof(fuzzOp), "appendEditorRowString(%d, \"%.*s\")", at, len, s);
+                appendEditorRowString(getEditorRow(at), s, len);
+                appendModelString(at, s, len);
+            } else {
+                int pos = fuzzBelow(M.len[at] + 1);
+                snprintf(fuzzOp, sizeof(fuzzOp), "truncateEditorRow(%d, %d)", at, pos);
+                truncateEditorRow(getEditorRow(at), pos);
+                M.len[at] = pos;
+            }
+            break;
+
+        case 8: {
+            // packs a run of rows, as idle time does in large files.
+            int end = at + 1 + fuzzBelow(M.numLines - at);
+            int j;
+            for (j = at; j < end && isEditorRowPackable(&E.row[j]); j++) {
+            }
+            snprintf(fuzzOp, sizeof(fuzzOp), "freezeEditorRows(%d, %d)", at, j);
+            if (j > at) {
+                freezeEditorRows(at, j);
+            }
+            break;
+        }
+
+        case 9: {
+            // copies a run of rows and pastes it elsewhere, as Ctrl-C and
+            // Ctrl-V do.
+            int count = 1 + fuzzBelow(M.numLines - at);
+            int to = fuzzBelow(M.numLines + 1);
+            int j;
+            if (!grow) {
+                count = 1;
+            }
+            snprintf(fuzzOp, sizeof(fuzzOp), "pasteEditorClip(%d, makeEditorClip(%d, %d))", to, at, count);
+            struct editorClip *clip = makeEditorClip(at, count);
+            pasteEditorClip(to, clip);
+            releaseEditorClip(clip);
+            for (j = 0; j < count; j++) {
+                int from = (at + j < to) ? at + j : at + j + j;
+                insertModelLine(to + j, M.line[from], M.len[from]);
+            }
+            break;
+        }
+
+        default:
+            snprintf(fuzzOp, sizeof(fuzzOp), "updateEditorSyntax(%d)", at);
+            updateEditorSyntax(getEditorRow(at));
+            break;
+    }
+}
+
+/*** init ***/
+
+// a fresh editor with no terminal, journal or undo. every other round has
+// no syntax, so rows are also checked with blank colors.
+void startFuzzEditor(int round) {
+    initEditor();
+    E.headless = 1;
+    E.journalSuspended = 1;
+    E.undoSuspended = 1;
+    if (round % 2 == 0) {
+        E.fileName = strdup("fuzz.c");
+        editorSelectSyntaxHighlight();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long steps = 100000;
+    int j;
+
+    fuzzSeed = (unsigned int)time(NULL);
+    for (j = 1; j < argc; j++) {
+        if (strcmp(argv[j], "-s") == 0 && j + 1 < argc) {
+            fuzzSeed = (unsigned int)strtoul(argv[++j], NULL, 10);
+        } else if (strcmp(argv[j], "-n") == 0 && j + 1 < argc) {
+            steps = strtol(argv[++j], NULL, 10);
+        } else {
+            fprintf(stderr, "usage: rowfuzz [-s seed] [-n steps]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    fuzzState = 0x9e3779b97f4a7c15ULL ^ fuzzSeed;
+
+    startFuzzEditor(0);
+    for (fuzzStep = 1; fuzzStep <= steps; fuzzStep++) {
+        fuzzEdit();
+        checkEditorRows();
+
+        if (fuzzStep % FUZZ_ROUND == 0) {
+            freeEditor();
+            freeModel();
+            startFuzzEditor(fuzzStep / FUZZ_ROUND);
+        }
+    }
+    freeEditor();
+    freeModel();
+    free(M.line);
+    free(M.len);
+
+    printf("rowfuzz: seed %u, %ld steps passed\n", fuzzSeed, steps);
+    return EXIT_SUCCESS;
+}